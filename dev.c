@@ -35,6 +35,7 @@
 
 #include "softdevice_handler.h"
 #include "app_timer.h"
+#include "app_util_platform.h"
 #include "app_gpiote.h"
 #include "app_button.h"
 #include "twi_master.h"
@@ -43,10 +44,14 @@
 #include "ble_conn_params.h"
 #include "ble_gap.h"
 #include "ble_hci.h"
+#include "ble_radio_notification.h"
+#include "device_manager.h"
+#include "pstorage.h"
 
 #include "app_trace.h"
 
 #include "st7032i.h"
+#include "rcs730.h"
 
 
 /**************************************************************************
@@ -62,7 +67,7 @@
  * Include or not the service_changed characteristic.
  * if not enabled, the server's database cannot be changed for the lifetime of the device
  */
-#define IS_SRVC_CHANGED_CHARACT_PRESENT (0)
+#define IS_SRVC_CHANGED_CHARACT_PRESENT (1)
 
 
 /*
@@ -85,8 +90,8 @@
 /** ボタンが使用するタイマ数(ボタンを使うなら1、使わないなら0) */
 #define APP_TIMER_NUM_BUTTON            (0)
 
-/** ユーザアプリで使用するタイマ数 */
-#define APP_TIMER_NUM_USERAPP           (0)
+/** ユーザアプリで使用するタイマ数(Connectionパラメータ切り替え, テレメトリ通知, RTC1維持, IRQ再処理) */
+#define APP_TIMER_NUM_USERAPP           (4)
 
 /** 同時に生成する最大タイマ数 */
 #define APP_TIMER_MAX_TIMERS            (APP_TIMER_NUM_BLE+APP_TIMER_NUM_BUTTON+APP_TIMER_NUM_USERAPP)
@@ -94,6 +99,17 @@
 /** Size of timer operation queues. */
 #define APP_TIMER_OP_QUEUE_SIZE         (4)
 
+/** RTC1を動かし続けるタイマの周期[ms]
+ *
+ * app_timerは動いているタイマがないとRTC1を止めてクリアするため、
+ * app_timer_cnt_get()による時間計測用に常に1つ動かしておく。
+ * 24bitカウンタ(512秒)の半分以下にして、スリープ時間の計算が折り返さないようにする。
+ */
+#define TIMER_TICK_KEEP_INTERVAL        (128000)
+
+/** スケジューラからのIRQ再処理を諦めてから、再度処理するまでの時間[ms] */
+#define TIMER_RF_RETRY_INTERVAL         (10)
+
 /*
  * GPIOTEおよびButton
  */
@@ -105,16 +121,53 @@
 
 /*
  * Scheduler
+ *  優先度(dev_prio_t)毎のキュー。
+ *  dev_event_exec()は優先度の高いキューから1つずつ取り出し、実行の度に選び直す。
+ *  同じハンドラ・引数のイベントが実行待ちなら、新たに積まずにまとめる。
+ *  キューがいっぱいならイベントを破棄して数え、NRF_ERROR_NO_MEMを返す(停止はしない)。
  */
+#define SCHED_QUEUE_SIZE_RF             (4)     ///< DEV_PRIO_RFの段数
+#define SCHED_QUEUE_SIZE_BLE            (8)     ///< DEV_PRIO_BLEの段数
+#define SCHED_QUEUE_SIZE_UI             (2)     ///< DEV_PRIO_UIの段数
+#define SCHED_QUEUE_SIZE_HK             (4)     ///< DEV_PRIO_HOUSEKEEPINGの段数
 
-/**
- * Maximum size of scheduler events.
- * Note that scheduler BLE stack events do not contain any data, as the events are being pulled from the stack in the event handler.
+/** 待ち時間ヒストグラムの区間数(1ms未満, 4ms未満, 16ms未満, 64ms未満, 64ms以上) */
+#define SCHED_WAIT_HIST_NUM             (5)
+
+/*
+ * I2C
+ *   I2C(twi_sw_master)はCPUでピンを動かすので、途中でSoftDeviceの無線イベントが入ると
+ *   その分クロックが伸び、RC-S730やLCDのリトライやタイムアウトの原因になる。
+ *   無線イベントの通知(Radio Notification)を受け、通知から無線イベント終了までは
+ *   DEV_PRIO_UIとDEV_PRIO_HOUSEKEEPINGのイベントを実行せずに待たせる。
+ *   RFの応答(IRQ処理)は待たせない。
+ *   dev_bus_begin()～dev_bus_end()の間に無線イベントが入った回数を、利用者毎に数える。
+ */
+/* 無線イベントの何us前に通知するか */
+#define RADIO_NOTIFICATION_DISTANCE     NRF_RADIO_NOTIFICATION_DISTANCE_800US
+
+/*
+ * Profiler
+ *   スケジューラで実行したハンドラ毎の実行回数・実行時間と、
+ *   mainloopの実行時間・スリープ時間(CPU使用率)を数える。
+ *   時間はRTC1のカウント(1count = 約30.5us)なので、短いハンドラは0になることがある。
+ *   CPU使用率はPROF_WINDOW_NUM区間の移動窓で、1区間はPROF_WINDOW_TICKS
+ *   (長く寝ていたときは、はみ出した分を次の区間以降に寝ていた時間として入れる)。
+ *   結果はテレメトリのFPS_TELEM_CMD_PROFILEでログ(UART)に出力し、FPS_TELEM_CMD_RESETで0に戻す。
+ *   リリースビルド(NDEBUG定義時)は無効。
  */
-#define SCHED_MAX_EVENT_DATA_SIZE       sizeof(app_timer_event_t)
+#ifndef NDEBUG
+#define DEV_PROFILE
+#endif  //NDEBUG
+
+/* 数えるハンドラの種類 */
+#define PROF_HANDLER_NUM                (12)
+
+/* CPU使用率の移動窓の区間数 */
+#define PROF_WINDOW_NUM                 (8)
 
-/** Maximum number of events in the scheduler queue. */
-#define SCHED_QUEUE_SIZE                (10)
+/* CPU使用率の移動窓の1区間[RTC1 tick] */
+#define PROF_WINDOW_TICKS               APP_TIMER_TICKS(1000, APP_TIMER_PRESCALER)
 
 /*
  * Appearance設定
@@ -128,12 +181,81 @@
 
 /*
  * BLE : Advertising
+ *   起動直後や切断直後はすぐに(再)接続されることが多いので、短い間隔から始めて
+ *   タイムアウト毎に間隔を延ばす。IDLEもタイムアウトしたらSystem OFFにし、
+ *   RC-S730のIRQで起動し直す。
+ *   切断後、Bonding済みの相手が分かっていれば、最初にその相手へDirected Advertisingする。
+ *
+ *   phase  interval    timeout     平均電流(model)     接続までの時間(model)
+ *   DIRECT 3.75ms以下  1.28sec     約3mA               数ms (High Duty Cycle)
+ *   FAST   40ms        30sec       約250uA             約25ms
+ *   SLOW   1000ms      150sec      約13uA              約0.5sec
+ *   IDLE   5000ms      3600sec     約5uA               約2.5sec
+ *   BURST  20ms        1sec        約500uA             約15ms  (RFイベント後。ADV_BCAST_RF_EVENT)
+ *   (OFF)  -           -           約1uA               Readerにかざして起動
+ *
+ *   平均電流 = ADV_MODEL_EVT_CHARGE / interval + ADV_MODEL_SLEEP_CURRENT
+ *   接続までの時間 = interval / 2 + advDelay(平均5ms)   (Centralが常にscanしている場合)
+ */
+/* FAST : Advertising間隔[msec単位] */
+#define APP_ADV_FAST_INTERVAL           (40)
+
+/* FAST : タイムアウト時間[sec単位] */
+#define APP_ADV_FAST_TIMEOUT            (30)
+
+/* SLOW : Advertising間隔[msec単位] */
+#define APP_ADV_SLOW_INTERVAL           (1000)
+
+/* SLOW : タイムアウト時間[sec単位] */
+#define APP_ADV_SLOW_TIMEOUT            (150)
+
+/* IDLE : Advertising間隔[msec単位] */
+#define APP_ADV_IDLE_INTERVAL           (5000)
+
+/* IDLE : タイムアウト時間[sec単位](0:無し) */
+#define APP_ADV_IDLE_TIMEOUT            (3600)
+
+/*
+ * BLE : RFイベントのブロードキャスト
+ *   最後のRFイベントの要約をAdvertisingデータのManufacturer Specific Dataに載せ、
+ *   Centralが接続しなくてもscanだけでイベントを知れるようにする。
+ *   イベント毎にseqを+1し、BURSTフェーズ(短い間隔)でしばらくAdvertisingしてから元のフェーズに戻る。
+ *   接続中はAdvertisingしないので、FPSのNotificationだけになる。
+ *   DIRECTフェーズ中はBURSTにせず、DIRECTが終わってからBURSTにする。
+ *   コメントアウト時はイベントを載せない(Advertisingデータは完全なデバイス名)。
+ *   company IDがテスト用なので、デフォルトは無効。
+ *
+ *   Manufacturer Specific Data
+ *      [0-1]company ID [2]seq [3]cmd [4]status [5-12]IDm [13-14]service code
+ *      cmd     : Readerのコマンドコード(0x06:Read w/o Enc, 0x08:Write w/o Enc)
+ *      status  : ST2(0:正常)
+ *      service : 最初のブロックのサービスコード(不明時0xffff)
+ *
+ *   AD全体が31byteに収まるよう、デバイス名は短縮形(GAP_SHORT_NAME_LEN文字)にする。
+ *   flags(3) + manufacturer(4+13) + 短縮名(2+8) = 30byte
  */
-/* Advertising間隔[msec単位] */
-#define APP_ADV_INTERVAL                (1000)
+//#define ADV_BCAST_RF_EVENT
 
-/* Advertisingタイムアウト時間[sec単位] */
-#define APP_ADV_TIMEOUT_IN_SECONDS      (60)
+/* company ID(0xffff:テスト用。製品ではBluetooth SIGで割り当てられたIDにすること) */
+#define ADV_BCAST_COMPANY_ID            (0xffff)
+
+/* Manufacturer Specific Dataの長さ(company ID除く) */
+#define ADV_BCAST_DATA_LEN              (13)
+
+/* Advertisingデータに載せるデバイス名の長さ */
+#define GAP_SHORT_NAME_LEN              (8)
+
+/* BURST : Advertising間隔[msec単位] */
+#define APP_ADV_BURST_INTERVAL          (20)
+
+/* BURST : タイムアウト時間[sec単位] */
+#define APP_ADV_BURST_TIMEOUT           (1)
+
+/* model : Advertisingイベント(3ch, ADV_IND + SCAN_RSP)1回の電荷[nC] */
+#define ADV_MODEL_EVT_CHARGE            (10000)
+
+/* model : Advertisingイベント以外の平均電流[nA] */
+#define ADV_MODEL_SLEEP_CURRENT         (2600)
 
 /*
  * Peripheral Preferred Connection Parameters(PPCP)
@@ -179,6 +301,24 @@
 /** Connectionパラメータ交換を諦めるまでの試行回数 */
 #define CONN_MAX_PARAMS_UPDATE_COUNT    (3)
 
+/*
+ * Connectionパラメータ(高速モード)
+ *   RFやGATTの通信が始まったら短いConnection間隔に切り替え、
+ *   CONN_FAST_IDLE_TIMEOUTの間通信が無ければPPCP(省電力)に戻す。
+ *   通信が無いときはslave latencyでConnectionイベントを読み飛ばして消費電流を抑える。
+ */
+/* 最小時間[msec単位] */
+#define CONN_FAST_MIN_INTERVAL          (7.5)
+
+/* 最大時間[msec単位] */
+#define CONN_FAST_MAX_INTERVAL          (30)
+
+/* slave latency */
+#define CONN_FAST_SLAVE_LATENCY         (10)
+
+/* 通信が無くなってからPPCPに戻すまでの時間[msec単位] */
+#define CONN_FAST_IDLE_TIMEOUT          (5000)
+
 /*
  * BLE : Security
  */
@@ -186,7 +326,7 @@
 #define SEC_PARAM_TIMEOUT               (30)
 
 /** 1:Bondingあり 0:なし */
-#define SEC_PARAM_BOND                  (0)
+#define SEC_PARAM_BOND                  (1)
 
 /** 1:ペアリング時の認証あり 0:なし */
 #define SEC_PARAM_MITM                  (0)
@@ -211,19 +351,38 @@
 
 
 //設定値のチェック
-#if (APP_ADV_INTERVAL < 20)
+#if (APP_ADV_FAST_INTERVAL < 20)
 #error connInterval(Advertising) too small.
-#elif (APP_ADV_INTERVAL < 100)
-#warning connInterval(Advertisin) is too small in non-connectable mode
-#elif (10240 < APP_ADV_INTERVAL)
+#elif (100 < APP_ADV_FAST_INTERVAL)
+#error connInterval(Advertising fast) must be 20-100msec.
+#endif  //APP_ADV_FAST_INTERVAL
+
+#if (APP_ADV_SLOW_INTERVAL <= APP_ADV_FAST_INTERVAL) || (APP_ADV_IDLE_INTERVAL <= APP_ADV_SLOW_INTERVAL)
+#error connInterval(Advertising) must be longer in later phase.
+#elif (10240 < APP_ADV_IDLE_INTERVAL)
 #error connInterval(Advertising) too large.
-#endif  //APP_ADV_INTERVAL
+#endif  //APP_ADV_xxx_INTERVAL
 
-#if (APP_ADV_TIMEOUT_IN_SECONDS == BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED)
-//OK
-#elif (BLE_GAP_ADV_TIMEOUT_LIMITED_MAX < APP_ADV_TIMEOUT_IN_SECONDS)
-#warning Advertising Timeout is too large in limited discoverable mode
-#endif  //APP_ADV_TIMEOUT_IN_SECONDS
+//SoftDeviceとタイマはイベントがまとまるので、ハンドラの種類だけあれば溢れない
+#if (SCHED_QUEUE_SIZE_BLE < APP_TIMER_MAX_TIMERS + 1)
+#error SCHED_QUEUE_SIZE_BLE must be larger than APP_TIMER_MAX_TIMERS.
+#endif  //SCHED_QUEUE_SIZE_BLE
+
+#if (APP_ADV_FAST_TIMEOUT == 0) || (APP_ADV_SLOW_TIMEOUT == 0)
+#error Advertising Timeout is needed except IDLE phase.
+#elif (BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED != APP_ADV_IDLE_TIMEOUT) && (0x3fff < APP_ADV_IDLE_TIMEOUT)
+#error Advertising Timeout too large.
+#endif  //APP_ADV_xxx_TIMEOUT
+
+#if (APP_ADV_BURST_INTERVAL < 20) || (APP_ADV_FAST_INTERVAL < APP_ADV_BURST_INTERVAL)
+#error connInterval(Advertising burst) must be 20msec - fast.
+#elif (APP_ADV_BURST_TIMEOUT == 0)
+#error Advertising Timeout is needed in BURST phase.
+#endif  //APP_ADV_BURST_xxx
+
+#if defined(ADV_BCAST_RF_EVENT) && defined(GAP_USE_APPEARANCE)
+#error Advertising data too large with Appearance and RF event.
+#endif  //ADV_BCAST_RF_EVENT && GAP_USE_APPEARANCE
 
 #if (CONN_MIN_INTERVAL * 1000 < 7500)
 #error connInterval_Min(Connection) too small.
@@ -255,11 +414,186 @@
 #error connSupervisionTimeout too small in manner.
 #endif
 
+#if (CONN_MIN_INTERVAL < CONN_FAST_MAX_INTERVAL)
+#error connInterval(fast) must be shorter than connInterval.
+#endif
+
+#if (BLE_GAP_CP_SLAVE_LATENCY_MAX < CONN_FAST_SLAVE_LATENCY)
+#error connSlaveLatency(fast) too large.
+#endif
+
+#if (CONN_SUP_TIMEOUT < CONN_FAST_MAX_INTERVAL * (CONN_FAST_SLAVE_LATENCY + 1) * 2)
+#error connSupervisionTimeout too small for fast mode.
+#endif
+
 
 /**************************************************************************
  * declaration
  **************************************************************************/
 
+/** Connectionパラメータのモード */
+typedef enum conn_mode_t {
+    CONN_MODE_IDLE,             ///< PPCP(省電力)
+    CONN_MODE_FAST,             ///< 高速
+    CONN_MODE_NUM
+} conn_mode_t;
+
+
+/** Advertisingのフェーズ */
+typedef enum adv_phase_t {
+    ADV_PHASE_DIRECT,           ///< Bonding済みの相手へDirected Advertising
+    ADV_PHASE_FAST,             ///< 短い間隔
+    ADV_PHASE_SLOW,             ///< 長い間隔
+    ADV_PHASE_IDLE,             ///< 低デューティ(タイムアウト無し)
+    ADV_PHASE_BURST,            ///< RFイベント直後の短い間隔(終わったら元のフェーズへ)
+    ADV_PHASE_NUM
+} adv_phase_t;
+
+
+/** Advertisingフェーズのパラメータ */
+typedef struct adv_phase_param_t {
+    uint16_t        interval;                   ///< Advertising間隔[msec](0:Directed)
+    uint16_t        timeout;                    ///< タイムアウト時間[sec](Directedでは無視)
+} adv_phase_param_t;
+
+
+/** Advertisingの状態 */
+typedef struct adv_sched_t {
+    adv_phase_t     phase;                      ///< 現在のフェーズ
+    uint32_t        start_ticks;                ///< ble_advertising_start()した時刻[RTC1 tick]
+    uint32_t        phase_start;                ///< 現在のフェーズを始めた時刻[RTC1 tick]
+    uint32_t        phase_ticks[ADV_PHASE_NUM]; ///< フェーズ毎のAdvertising時間[RTC1 tick]
+    uint32_t        connects[ADV_PHASE_NUM];    ///< フェーズ毎の接続回数
+    uint32_t        latency_max[ADV_PHASE_NUM]; ///< フェーズ毎の接続までの時間の最大[RTC1 tick]
+} adv_sched_t;
+
+
+/** RFイベントのブロードキャスト */
+typedef struct adv_bcast_t {
+    uint8_t         evt[ADV_BCAST_DATA_LEN];    ///< 最後のRFイベント(seqは更新時に付ける)
+    uint32_t        evt_ticks;                  ///< RFイベントの時刻[RTC1 tick]
+    bool            pending;                    ///< true:Advertisingデータ未更新
+    uint8_t         data[ADV_BCAST_DATA_LEN];   ///< Advertisingデータに載せている値
+    adv_phase_t     resume;                     ///< BURST後に戻るフェーズ
+    bool            deferred;                   ///< true:DIRECTフェーズの後でBURSTする
+    uint32_t        events;                     ///< RFイベント数
+    uint32_t        updates;                    ///< Advertisingデータの更新回数
+    uint32_t        connected;                  ///< 接続中で載せなかった回数
+    uint32_t        latency_sum;                ///< RFイベントから更新までの時間の合計[RTC1 tick]
+    uint32_t        latency_max;                ///< RFイベントから更新までの時間の最大[RTC1 tick]
+} adv_bcast_t;
+
+
+/** Connectionパラメータ切り替えの状態 */
+typedef struct conn_gov_t {
+    conn_mode_t     req;                        ///< 要求中のモード
+    conn_mode_t     cur;                        ///< Centralと合意したモード
+    bool            pending;                    ///< true:パラメータ更新待ち
+    uint32_t        req_ticks;                  ///< パラメータ更新を要求した時刻[RTC1 tick]
+    uint32_t        mode_start;                 ///< curの積算を始めた時刻[RTC1 tick]
+    uint32_t        mode_ticks[CONN_MODE_NUM];  ///< モード毎の滞在時間[RTC1 tick]
+    uint32_t        update_cnt;                 ///< パラメータ更新回数
+    uint32_t        update_last;                ///< 前回の更新にかかった時間[RTC1 tick]
+    uint32_t        update_max;                 ///< 更新にかかった時間の最大[RTC1 tick]
+    uint16_t        connect_interval;           ///< 接続時のConnection間隔[1.25msec]
+} conn_gov_t;
+
+
+/**
+ * 接続からNotification許可までのConnectionイベント数
+ *  [0]:サービス探索とCCCD書込みをした, [1]:Bonding情報から復元した
+ *  平均の差が、属性キャッシュで省略できた往復数の目安になる。
+ */
+typedef struct gatt_ready_stat_t {
+    uint32_t        events_sum[2];              ///< Connectionイベント数の合計
+    uint32_t        count[2];                   ///< 接続回数
+} gatt_ready_stat_t;
+
+
+/**
+ * テレメトリ
+ *  カウンタは積算を続け、リセット時の値との差をスナップショットにする。
+ *  時間はRTC1のカウント(1count = 約30.5us)。
+ */
+typedef struct telem_t {
+    uint32_t        base_irq;                   ///< リセット時のIRQ数
+    uint32_t        base_i2c_retries;           ///< リセット時のI2Cリトライ数
+    uint32_t        base_drops;                 ///< リセット時の送信キュー破棄数
+    uint16_t        rf_hist[FPS_TELEM_HIST_NUM];///< RF応答時間のヒストグラム
+    uint32_t        run_ticks;                  ///< 起きていた時間
+    uint32_t        sleep_ticks;                ///< sd_app_evt_wait()で寝ていた時間
+    uint32_t        wake_ticks;                 ///< 最後に起きた時刻
+    uint8_t         sched_depth;                ///< dev_sched_put()で積んで未実行のイベント数
+    uint8_t         sched_max;                  ///< sched_depthの最大値
+    uint32_t        sched_drops;                ///< キューがいっぱいで積めなかった回数
+    uint8_t         period;                     ///< Notification周期[sec](0:停止)
+} telem_t;
+
+
+/** スケジューラのイベント */
+typedef struct sched_evt_t {
+    dev_sched_handler_t handler;                ///< イベントハンドラ
+    void            *p_context;                 ///< ハンドラの引数
+    uint32_t        put_ticks;                  ///< 積んだ時刻
+} sched_evt_t;
+
+
+#ifdef DEV_PROFILE
+/** プロファイル:ハンドラ毎 */
+typedef struct prof_handler_t {
+    dev_sched_handler_t handler;                ///< ハンドラ(NULL:未使用)
+    uint32_t        count;                      ///< 実行回数
+    uint32_t        run_ticks;                  ///< 実行時間の合計
+    uint32_t        run_max;                    ///< 実行時間の最大値
+} prof_handler_t;
+
+
+/** プロファイル:CPU使用率の移動窓の1区間 */
+typedef struct prof_window_t {
+    uint32_t        run_ticks;                  ///< 起きていた時間
+    uint32_t        total_ticks;                ///< 区間の長さ
+} prof_window_t;
+
+
+/** プロファイル */
+typedef struct prof_t {
+    prof_handler_t  handler[PROF_HANDLER_NUM];  ///< ハンドラ毎
+    uint32_t        unknown;                    ///< handler[]に入らなかった実行回数
+    uint32_t        wakeups;                    ///< sd_app_evt_wait()から戻った回数
+    uint32_t        run_ticks;                  ///< 起きていた時間
+    uint32_t        sleep_ticks;                ///< 寝ていた時間
+    prof_window_t   window[PROF_WINDOW_NUM];    ///< CPU使用率の移動窓
+    uint8_t         window_idx;                 ///< 数えている区間
+} prof_t;
+#endif  //DEV_PROFILE
+
+
+/** スケジューラのキュー(優先度毎) */
+typedef struct sched_queue_t {
+    sched_evt_t     *p_evt;                     ///< バッファ
+    uint8_t         size;                       ///< 段数
+    uint8_t         rd;                         ///< 次に取り出す位置
+    uint8_t         cnt;                        ///< 実行待ちの数
+    uint8_t         cnt_max;                    ///< cntの最大値
+    bool            gap;                        ///< true:無線イベントの合間だけ実行する
+    uint32_t        merges;                     ///< 実行待ちのイベントにまとめた数
+    uint32_t        drops;                      ///< キューがいっぱいで破棄した数
+    uint32_t        wait_max;                   ///< 最大待ち時間[RTC1 tick]
+    uint16_t        wait_hist[SCHED_WAIT_HIST_NUM]; ///< 待ち時間のヒストグラム
+} sched_queue_t;
+
+
+/** I2Cと無線イベントの統計 */
+typedef struct bus_stat_t {
+    volatile bool       radio_active;           ///< true:無線イベント中(通知から終了まで)
+    volatile uint32_t   radio_events;           ///< 無線イベント数
+    uint32_t            held;                   ///< 無線イベント中でイベント実行を待たせた回数
+    uint32_t            bursts[DEV_BUS_NUM];    ///< 一連の転送の数
+    uint32_t            stretched[DEV_BUS_NUM]; ///< 途中で無線イベントが入った数
+    uint32_t            ticks_max[DEV_BUS_NUM]; ///< 一連の転送の最大時間
+} bus_stat_t;
+
+
 /** Handle of the current connection. */
 static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;
 
@@ -271,6 +605,66 @@ static ble_fps_t                        m_fps;
 
 static app_gpiote_user_id_t             m_gpiote_irq;
 
+/** true:System OFFからIRQで起動した */
+static bool                             m_resumed;
+
+static app_timer_id_t                   m_timer_conn_idle;
+static conn_gov_t                       m_conn_gov;
+
+static app_timer_id_t                   m_timer_telem;
+static telem_t                          m_telem;
+
+/** RTC1維持タイマ */
+static app_timer_id_t                   m_timer_tick;
+
+/** IRQ再処理タイマ */
+static app_timer_id_t                   m_timer_rf_retry;
+
+static sched_evt_t                      m_sched_evt_rf[SCHED_QUEUE_SIZE_RF];
+static sched_evt_t                      m_sched_evt_ble[SCHED_QUEUE_SIZE_BLE];
+static sched_evt_t                      m_sched_evt_ui[SCHED_QUEUE_SIZE_UI];
+static sched_evt_t                      m_sched_evt_hk[SCHED_QUEUE_SIZE_HK];
+static sched_queue_t                    m_sched[DEV_PRIO_NUM] = {
+    [DEV_PRIO_RF]           = { .p_evt = m_sched_evt_rf,  .size = SCHED_QUEUE_SIZE_RF  },
+    [DEV_PRIO_BLE]          = { .p_evt = m_sched_evt_ble, .size = SCHED_QUEUE_SIZE_BLE },
+    [DEV_PRIO_UI]           = { .p_evt = m_sched_evt_ui,  .size = SCHED_QUEUE_SIZE_UI, .gap = true },
+    [DEV_PRIO_HOUSEKEEPING] = { .p_evt = m_sched_evt_hk,  .size = SCHED_QUEUE_SIZE_HK, .gap = true },
+};
+
+#ifdef DEV_PROFILE
+static prof_t                           m_prof;
+#endif  //DEV_PROFILE
+
+static bus_stat_t                       m_bus;
+
+/** LCDに表示する文字列(lcd_show()) */
+static const char * volatile            m_lcd_str;
+
+static const adv_phase_param_t          m_adv_phase_param[ADV_PHASE_NUM] = {
+    { 0,                     0                    },
+    { APP_ADV_FAST_INTERVAL, APP_ADV_FAST_TIMEOUT },
+    { APP_ADV_SLOW_INTERVAL, APP_ADV_SLOW_TIMEOUT },
+    { APP_ADV_IDLE_INTERVAL, APP_ADV_IDLE_TIMEOUT },
+    { APP_ADV_BURST_INTERVAL, APP_ADV_BURST_TIMEOUT },
+};
+static adv_sched_t                      m_adv;
+#ifdef ADV_BCAST_RF_EVENT
+static adv_bcast_t                      m_bcast;
+#endif  //ADV_BCAST_RF_EVENT
+static gatt_ready_stat_t                m_gatt_ready;
+
+static dm_application_instance_t        m_app_handle;
+static ble_gap_addr_t                   m_peer_addr;    ///< 最後にBondingした相手(起動時はBondingテーブルから)
+static bool                             m_peer_valid;   ///< true:m_peer_addrが有効
+
+/** ブロックデータ(アプリ側メモリ) */
+static uint8_t                          *m_blk_buf;
+static uint8_t                          *m_blk_buf_shadow;
+static uint16_t                         m_blk_size;
+static uint8_t                          *m_blk_win;
+static uint8_t                          *m_blk_win_shadow;
+static uint16_t                         m_blk_win_size;
+
 
 /**************************************************************************
  * prototype
@@ -278,13 +672,28 @@ static app_gpiote_user_id_t             m_gpiote_irq;
 
 /* GPIO */
 static void gpio_init(void);
+static void system_off(void);
 
 /* Timer */
 static void timers_init(void);
+static void tick_timeout_handler(void *p_context);
+static void rf_retry_timeout_handler(void *p_context);
 //static void timers_start(void);
 
 /* Scheduler */
 static void scheduler_init(void);
+static void sched_execute(void);
+static void sched_wait_account(sched_queue_t *p_queue, uint32_t wait);
+static void sched_trace(void);
+#ifdef DEV_PROFILE
+static void prof_handler_account(dev_sched_handler_t handler, uint32_t start);
+static void prof_cpu_account(uint32_t run, uint32_t sleep);
+static void prof_reset(void);
+static void prof_dump(void);
+#endif  //DEV_PROFILE
+static uint32_t sd_evt_schedule(void);
+static void sd_evt_handler(void *p_context);
+static uint32_t timer_evt_schedule(app_timer_timeout_handler_t timeout_handler, void *p_context);
 
 /* GPIOTEおよびButton */
 static void gpiote_init(void);
@@ -292,11 +701,45 @@ static void gpiote_init(void);
 //static void button_event_handler(uint8_t pin_no, uint8_t button_event);
 
 static void ble_stack_init(void);
+static void device_manager_init(void);
+static bool peer_addr_directable(const ble_gap_addr_t *p_addr);
+static api_result_t device_manager_evt_handler(dm_handle_t const *p_handle,
+                                            dm_event_t const *p_event,
+                                            api_result_t event_result);
 
 static void conn_params_evt_handler(ble_conn_params_evt_t * p_evt);
 static void conn_params_error_handler(uint32_t nrf_error);
+static void conn_activity_handler(void *p_context);
+static void tx_flush_handler(void *p_context);
+static void conn_idle_timeout_handler(void *p_context);
+static void conn_mode_request(conn_mode_t mode);
+static void conn_mode_update(const ble_gap_conn_params_t *p_params);
+static void conn_mode_account(void);
+
+static void adv_phase_start(adv_phase_t phase);
+static void adv_phase_account(void);
+static void adv_data_set(void);
+#ifdef ADV_BCAST_RF_EVENT
+static void adv_bcast_handler(void *p_context);
+#endif  //ADV_BCAST_RF_EVENT
+static void gatt_ready_account(void);
+static void db_version_check(dm_handle_t const *p_handle, bool new_bond);
 
 static void svc_fps_handler_ndef(ble_fps_t *p_fps, const uint8_t *p_value, uint16_t length);
+static void svc_fps_handler_msg(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length);
+static void svc_fps_handler_bulk(ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+static void svc_fps_handler_write_begin(ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+static void svc_fps_handler_block(ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+static void svc_fps_telem_snapshot(ble_fps_t *p_fps, uint8_t *p_value);
+static void svc_fps_telem_handler(ble_fps_t *p_fps, const uint8_t *p_cmd, uint16_t length);
+
+static void telem_reset(void);
+static void telem_timeout_handler(void *p_context);
+
+static void lcd_update_handler(void *p_context);
+
+static void radio_notification_handler(bool radio_active);
+static void bus_trace(void);
 
 static void ble_evt_handler(ble_evt_t * p_ble_evt);
 static void ble_evt_dispatch(ble_evt_t * p_ble_evt);
@@ -310,6 +753,10 @@ static void sys_evt_dispatch(uint32_t sys_evt);
 
 void dev_init(void)
 {
+    //SoftDeviceを有効にするとNRF_POWERは直接触れなくなるので、先に読んでおく
+    m_resumed = (NRF_POWER->RESETREAS & POWER_RESETREAS_OFF_Msk) != 0;
+    NRF_POWER->RESETREAS = NRF_POWER->RESETREAS;    //1を書いてクリア
+
     gpio_init();
     twi_master_init();
     timers_init();      //app_button_init()やble_conn_params_init()よりも前に呼ぶこと!
@@ -322,37 +769,219 @@ void dev_init(void)
 }
 
 
+/**
+ * @brief System OFFからの起動か
+ *
+ * IRQ(RC-S730)のSENSEでSystem OFFから起動したときはtrue。
+ * RAMは消えているが、RC-S730の設定は残っており、Readerのコマンドが待っている。
+ *
+ * @retval      true    System OFFから起動した
+ */
+bool dev_is_resumed(void)
+{
+    return m_resumed;
+}
+
+
 void dev_event_exec(void)
 {
     uint32_t err_code;
+    uint32_t now;
+    uint32_t run;
+    uint32_t sleep;
 
     //スケジュール済みイベントの実行(mainloop内で呼び出す)
-    app_sched_execute();
+    sched_execute();
+
+    //起きていた時間と寝ていた時間(テレメトリのスリープ率)
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, m_telem.wake_ticks, &run);
+    m_telem.run_ticks += run;
+
     err_code = sd_app_evt_wait();
     APP_ERROR_CHECK(err_code);
+
+    app_timer_cnt_get(&m_telem.wake_ticks);
+    app_timer_cnt_diff_compute(m_telem.wake_ticks, now, &sleep);
+    m_telem.sleep_ticks += sleep;
+
+#ifdef DEV_PROFILE
+    prof_cpu_account(run, sleep);
+#endif  //DEV_PROFILE
 }
 
 
 /**
- * @brief Advertising開始
+ * @brief スケジューラへのイベント登録
+ *
+ * 優先度のキューに積み、dev_event_exec()で実行する。
+ * 同じハンドラ・引数のイベントが実行待ちなら、それにまとめて成功を返す。
+ * SoftDeviceとタイマのイベントもここに積まれる(DEV_PRIO_BLE)。
+ * 割込みからも呼べる。
+ *
+ * @param[in]   prio        優先度
+ * @param[in]   handler     イベントハンドラ
+ * @param[in]   p_context   ハンドラの引数
+ * @retval      NRF_SUCCESS         成功
+ * @retval      NRF_ERROR_NO_MEM    キューがいっぱい(破棄した)
  */
-void ble_advertising_start(void)
+uint32_t dev_sched_put(dev_prio_t prio, dev_sched_handler_t handler, void *p_context)
 {
-    uint32_t             err_code;
-    ble_gap_adv_params_t adv_params;
+    sched_queue_t *p_queue = &m_sched[prio];
+    sched_evt_t *p_evt;
+    uint32_t err_code = NRF_SUCCESS;
+    uint32_t now;
+    uint8_t i;
+
+    app_timer_cnt_get(&now);
+
+    CRITICAL_REGION_ENTER();
+    for (i = 0; i < p_queue->cnt; i++) {
+        p_evt = &p_queue->p_evt[(p_queue->rd + i) % p_queue->size];
+        if ((p_evt->handler == handler) && (p_evt->p_context == p_context)) {
+            break;
+        }
+    }
+    if (i < p_queue->cnt) {
+        //実行待ちのイベントにまとめる(待ち時間は最初に積んだ時刻から数える)
+        p_queue->merges++;
+    }
+    else if (p_queue->cnt < p_queue->size) {
+        p_evt = &p_queue->p_evt[(p_queue->rd + p_queue->cnt) % p_queue->size];
+        p_evt->handler = handler;
+        p_evt->p_context = p_context;
+        p_evt->put_ticks = now;
+        p_queue->cnt++;
+        if (p_queue->cnt > p_queue->cnt_max) {
+            p_queue->cnt_max = p_queue->cnt;
+        }
+        m_telem.sched_depth++;
+        if (m_telem.sched_depth > m_telem.sched_max) {
+            m_telem.sched_max = m_telem.sched_depth;
+        }
+    }
+    else {
+        p_queue->drops++;
+        m_telem.sched_drops++;
+        err_code = NRF_ERROR_NO_MEM;
+    }
+    CRITICAL_REGION_EXIT();
 
-    // Start advertising
-    memset(&adv_params, 0, sizeof(adv_params));
+    return err_code;
+}
 
-    adv_params.type        = BLE_GAP_ADV_TYPE_ADV_IND;
-    adv_params.p_peer_addr = NULL;
-    adv_params.fp          = BLE_GAP_ADV_FP_ANY;
-    adv_params.interval    = MSEC_TO_UNITS(APP_ADV_INTERVAL, UNIT_0_625_MS);
-    adv_params.timeout     = APP_ADV_TIMEOUT_IN_SECONDS;
 
-    err_code = sd_ble_gap_adv_start(&adv_params);
+/**
+ * @brief I2Cの一連の転送の開始
+ *
+ * dev_bus_end()と組で呼び、間に無線イベントが入ったかを数える。
+ * 割込みからも呼べる。
+ *
+ * @param[out]  p_bus       記録
+ */
+void dev_bus_begin(dev_bus_t *p_bus)
+{
+    app_timer_cnt_get(&p_bus->start);
+    CRITICAL_REGION_ENTER();
+    p_bus->radio_events = m_bus.radio_events;
+    p_bus->radio_active = m_bus.radio_active;
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**
+ * @brief I2Cの一連の転送の終了
+ *
+ * 開始時に無線イベント中だった、または途中で通知があったら「伸びた」と数える。
+ * 割込み禁止中や同じ優先度の割込み中は通知が保留されているので、保留も見る。
+ *
+ * @param[in]   p_bus       dev_bus_begin()の記録
+ * @param[in]   user        利用者
+ */
+void dev_bus_end(dev_bus_t *p_bus, dev_bus_user_t user)
+{
+    uint32_t now;
+    uint32_t ticks;
+    uint32_t pending = 0;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, p_bus->start, &ticks);
+    (void)sd_nvic_GetPendingIRQ(SWI1_IRQn, &pending);
+
+    CRITICAL_REGION_ENTER();
+    m_bus.bursts[user]++;
+    if (p_bus->radio_active || (p_bus->radio_events != m_bus.radio_events) || (pending != 0)) {
+        m_bus.stretched[user]++;
+    }
+    if (ticks > m_bus.ticks_max[user]) {
+        m_bus.ticks_max[user] = ticks;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**
+ * @brief RF応答時間の記録
+ *
+ * IRQを受けてからRC-S730へ応答を書き込むまでの時間を、テレメトリのヒストグラムに数える。
+ * 割込みから呼ばれる。
+ *
+ * @param[in]   ticks       応答時間[RTC1 tick]
+ */
+void dev_telem_rf_response(uint32_t ticks)
+{
+    uint32_t ms = ticks * 1000 / 32768;
+    int idx;
+
+    //2ms未満, 4ms未満, 8ms未満, 8ms以上
+    if (ms < 2) {
+        idx = 0;
+    }
+    else if (ms < 4) {
+        idx = 1;
+    }
+    else if (ms < 8) {
+        idx = 2;
+    }
+    else {
+        idx = 3;
+    }
+    m_telem.rf_hist[idx]++;
+}
+
+
+/**
+ * @brief IRQの再処理を遅らせて行う
+ *
+ * スケジューラから続けて再処理しても終わらないとき、他のイベントを先に進めるため、
+ * TIMER_RF_RETRY_INTERVAL後にgpiote_irq_handler()を呼ぶ。
+ * 割込みから呼ばれる。
+ */
+void dev_rf_retry(void)
+{
+    uint32_t err_code;
+
+    err_code = app_timer_stop(m_timer_rf_retry);
     APP_ERROR_CHECK(err_code);
-    led_on(LED_PIN_NO_ADVERTISING);
+    err_code = app_timer_start(m_timer_rf_retry,
+                    APP_TIMER_TICKS(TIMER_RF_RETRY_INTERVAL, APP_TIMER_PRESCALER), NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**
+ * @brief Advertising開始
+ *
+ * FASTフェーズから始め、タイムアウトする毎にSLOW, IDLEへ移る。
+ * Bonding済みの相手が分かっていれば、その前にDIRECTフェーズを行う。
+ */
+void ble_advertising_start(void)
+{
+    app_timer_cnt_get(&m_adv.start_ticks);
+#ifdef ADV_BCAST_RF_EVENT
+    m_bcast.deferred = false;
+#endif  //ADV_BCAST_RF_EVENT
+    adv_phase_start((m_peer_valid) ? ADV_PHASE_DIRECT : ADV_PHASE_FAST);
 
     app_trace_log("advertising start\r\n");
 }
@@ -376,9 +1005,172 @@ int ble_is_connected(void)
 	return m_conn_handle != BLE_CONN_HANDLE_INVALID;
 }
 
-void ble_nofify(const uint8_t *p_data, uint16_t length)
+/**
+ * @brief Centralへのデータ送信
+ *
+ * 20byteを超えるデータはFPSサービスで分割して送信される。
+ * RC-S730のIRQから呼ぶので、ble_queue()で積むだけにする。
+ *
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
+ */
+uint32_t ble_nofify(const uint8_t *p_data, uint16_t length)
+{
+    return ble_queue(FPS_MSG_RF_FRAME, p_data, length);
+}
+
+
+/**
+ * @brief Centralへのメッセージ送信(割込み用)
+ *
+ * 送信キューに積むだけで、SoftDeviceへの送出はスケジューラで行う。
+ * RFの応答時間が接続の有無やTXバッファの空きで変わらないよう、RC-S730のIRQからはこちらを使う。
+ *
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
+ */
+uint32_t ble_queue(uint8_t type, const uint8_t *p_data, uint16_t length)
+{
+    uint32_t err_code;
+
+    err_code = ble_fps_queue(&m_fps, type, p_data, length);
+    if (err_code == NRF_SUCCESS) {
+        //キューがいっぱいでも、次のTX_COMPLETEで送出される
+        (void)dev_sched_put(DEV_PRIO_RF, tx_flush_handler, NULL);
+    }
+    return err_code;
+}
+
+
+/**
+ * @brief Centralへのメッセージ送信
+ *
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
+ */
+uint32_t ble_send(uint8_t type, const uint8_t *p_data, uint16_t length)
+{
+    uint32_t err_code;
+
+    err_code = ble_fps_send(&m_fps, type, p_data, length);
+    if (err_code != NRF_SUCCESS) {
+        app_trace_log("ble_send type=%d err=%d\r\n", type, err_code);
+    }
+    return err_code;
+}
+
+
+/**
+ * @brief 通信発生の通知
+ *
+ * RFやGATTの通信が発生したときに呼ぶ。
+ * Connection間隔を短くし、しばらく通信が無ければ元に戻す。
+ * 割込みからも呼べるよう、処理はスケジューラで行う。
+ */
+void ble_conn_activity(void)
+{
+    //キューがいっぱいでも次の通信で再要求されるので、エラーは無視する
+    (void)dev_sched_put(DEV_PRIO_RF, conn_activity_handler, NULL);
+}
+
+
+/**
+ * @brief RFイベントのブロードキャスト
+ *
+ * 最後のRFイベントをAdvertisingデータに載せ、BURSTフェーズでAdvertisingする。
+ * 割込みから呼ばれるので、値を保存して処理はスケジューラで行う。
+ * 更新前に次のイベントが来たら、新しい方だけを載せる。
+ * ADV_BCAST_RF_EVENTが無効なときは何もしない。
+ *
+ * @param[in]   cmd         Readerのコマンドコード
+ * @param[in]   status      ST2(0:正常)
+ * @param[in]   p_idm       IDm(8byte)
+ * @param[in]   svc_code    サービスコード
+ */
+void ble_broadcast_rf_event(uint8_t cmd, uint8_t status, const uint8_t *p_idm, uint16_t svc_code)
+{
+#ifdef ADV_BCAST_RF_EVENT
+    uint32_t now;
+
+    app_timer_cnt_get(&now);
+
+    CRITICAL_REGION_ENTER();
+    //[0]seq(更新時) [1]cmd [2]status [3-10]IDm [11-12]service code
+    m_bcast.evt[1] = cmd;
+    m_bcast.evt[2] = status;
+    memcpy(&m_bcast.evt[3], p_idm, 8);
+    m_bcast.evt[11] = (uint8_t)svc_code;
+    m_bcast.evt[12] = (uint8_t)(svc_code >> 8);
+    m_bcast.evt_ticks = now;
+    m_bcast.pending = true;
+    m_bcast.events++;
+    CRITICAL_REGION_EXIT();
+
+    //キューがいっぱいでも次のイベントで載るので、エラーは無視する
+    (void)dev_sched_put(DEV_PRIO_RF, adv_bcast_handler, NULL);
+#else   //ADV_BCAST_RF_EVENT
+    (void)cmd;
+    (void)status;
+    (void)p_idm;
+    (void)svc_code;
+#endif  //ADV_BCAST_RF_EVENT
+}
+
+
+/**
+ * @brief ブロックデータのバッファ設定
+ *
+ * dev_init()より前に呼ぶこと。
+ * バッファはNDEFキャラクタリスティックの値と、Centralからの一括転送の受信先を兼ねる。
+ * p_shadowはNDEFキャラクタリスティックの値(BLE_GATTS_VLOC_USER)で、
+ * SoftDeviceはこちらだけを読み書きする(p_bufへはサービスが割込みを止めて写す)。
+ * 受け側は書込みの度に捨て、読む前に写し直すので、ブロック窓の受け側と重なってよい。
+ *
+ * @param[in]   p_buf       バッファ(512byte以下)
+ * @param[in]   p_shadow    受け側のバッファ(sizeと同じ長さ)
+ * @param[in]   size        バッファサイズ
+ */
+void ble_blk_buffer_set(uint8_t *p_buf, uint8_t *p_shadow, uint16_t size)
+{
+    m_blk_buf = p_buf;
+    m_blk_buf_shadow = p_shadow;
+    m_blk_size = size;
+}
+
+
+/**
+ * @brief ブロック窓の設定
+ *
+ * dev_init()より前に呼ぶこと。
+ * p_bufはble_blk_buffer_set()のバッファの一部であること(書込みはその位置に換算して通知する)。
+ * p_shadowはBLOCKキャラクタリスティックの値(BLE_GATTS_VLOC_USER)で、
+ * SoftDeviceはこちらだけを読み書きする(p_bufへはサービスが割込みを止めて写す)。
+ *
+ * @param[in]   p_buf       ブロックデータの配列(512byte以下)
+ * @param[in]   p_shadow    受け側のバッファ(sizeと同じ長さ)
+ * @param[in]   size        バッファサイズ
+ */
+void ble_blk_window_set(uint8_t *p_buf, uint8_t *p_shadow, uint16_t size)
+{
+    m_blk_win = p_buf;
+    m_blk_win_shadow = p_shadow;
+    m_blk_win_size = size;
+}
+
+
+/**
+ * @brief 一括転送中か
+ *
+ * @retval      true    一括転送中(ブロックイメージは書きかけ)
+ */
+bool ble_blk_bulk_active(void)
 {
-	ble_fps_notify(&m_fps, p_data, length);
+    return m_fps.bulk.active;
 }
 
 
@@ -410,6 +1202,27 @@ void led_off(int pin)
 }
 
 
+/**********************************************
+ * LCD
+ **********************************************/
+
+/**
+ * @brief LCD表示
+ *
+ * 表示はDEV_PRIO_UIで行うので、RFやBLEの処理を待たせない。
+ * 表示前に次の要求が来たら、新しい方だけを表示する。
+ * 割込みからも呼べる。
+ *
+ * @param[in]   p_str   表示する文字列(表示するまで保持されていること)
+ */
+void lcd_show(const char *p_str)
+{
+    m_lcd_str = p_str;
+    //キューがいっぱいでも次の表示で更新されるので、エラーは無視する
+    (void)dev_sched_put(DEV_PRIO_UI, lcd_update_handler, NULL);
+}
+
+
 /**************************************************************************
  * private function
  **************************************************************************/
@@ -435,6 +1248,24 @@ static void gpio_init(void)
 }
 
 
+/**
+ * @brief System OFF
+ *
+ * IRQ(RC-S730)をSENSE LOWにしておき、Readerのコマンドで起動し直す(リセット扱い)。
+ */
+static void system_off(void)
+{
+    uint32_t err_code;
+
+    led_off(LED_PIN_NO_ADVERTISING);
+    nrf_gpio_cfg_sense_input(RCS730_IRQ, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_SENSE_LOW);
+    app_trace_log("system off\r\n");
+
+    err_code = sd_power_system_off();
+    APP_ERROR_CHECK(err_code);
+}
+
+
 /**********************************************
  * タイマ
  **********************************************/
@@ -450,7 +1281,36 @@ static void gpio_init(void)
 static void timers_init(void)
 {
     // Initialize timer module, making it use the scheduler
-    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_MAX_TIMERS, APP_TIMER_OP_QUEUE_SIZE, true);
+    static uint32_t timer_buf[CEIL_DIV(APP_TIMER_BUF_SIZE(APP_TIMER_MAX_TIMERS, APP_TIMER_OP_QUEUE_SIZE + 1),
+                                        sizeof(uint32_t))];
+    uint32_t err_code;
+
+    //APP_TIMER_INIT()と同じだが、タイムアウトはdev_sched_put()に積む
+    err_code = app_timer_init(APP_TIMER_PRESCALER, APP_TIMER_MAX_TIMERS, APP_TIMER_OP_QUEUE_SIZE + 1,
+                                timer_buf, timer_evt_schedule);
+    APP_ERROR_CHECK(err_code);
+
+    //Connectionパラメータを省電力に戻すタイマ
+    err_code = app_timer_create(&m_timer_conn_idle, APP_TIMER_MODE_SINGLE_SHOT, conn_idle_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    //テレメトリを通知するタイマ
+    err_code = app_timer_create(&m_timer_telem, APP_TIMER_MODE_REPEATED, telem_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    //RTC1を止めないためのタイマ(未接続でもapp_timer_cnt_get()が進むようにする)
+    err_code = app_timer_create(&m_timer_tick, APP_TIMER_MODE_REPEATED, tick_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_start(m_timer_tick,
+                    APP_TIMER_TICKS(TIMER_TICK_KEEP_INTERVAL, APP_TIMER_PRESCALER), NULL);
+    APP_ERROR_CHECK(err_code);
+
+    //IRQの再処理を遅らせるタイマ
+    err_code = app_timer_create(&m_timer_rf_retry, APP_TIMER_MODE_SINGLE_SHOT, rf_retry_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    //起きている時間の計測はRTC1が動き始めてから
+    app_timer_cnt_get(&m_telem.wake_ticks);
 
 #if 0
     /* YOUR_JOB: Create any timers to be used by the application.
@@ -463,32 +1323,327 @@ static void timers_init(void)
 #endif
 }
 
-#if 0
 /**
- * @brief タイマ開始
+ * @brief RTC1維持タイマのタイムアウト
+ *
+ * RTC1を動かしておくためだけのタイマなので、何もしない。
+ *
+ * @param[in]   p_context   未使用
  */
-static void timers_start(void)
+static void tick_timeout_handler(void *p_context)
 {
-#if 0
-    /* YOUR_JOB: Start your timers. below is an example of how to start a timer. */
-    uint32_t err_code;
-
-    err_code = app_timer_start(m_app_timer_id, TIMER_INTERVAL, NULL);
-    APP_ERROR_CHECK(err_code);
-#endif
+    UNUSED_PARAMETER(p_context);
 }
-#endif
 
-/**********************************************
+
+/**
+ * @brief IRQ再処理タイマのタイムアウト
+ *
+ * GPIOTE割込みと重ならないよう、割込み禁止で呼ぶ。
+ *
+ * @param[in]   p_context   未使用
+ */
+static void rf_retry_timeout_handler(void *p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    CRITICAL_REGION_ENTER();
+    gpiote_irq_handler(0, 1 << RCS730_IRQ);
+    CRITICAL_REGION_EXIT();
+}
+
+#if 0
+/**
+ * @brief タイマ開始
+ */
+static void timers_start(void)
+{
+#if 0
+    /* YOUR_JOB: Start your timers. below is an example of how to start a timer. */
+    uint32_t err_code;
+
+    err_code = app_timer_start(m_app_timer_id, TIMER_INTERVAL, NULL);
+    APP_ERROR_CHECK(err_code);
+#endif
+}
+#endif
+
+/**********************************************
  * Scheduler
  **********************************************/
 
 /**
  * @brief スケジューラ初期化
+ *
+ * キューはtimers_init()から使われるので、統計だけを初期化する。
  */
 static void scheduler_init(void)
 {
-    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+    for (int i = 0; i < DEV_PRIO_NUM; i++) {
+        CRITICAL_REGION_ENTER();
+        m_sched[i].cnt_max = m_sched[i].cnt;
+        m_sched[i].merges = 0;
+        m_sched[i].drops = 0;
+        m_sched[i].wait_max = 0;
+        memset(m_sched[i].wait_hist, 0, sizeof(m_sched[i].wait_hist));
+        CRITICAL_REGION_EXIT();
+    }
+}
+
+
+/**
+ * @brief スケジュール済みイベントの実行
+ *
+ * 優先度の高いキューから1つずつ取り出して実行し、全てのキューが空になるまで繰り返す。
+ * 1つ実行する度に最初の優先度から選び直すので、
+ * 低い優先度のイベント実行中に積まれたRFイベントは、その次に実行される。
+ * 無線イベント中は、gapのキューを飛ばす。
+ */
+static void sched_execute(void)
+{
+    sched_queue_t *p_queue;
+    sched_evt_t evt;
+    uint32_t now;
+    uint32_t wait;
+    bool held;
+
+    for (;;) {
+        p_queue = NULL;
+        held = false;
+        CRITICAL_REGION_ENTER();
+        for (int i = 0; i < DEV_PRIO_NUM; i++) {
+            if ((m_sched[i].cnt != 0) && m_sched[i].gap && m_bus.radio_active) {
+                //無線イベントが終われば通知の割込みで起きる
+                held = true;
+            }
+            else if (m_sched[i].cnt != 0) {
+                p_queue = &m_sched[i];
+                evt = p_queue->p_evt[p_queue->rd];
+                p_queue->rd = (uint8_t)((p_queue->rd + 1) % p_queue->size);
+                p_queue->cnt--;
+                m_telem.sched_depth--;
+                break;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+        if (p_queue == NULL) {
+            if (held) {
+                m_bus.held++;
+            }
+            break;
+        }
+
+        app_timer_cnt_get(&now);
+        app_timer_cnt_diff_compute(now, evt.put_ticks, &wait);
+        sched_wait_account(p_queue, wait);
+
+        evt.handler(evt.p_context);
+#ifdef DEV_PROFILE
+        prof_handler_account(evt.handler, now);
+#endif  //DEV_PROFILE
+    }
+}
+
+
+/**
+ * @brief 待ち時間の記録
+ *
+ * @param[in,out]   p_queue     キュー
+ * @param[in]       wait        積んでから実行するまでの時間[RTC1 tick]
+ */
+static void sched_wait_account(sched_queue_t *p_queue, uint32_t wait)
+{
+    uint32_t ms = wait * 1000 / 32768;
+    uint32_t limit = 1;
+    int idx = 0;
+
+    //1ms未満, 4ms未満, 16ms未満, 64ms未満, 64ms以上
+    while ((idx < SCHED_WAIT_HIST_NUM - 1) && (ms >= limit)) {
+        idx++;
+        limit *= 4;
+    }
+    p_queue->wait_hist[idx]++;
+    if (wait > p_queue->wait_max) {
+        p_queue->wait_max = wait;
+    }
+}
+
+
+/**
+ * @brief スケジューラ統計のログ出力
+ */
+static void sched_trace(void)
+{
+    for (int i = 0; i < DEV_PRIO_NUM; i++) {
+        const sched_queue_t *p_queue = &m_sched[i];
+
+        app_trace_log("sched prio=%d max=%d merge=%d drop=%d wait(1/4/16/64/-ms)=%d/%d/%d/%d/%d max=%d\r\n",
+                        i, p_queue->cnt_max, p_queue->merges, p_queue->drops,
+                        p_queue->wait_hist[0], p_queue->wait_hist[1], p_queue->wait_hist[2],
+                        p_queue->wait_hist[3], p_queue->wait_hist[4], p_queue->wait_max);
+    }
+}
+
+
+#ifdef DEV_PROFILE
+/**
+ * @brief ハンドラ実行時間の記録
+ *
+ * @param[in]   handler     実行したハンドラ
+ * @param[in]   start       実行開始時刻[RTC1 tick]
+ */
+static void prof_handler_account(dev_sched_handler_t handler, uint32_t start)
+{
+    prof_handler_t *p_prof = NULL;
+    uint32_t now;
+    uint32_t run;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, start, &run);
+
+    for (int i = 0; i < PROF_HANDLER_NUM; i++) {
+        if (m_prof.handler[i].handler == handler) {
+            p_prof = &m_prof.handler[i];
+            break;
+        }
+        if (m_prof.handler[i].handler == NULL) {
+            //初めてのハンドラ
+            p_prof = &m_prof.handler[i];
+            p_prof->handler = handler;
+            break;
+        }
+    }
+    if (p_prof == NULL) {
+        m_prof.unknown++;
+        return;
+    }
+    p_prof->count++;
+    p_prof->run_ticks += run;
+    if (run > p_prof->run_max) {
+        p_prof->run_max = run;
+    }
+}
+
+
+/**
+ * @brief CPU使用率の記録
+ *
+ * mainloopを1周する度に呼ぶ。
+ *
+ * @param[in]   run     起きていた時間[RTC1 tick]
+ * @param[in]   sleep   寝ていた時間[RTC1 tick]
+ */
+static void prof_cpu_account(uint32_t run, uint32_t sleep)
+{
+    prof_window_t *p_win = &m_prof.window[m_prof.window_idx];
+    uint32_t over;
+    int i;
+
+    m_prof.wakeups++;
+    m_prof.run_ticks += run;
+    m_prof.sleep_ticks += sleep;
+
+    p_win->run_ticks += run;
+    p_win->total_ticks += run + sleep;
+    for (i = 0; (i < PROF_WINDOW_NUM) && (p_win->total_ticks >= PROF_WINDOW_TICKS); i++) {
+        //次の区間へ(一番古い区間を捨てる)
+        //  はみ出した時間は寝ていた時間として次の区間に入れる
+        over = p_win->total_ticks - PROF_WINDOW_TICKS;
+        if (p_win->run_ticks > PROF_WINDOW_TICKS) {
+            p_win->run_ticks = PROF_WINDOW_TICKS;
+        }
+        p_win->total_ticks = PROF_WINDOW_TICKS;
+        m_prof.window_idx = (uint8_t)((m_prof.window_idx + 1) % PROF_WINDOW_NUM);
+        p_win = &m_prof.window[m_prof.window_idx];
+        p_win->run_ticks = 0;
+        p_win->total_ticks = over;
+    }
+    if (p_win->total_ticks >= PROF_WINDOW_TICKS) {
+        //全区間より長く寝ていた
+        p_win->total_ticks = 0;
+    }
+}
+
+
+/**
+ * @brief プロファイルのリセット
+ */
+static void prof_reset(void)
+{
+    memset(&m_prof, 0, sizeof(m_prof));
+}
+
+
+/**
+ * @brief プロファイルのログ出力
+ *
+ * ハンドラはアドレスで出力するので、mapファイルで名前を引くこと。
+ * rateは1分あたりの実行回数。
+ */
+static void prof_dump(void)
+{
+    uint32_t total = m_prof.run_ticks + m_prof.sleep_ticks;
+    uint32_t win_run = 0;
+    uint32_t win_total = 0;
+
+    for (int i = 0; i < PROF_WINDOW_NUM; i++) {
+        win_run += m_prof.window[i].run_ticks;
+        win_total += m_prof.window[i].total_ticks;
+    }
+    app_trace_log("prof total=%d run=%d sleep=%d wakeups=%d unknown=%d\r\n",
+                    total, m_prof.run_ticks, m_prof.sleep_ticks, m_prof.wakeups, m_prof.unknown);
+    app_trace_log("prof cpu(window)=%d/1000 window=%d\r\n",
+                    (win_total != 0) ? (uint32_t)((uint64_t)win_run * 1000 / win_total) : 0, win_total);
+    for (int i = 0; (i < PROF_HANDLER_NUM) && (m_prof.handler[i].handler != NULL); i++) {
+        const prof_handler_t *p_prof = &m_prof.handler[i];
+
+        app_trace_log("prof handler=%p n=%d run=%d max=%d rate=%d/min\r\n",
+                        (void *)p_prof->handler, p_prof->count, p_prof->run_ticks, p_prof->run_max,
+                        (total != 0) ? (uint32_t)((uint64_t)p_prof->count * APP_TIMER_CLOCK_FREQ * 60 / total) : 0);
+    }
+}
+#endif  //DEV_PROFILE
+
+
+/**
+ * @brief SoftDeviceイベントのスケジュール
+ *
+ * SoftDevice handlerの割込みから呼ばれる。
+ * イベントは実行時にまとめて取り出すので、実行待ちがあれば1つにまとまる。
+ *
+ * @retval      NRF_SUCCESS         成功
+ * @retval      NRF_ERROR_NO_MEM    キューがいっぱい
+ */
+static uint32_t sd_evt_schedule(void)
+{
+    return dev_sched_put(DEV_PRIO_BLE, sd_evt_handler, NULL);
+}
+
+
+/**
+ * @brief SoftDeviceイベントの実行
+ *
+ * @param[in]   p_context   未使用
+ */
+static void sd_evt_handler(void *p_context)
+{
+    intern_softdevice_events_execute();
+}
+
+
+/**
+ * @brief タイムアウトのスケジュール
+ *
+ * app_timerの割込みから呼ばれる。
+ *
+ * @param[in]   timeout_handler     タイムアウトハンドラ
+ * @param[in]   p_context           ハンドラの引数
+ * @retval      NRF_SUCCESS         成功
+ * @retval      NRF_ERROR_NO_MEM    キューがいっぱい
+ */
+static uint32_t timer_evt_schedule(app_timer_timeout_handler_t timeout_handler, void *p_context)
+{
+    return dev_sched_put(DEV_PRIO_BLE, timeout_handler, p_context);
 }
 
 
@@ -529,6 +1684,7 @@ static void gpiote_init(void)
  *      -# システムイベントハンドラ初期化
  *      -# BLEスタック有効化
  *      -# BLEイベントハンドラ設定
+ *      -# Device Manager初期化
  *      -# デバイス名設定
  *      -# Appearance設定(GAP_USE_APPEARANCE定義時)
  *      -# PPCP設定
@@ -540,11 +1696,16 @@ static void ble_stack_init(void)
 {
     uint32_t err_code;
 
+    static uint32_t sd_evt_buf[CEIL_DIV(MAX(BLE_STACK_EVT_MSG_BUF_SIZE, SYS_EVT_MSG_BUF_SIZE),
+                                        sizeof(uint32_t))];
+
     /*
      * SoftDeviceの初期化
-     *      スケジューラの使用：あり
+     *      スケジューラの使用：あり(sd_evt_schedule())
      */
-    SOFTDEVICE_HANDLER_INIT(NRF_CLOCK_LFCLKSRC_RC_250_PPM_4000MS_CALIBRATION, true);
+    err_code = softdevice_handler_init(NRF_CLOCK_LFCLKSRC_RC_250_PPM_4000MS_CALIBRATION,
+                                        sd_evt_buf, sizeof(sd_evt_buf), sd_evt_schedule);
+    APP_ERROR_CHECK(err_code);
 
     /* システムイベントハンドラの設定 */
     err_code = softdevice_sys_evt_handler_set(sys_evt_dispatch);
@@ -568,6 +1729,15 @@ static void ble_stack_init(void)
         APP_ERROR_CHECK(err_code);
     }
 
+    /* 無線イベントの通知(I2Cを無線イベントの合間に行う) */
+    err_code = ble_radio_notification_init(APP_IRQ_PRIORITY_LOW,
+                                            RADIO_NOTIFICATION_DISTANCE,
+                                            radio_notification_handler);
+    APP_ERROR_CHECK(err_code);
+
+    /* Device Manager(Bonding)初期化 */
+    device_manager_init();
+
     /* デバイス名設定 */
     {
         //デバイス名へのWrite Permission(no protection, open link)
@@ -609,63 +1779,28 @@ static void ble_stack_init(void)
         ble_fps_init_t fps_init;
 
         fps_init.evt_handler_ndef = svc_fps_handler_ndef;
+        fps_init.msg_handler = svc_fps_handler_msg;
+        fps_init.bulk_handler = svc_fps_handler_bulk;
+        fps_init.write_begin_handler = svc_fps_handler_write_begin;
+        fps_init.block_handler = svc_fps_handler_block;
+        fps_init.p_ndef_value = m_blk_buf;
+        fps_init.p_ndef_shadow = m_blk_buf_shadow;
+        fps_init.ndef_value_len = m_blk_size;
+        fps_init.p_block_value = m_blk_win;
+        fps_init.p_block_shadow = m_blk_win_shadow;
+        fps_init.block_value_len = m_blk_win_size;
+        fps_init.telem_snapshot = svc_fps_telem_snapshot;
+        fps_init.telem_handler = svc_fps_telem_handler;
         err_code = ble_fps_init(&m_fps, &fps_init);
         APP_ERROR_CHECK(err_code);
+
+        ble_fps_bulk_buffer_set(&m_fps, m_blk_buf, m_blk_size);
     }
 
     /*
      * Advertising初期化
      */
-    {
-        ble_uuid_t adv_uuids[] = { { FPS_UUID_SERVICE, m_fps.uuid_type } };
-        ble_advdata_t advdata;
-        ble_advdata_t scanrsp;
-        //Vol 3,Part C : Generic Access Profile "9.2 Discovery Modes and Procedures"
-        uint8_t flags = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;    //探索時間に制限あり
-        //uint8_t flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
-
-        memset(&advdata, 0, sizeof(advdata));
-        memset(&scanrsp, 0, sizeof(scanrsp));
-
-        /*
-         * ble_advdata_name_type_t (ble_advdata.h)
-         *
-         * BLE_ADVDATA_NO_NAME    : デバイス名無し
-         * BLE_ADVDATA_SHORT_NAME : デバイス名あり «Shortened Local Name»
-         * BLE_ADVDATA_FULL_NAME  : デバイス名あり «Complete Local Name»
-         *
-         * https://www.bluetooth.org/en-us/specification/assigned-numbers/generic-access-profile
-         * https://developer.nordicsemi.com/nRF51_SDK/nRF51_SDK_v7.x.x/doc/7.2.0/s110/html/a01015.html#ga03c5ccf232779001be9786021b1a563b
-         */
-        advdata.name_type = BLE_ADVDATA_FULL_NAME;
-
-        /*
-         * Appearanceが含まれるかどうか
-         */
-#ifdef GAP_USE_APPEARANCE
-        advdata.include_appearance = true;
-#else   //GAP_USE_APPEARANCE
-        advdata.include_appearance = false;
-#endif  //GAP_USE_APPEARANCE
-        /*
-         * Advertisingフラグの設定
-         * CSS_v4 : Part A  1.3 FLAGS
-         * https://developer.nordicsemi.com/nRF51_SDK/nRF51_SDK_v7.x.x/doc/7.2.0/s110/html/a00802.html
-         *
-         * BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE = BLE_GAP_ADV_FLAG_LE_LIMITED_DISC_MODE | BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED
-         *      BLE_GAP_ADV_FLAG_LE_LIMITED_DISC_MODE : LE Limited Discoverable Mode
-         *      BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED : BR/EDR not supported
-         */
-        advdata.flags.size   = sizeof(flags);
-        advdata.flags.p_data = &flags;
-
-        /* SCAN_RSPデータ設定 */
-        scanrsp.uuids_complete.uuid_cnt = ARRAY_SIZE(adv_uuids);
-        scanrsp.uuids_complete.p_uuids  = adv_uuids;
-
-        err_code = ble_advdata_set(&advdata, &scanrsp);
-        APP_ERROR_CHECK(err_code);
-    }
+    adv_data_set();
 
     /*
      * Connection初期化
@@ -734,22 +1869,29 @@ static void dfu_reset_prepare(void)
 #endif // BLE_DFU_APP_SUPPORT
 
 
-#ifdef BLE_DFU_APP_SUPPORT
-/**@brief Function for the Device Manager initialization.
+/**********************************************
+ * BLE : Device Manager
+ **********************************************/
+
+/**
+ * @brief Device Manager初期化
+ *
+ * Bondingした相手の鍵とSystem Attribute(CCCD)をpstorageに保存し、
+ * 再接続時に復元する。Centralはサービス探索やCCCD書込みをせずに通知を受けられる。
  */
 static void device_manager_init(void)
 {
     uint32_t               err_code;
     dm_init_param_t        init_data;
     dm_application_param_t register_param;
+    dm_handle_t            handle;
 
     // Initialize persistent storage module.
     err_code = pstorage_init();
     APP_ERROR_CHECK(err_code);
 
-    // Clear all bonded centrals if the Bonds Delete button is pushed.
-    err_code = bsp_button_is_pressed(BOND_DELETE_ALL_BUTTON_ID,&(init_data.clear_persistent_data));
-    APP_ERROR_CHECK(err_code);
+    //Bonding情報は消さない(消すボタンが無い)
+    init_data.clear_persistent_data = false;
 
     err_code = dm_init(&init_data);
     APP_ERROR_CHECK(err_code);
@@ -768,8 +1910,120 @@ static void device_manager_init(void)
 
     err_code = dm_register(&m_app_handle, &register_param);
     APP_ERROR_CHECK(err_code);
+
+    //Bonding済みの相手をフラッシュのBondingテーブルから戻す
+    //  RAMは起動(System OFFからを含む)で消えるため。複数あれば最初に見つかった相手にする。
+    err_code = dm_handle_initialize(&handle);
+    APP_ERROR_CHECK(err_code);
+    handle.appl_id = m_app_handle;
+    for (uint8_t i = 0; i < DEVICE_MANAGER_MAX_BONDS; i++) {
+        handle.device_id = i;
+        if ((dm_peer_addr_get(&handle, &m_peer_addr) == NRF_SUCCESS) && peer_addr_directable(&m_peer_addr)) {
+            m_peer_valid = true;
+            app_trace_log("peer restored(device=%d)\r\n", i);
+            break;
+        }
+    }
+}
+
+
+/**
+ * @brief Directed Advertisingできる相手か
+ *
+ * Resolvable Private Address(スマートフォンなど)は変わっていくので、
+ * 覚えているアドレスへDirected Advertisingしても応答されない。
+ *
+ * @param[in]   p_addr      相手のアドレス
+ * @retval      true        Directed Advertisingする
+ */
+static bool peer_addr_directable(const ble_gap_addr_t *p_addr)
+{
+    return p_addr->addr_type != BLE_GAP_ADDR_TYPE_RANDOM_PRIVATE_RESOLVABLE;
+}
+
+
+/**
+ * @brief Device Managerイベントハンドラ
+ *
+ * @param[in]   p_handle        対象のデバイス
+ * @param[in]   p_event         イベント
+ * @param[in]   event_result    処理結果
+ * @retval      NRF_SUCCESS     成功
+ */
+static api_result_t device_manager_evt_handler(dm_handle_t const *p_handle,
+                                            dm_event_t const *p_event,
+                                            api_result_t event_result)
+{
+    uint32_t err_code;
+
+    APP_ERROR_CHECK(event_result);
+
+    switch (p_event->event_id) {
+    //接続したらセキュリティを要求する
+    //  Bonding済みなら暗号化のみ、未Bondingならペアリングになる
+    case DM_EVT_CONNECTION:
+        err_code = dm_security_setup_req((dm_handle_t *)p_handle);
+        APP_ERROR_CHECK(err_code);
+        break;
+
+    //ペアリング完了、またはBonding済みの相手と暗号化完了
+    //  次の切断後にDirected Advertisingする相手として覚えておく
+    case DM_EVT_SECURITY_SETUP_COMPLETE:
+    case DM_EVT_LINK_SECURED:
+        app_trace_log("DM_EVT_LINK_SECURED(%d)\r\n", p_event->event_id);
+        err_code = dm_peer_addr_get(p_handle, &m_peer_addr);
+        m_peer_valid = (err_code == NRF_SUCCESS) && peer_addr_directable(&m_peer_addr);
+        db_version_check(p_handle, p_event->event_id == DM_EVT_SECURITY_SETUP_COMPLETE);
+        break;
+
+    default:
+        break;
+    }
+
+    return NRF_SUCCESS;
+}
+
+
+/**
+ * @brief 属性テーブルの版の確認
+ *
+ * Bonding済みの相手ごとに、最後に見せたFPS_DB_VERSIONをApplication Contextに保存しておく。
+ * 版が違えばService Changedを通知し、Centralにキャッシュを捨てて探索し直してもらう。
+ * 同じであれば、Centralはキャッシュしたハンドルをそのまま使える。
+ *
+ * @param[in]   p_handle    対象のデバイス
+ * @param[in]   new_bond    true:今回Bondingした(Centralは探索済み)
+ */
+static void db_version_check(dm_handle_t const *p_handle, bool new_bond)
+{
+    uint32_t err_code;
+    uint32_t version = 0;
+    dm_application_context_t context;
+
+    context.flags  = 0;
+    context.p_data = (uint8_t *)&version;
+    context.len    = sizeof(version);
+
+    if (!new_bond) {
+        err_code = dm_application_context_get(p_handle, &context);
+        if ((err_code == NRF_SUCCESS) && (version == FPS_DB_VERSION)) {
+            //キャッシュは有効
+            return;
+        }
+
+        app_trace_log("db version %d -> %d : service changed\r\n", version, FPS_DB_VERSION);
+        err_code = sd_ble_gatts_service_changed(m_conn_handle, m_fps.service_handle, 0xffff);
+        if (err_code != NRF_SUCCESS) {
+            //CCCDでIndicationが許可されていないなど。Centralは次の接続で探索する
+            app_trace_log("service changed err=%d\r\n", err_code);
+            return;
+        }
+    }
+
+    version = FPS_DB_VERSION;
+    err_code = dm_application_context_set(p_handle, &context);
+    APP_ERROR_CHECK(err_code);
 }
-#endif // BLE_DFU_APP_SUPPORT
 
 
 /**********************************************
@@ -791,6 +2045,12 @@ static void conn_params_evt_handler(ble_conn_params_evt_t *p_evt)
     uint32_t err_code;
 
     if(p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED) {
+        if (m_conn_gov.req == CONN_MODE_FAST) {
+            //高速モードを断られただけなので、切断せずにPPCPへ戻す
+            app_trace_log("conn fast: rejected\r\n");
+            conn_mode_request(CONN_MODE_IDLE);
+            return;
+        }
         err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
     }
@@ -808,6 +2068,397 @@ static void conn_params_error_handler(uint32_t nrf_error)
 }
 
 
+/**
+ * @brief 送信キューの送出(スケジューラ)
+ *
+ * ble_queue()で積んだメッセージを送る。
+ */
+static void tx_flush_handler(void *p_context)
+{
+    ble_fps_tx_flush(&m_fps);
+}
+
+
+/**
+ * @brief 通信発生(スケジューラ)
+ *
+ * 高速モードでなければ切り替えを要求し、省電力に戻すタイマを延長する。
+ */
+static void conn_activity_handler(void *p_context)
+{
+    uint32_t err_code;
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID) {
+        return;
+    }
+
+    err_code = app_timer_stop(m_timer_conn_idle);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_start(m_timer_conn_idle,
+                    APP_TIMER_TICKS(CONN_FAST_IDLE_TIMEOUT, APP_TIMER_PRESCALER), NULL);
+    APP_ERROR_CHECK(err_code);
+
+    if (m_conn_gov.req != CONN_MODE_FAST) {
+        conn_mode_request(CONN_MODE_FAST);
+    }
+}
+
+
+/**
+ * @brief 通信が無くなった
+ *
+ * @param[in]   p_context   未使用
+ */
+static void conn_idle_timeout_handler(void *p_context)
+{
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID) {
+        conn_mode_request(CONN_MODE_IDLE);
+    }
+}
+
+
+/**
+ * @brief Connectionパラメータの切り替え要求
+ *
+ * ble_conn_paramsモジュールの希望パラメータ(PPCP)を変更する。
+ * 現在のパラメータが範囲外なら、モジュールがCentralへ更新を要求する。
+ *
+ * @param[in]   mode    要求するモード
+ */
+static void conn_mode_request(conn_mode_t mode)
+{
+    uint32_t err_code;
+    ble_gap_conn_params_t params;
+
+    if (mode == CONN_MODE_FAST) {
+        params.min_conn_interval = MSEC_TO_UNITS(CONN_FAST_MIN_INTERVAL, UNIT_1_25_MS);
+        params.max_conn_interval = MSEC_TO_UNITS(CONN_FAST_MAX_INTERVAL, UNIT_1_25_MS);
+        params.slave_latency     = CONN_FAST_SLAVE_LATENCY;
+    }
+    else {
+        params.min_conn_interval = MSEC_TO_UNITS(CONN_MIN_INTERVAL, UNIT_1_25_MS);
+        params.max_conn_interval = MSEC_TO_UNITS(CONN_MAX_INTERVAL, UNIT_1_25_MS);
+        params.slave_latency     = CONN_SLAVE_LATENCY;
+    }
+    params.conn_sup_timeout = MSEC_TO_UNITS(CONN_SUP_TIMEOUT, UNIT_10_MS);
+
+    m_conn_gov.req = mode;
+    m_conn_gov.pending = (mode != m_conn_gov.cur);
+    app_timer_cnt_get(&m_conn_gov.req_ticks);
+
+    err_code = ble_conn_params_change_conn_params(&params);
+    if ((err_code != NRF_SUCCESS) && (err_code != BLE_ERROR_INVALID_CONN_HANDLE)) {
+        //未接続時はPPCPの変更だけ行われる
+        APP_ERROR_HANDLER(err_code);
+    }
+}
+
+
+/**
+ * @brief Connectionパラメータ決定
+ *
+ * 接続時とBLE_GAP_EVT_CONN_PARAM_UPDATE時に呼ぶ。
+ *
+ * @param[in]   p_params    決まったパラメータ
+ */
+static void conn_mode_update(const ble_gap_conn_params_t *p_params)
+{
+    uint32_t now;
+    conn_mode_t mode;
+
+    mode = (p_params->max_conn_interval <= MSEC_TO_UNITS(CONN_FAST_MAX_INTERVAL, UNIT_1_25_MS))
+                ? CONN_MODE_FAST : CONN_MODE_IDLE;
+
+    conn_mode_account();
+    m_conn_gov.cur = mode;
+
+    if (m_conn_gov.pending && (mode == m_conn_gov.req)) {
+        //要求からパラメータ更新までの時間
+        app_timer_cnt_get(&now);
+        app_timer_cnt_diff_compute(now, m_conn_gov.req_ticks, &m_conn_gov.update_last);
+        if (m_conn_gov.update_last > m_conn_gov.update_max) {
+            m_conn_gov.update_max = m_conn_gov.update_last;
+        }
+        m_conn_gov.update_cnt++;
+        m_conn_gov.pending = false;
+    }
+
+    app_trace_log("conn interval=%d latency=%d update=%d\r\n",
+                    p_params->max_conn_interval, p_params->slave_latency, m_conn_gov.update_last);
+}
+
+
+/**
+ * @brief 接続からNotification許可までのConnectionイベント数を集計
+ *
+ * ATTの要求と応答は1往復に1回以上のConnectionイベントが必要なので、
+ * Connectionイベント数を往復数の上限とみなす。
+ */
+static void gatt_ready_account(void)
+{
+    uint32_t events;
+    int idx;
+
+    if ((m_fps.tx_stat.ready_delay == 0) || (m_conn_gov.connect_interval == 0)) {
+        //Notification許可されないまま切断
+        return;
+    }
+
+    //[RTC1 tick] / (interval * 1.25msec = interval * 40.96 tick)
+    events = m_fps.tx_stat.ready_delay * 100 / (m_conn_gov.connect_interval * 4096);
+    idx = (m_fps.tx_stat.ready_restored) ? 1 : 0;
+    m_gatt_ready.events_sum[idx] += events;
+    m_gatt_ready.count[idx]++;
+
+    app_trace_log("gatt ready=%d events(restored=%d) avg discover/restored=%d/%d\r\n",
+                    events, idx,
+                    (m_gatt_ready.count[0]) ? m_gatt_ready.events_sum[0] / m_gatt_ready.count[0] : 0,
+                    (m_gatt_ready.count[1]) ? m_gatt_ready.events_sum[1] / m_gatt_ready.count[1] : 0);
+}
+
+
+/**
+ * @brief 現在のモードの滞在時間を積算
+ *
+ * RTC1は24bitなので、512秒を超える区間は短く数えられる。
+ */
+static void conn_mode_account(void)
+{
+    uint32_t now;
+    uint32_t diff;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, m_conn_gov.mode_start, &diff);
+    m_conn_gov.mode_ticks[m_conn_gov.cur] += diff;
+    m_conn_gov.mode_start = now;
+}
+
+
+/**********************************************
+ * BLE : Advertising
+ **********************************************/
+
+/**
+ * @brief Advertisingフェーズ開始
+ *
+ * @param[in]   phase   開始するフェーズ
+ */
+static void adv_phase_start(adv_phase_t phase)
+{
+    uint32_t             err_code;
+    ble_gap_adv_params_t adv_params;
+    const adv_phase_param_t *p_param = &m_adv_phase_param[phase];
+
+    memset(&adv_params, 0, sizeof(adv_params));
+
+    if (phase == ADV_PHASE_DIRECT) {
+        //High Duty Cycle : intervalとtimeoutはSoftDeviceが決める(1.28sec)
+        adv_params.type        = BLE_GAP_ADV_TYPE_ADV_DIRECT_IND;
+        adv_params.p_peer_addr = &m_peer_addr;
+        adv_params.fp          = BLE_GAP_ADV_FP_ANY;
+        adv_params.interval    = 0;
+        adv_params.timeout     = 0;
+    }
+    else {
+        adv_params.type        = BLE_GAP_ADV_TYPE_ADV_IND;
+        adv_params.p_peer_addr = NULL;
+        adv_params.fp          = BLE_GAP_ADV_FP_ANY;
+        adv_params.interval    = MSEC_TO_UNITS(p_param->interval, UNIT_0_625_MS);
+        adv_params.timeout     = p_param->timeout;
+    }
+
+    err_code = sd_ble_gap_adv_start(&adv_params);
+    APP_ERROR_CHECK(err_code);
+    led_on(LED_PIN_NO_ADVERTISING);
+
+    m_adv.phase = phase;
+    app_timer_cnt_get(&m_adv.phase_start);
+
+    if (phase == ADV_PHASE_DIRECT) {
+        app_trace_log("adv phase=%d direct\r\n", phase);
+    }
+    else {
+        //model : 平均電流[uA], 接続までの時間[msec]
+        app_trace_log("adv phase=%d interval=%d model=%duA/%dms\r\n",
+                        phase, p_param->interval,
+                        (ADV_MODEL_EVT_CHARGE * 1000 / p_param->interval + ADV_MODEL_SLEEP_CURRENT) / 1000,
+                        p_param->interval / 2 + 5);
+    }
+}
+
+
+/**
+ * @brief 現在のフェーズのAdvertising時間を積算
+ *
+ * フェーズ毎の時間にmodelの平均電流を掛ければ、Advertisingの消費電荷が見積もれる。
+ */
+static void adv_phase_account(void)
+{
+    uint32_t now;
+    uint32_t diff;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, m_adv.phase_start, &diff);
+    m_adv.phase_ticks[m_adv.phase] += diff;
+    m_adv.phase_start = now;
+}
+
+
+/**
+ * @brief Advertisingデータ設定
+ *
+ * ADV_BCAST_RF_EVENT有効時は、m_bcast.dataをManufacturer Specific Dataに載せる。
+ * Advertising中に呼んでもよい(次のAdvertisingイベントから変わる)。
+ */
+static void adv_data_set(void)
+{
+    uint32_t err_code;
+    ble_uuid_t adv_uuids[] = { { FPS_UUID_SERVICE, m_fps.uuid_type } };
+    ble_advdata_t advdata;
+    ble_advdata_t scanrsp;
+    //Vol 3,Part C : Generic Access Profile "9.2 Discovery Modes and Procedures"
+    //IDLEフェーズはタイムアウト無しで続けるので、General Discoverable Modeにする
+    //uint8_t flags = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;    //探索時間に制限あり
+    uint8_t flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+#ifdef ADV_BCAST_RF_EVENT
+    ble_advdata_manuf_data_t manuf;
+#endif  //ADV_BCAST_RF_EVENT
+
+    memset(&advdata, 0, sizeof(advdata));
+    memset(&scanrsp, 0, sizeof(scanrsp));
+
+    /*
+     * ble_advdata_name_type_t (ble_advdata.h)
+     *
+     * BLE_ADVDATA_NO_NAME    : デバイス名無し
+     * BLE_ADVDATA_SHORT_NAME : デバイス名あり «Shortened Local Name»
+     * BLE_ADVDATA_FULL_NAME  : デバイス名あり «Complete Local Name»
+     *
+     * https://www.bluetooth.org/en-us/specification/assigned-numbers/generic-access-profile
+     * https://developer.nordicsemi.com/nRF51_SDK/nRF51_SDK_v7.x.x/doc/7.2.0/s110/html/a01015.html#ga03c5ccf232779001be9786021b1a563b
+     */
+#ifdef ADV_BCAST_RF_EVENT
+    //RFイベントの分を空けるため短縮形にする(完全な名前はGAPサービスで読める)
+    advdata.name_type = BLE_ADVDATA_SHORT_NAME;
+    advdata.short_name_len = GAP_SHORT_NAME_LEN;
+#else   //ADV_BCAST_RF_EVENT
+    advdata.name_type = BLE_ADVDATA_FULL_NAME;
+#endif  //ADV_BCAST_RF_EVENT
+
+    /*
+     * Appearanceが含まれるかどうか
+     */
+#ifdef GAP_USE_APPEARANCE
+    advdata.include_appearance = true;
+#else   //GAP_USE_APPEARANCE
+    advdata.include_appearance = false;
+#endif  //GAP_USE_APPEARANCE
+    /*
+     * Advertisingフラグの設定
+     * CSS_v4 : Part A  1.3 FLAGS
+     * https://developer.nordicsemi.com/nRF51_SDK/nRF51_SDK_v7.x.x/doc/7.2.0/s110/html/a00802.html
+     *
+     * BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE = BLE_GAP_ADV_FLAG_LE_LIMITED_DISC_MODE | BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED
+     *      BLE_GAP_ADV_FLAG_LE_LIMITED_DISC_MODE : LE Limited Discoverable Mode
+     *      BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED : BR/EDR not supported
+     */
+    advdata.flags.size   = sizeof(flags);
+    advdata.flags.p_data = &flags;
+
+#ifdef ADV_BCAST_RF_EVENT
+    /* RFイベント(起動直後はseq=0, cmd=0) */
+    manuf.company_identifier = ADV_BCAST_COMPANY_ID;
+    manuf.data.size          = ADV_BCAST_DATA_LEN;
+    manuf.data.p_data        = m_bcast.data;
+    advdata.p_manuf_specific_data = &manuf;
+#endif  //ADV_BCAST_RF_EVENT
+
+    /* SCAN_RSPデータ設定 */
+    scanrsp.uuids_complete.uuid_cnt = ARRAY_SIZE(adv_uuids);
+    scanrsp.uuids_complete.p_uuids  = adv_uuids;
+
+    err_code = ble_advdata_set(&advdata, &scanrsp);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+#ifdef ADV_BCAST_RF_EVENT
+/**
+ * @brief RFイベントをAdvertisingデータに載せる
+ *
+ * seqを+1してAdvertisingデータを更新し、BURSTフェーズを始める。
+ * 接続中はAdvertisingできないので、イベントはFPSのNotificationだけで届く。
+ *
+ * 届くまでの時間(model)の比較
+ *   ブロードキャスト : 更新までの時間 + BURST間隔 / 2 + advDelay(平均5ms)   (Centralが常にscanしている場合)
+ *   接続中           : Connection間隔 / 2 (キュー待ちが無い場合)
+ *
+ * @param[in]   p_context   未使用
+ */
+static void adv_bcast_handler(void *p_context)
+{
+    uint32_t err_code;
+    uint32_t now;
+    uint32_t latency;
+    bool pending;
+
+    CRITICAL_REGION_ENTER();
+    pending = m_bcast.pending;
+    if (pending && (m_conn_handle == BLE_CONN_HANDLE_INVALID)) {
+        memcpy(m_bcast.data, m_bcast.evt, ADV_BCAST_DATA_LEN);
+        m_bcast.data[0]++;      //seq
+        m_bcast.evt[0] = m_bcast.data[0];
+    }
+    m_bcast.pending = false;
+    CRITICAL_REGION_EXIT();
+
+    if (!pending) {
+        //前のハンドラで載せ済み
+        return;
+    }
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID) {
+        m_bcast.connected++;
+        return;
+    }
+
+    adv_data_set();
+
+    if (m_adv.phase == ADV_PHASE_DIRECT) {
+        //Bonding済みの相手の再接続を邪魔しない : DIRECTのタイムアウト後にBURSTする
+        m_bcast.deferred = true;
+    }
+    else {
+        //Advertising中ならBURSTフェーズにする(System OFF直前やDFU中は止まっている)
+        err_code = sd_ble_gap_adv_stop();
+        if (err_code == NRF_SUCCESS) {
+            adv_phase_account();
+            if (m_adv.phase != ADV_PHASE_BURST) {
+                m_bcast.resume = m_adv.phase;
+            }
+            adv_phase_start(ADV_PHASE_BURST);
+        }
+    }
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, m_bcast.evt_ticks, &latency);
+    m_bcast.updates++;
+    m_bcast.latency_sum += latency;
+    if (latency > m_bcast.latency_max) {
+        m_bcast.latency_max = latency;
+    }
+
+    //model[msec] : ブロードキャスト / 接続中(前回のConnection間隔)
+    app_trace_log("bcast seq=%d cmd=%02x update=%d avg=%d max=%d (n=%d/%d conn=%d)\r\n",
+                    m_bcast.data[0], m_bcast.data[1], latency,
+                    m_bcast.latency_sum / m_bcast.updates, m_bcast.latency_max,
+                    m_bcast.updates, m_bcast.events, m_bcast.connected);
+    app_trace_log("bcast model=%dms conn model=%dms\r\n",
+                    latency * 1000 / 32768 + APP_ADV_BURST_INTERVAL / 2 + 5,
+                    m_conn_gov.connect_interval * 5 / 8);
+}
+#endif  //ADV_BCAST_RF_EVENT
+
+
 /**********************************************
  * BLE : Services
  **********************************************/
@@ -822,8 +2473,285 @@ static void conn_params_error_handler(uint32_t nrf_error)
 static void svc_fps_handler_ndef(ble_fps_t *p_fps, const uint8_t *p_value, uint16_t length)
 {
     app_trace_log("svc_fps_handler_ndef\r\n");
+
+    //値はサービスがブロックイメージへ写し終わっている
+    blk_image_updated(0, length);
 }
 
+
+/**
+ * @brief FeliCa Plugサービスメッセージ受信ハンドラ
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[in]   type    メッセージ種別
+ * @param[in]   p_data  メッセージ
+ * @param[in]   length  メッセージ長
+ */
+static void svc_fps_handler_msg(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length)
+{
+    app_trace_log("svc_fps_handler_msg type=%d len=%d\r\n", type, length);
+
+    switch (type) {
+    case FPS_MSG_BATCH:
+        remote_batch_exec(p_data, length);
+        break;
+
+    case FPS_MSG_RFLOG_REQ:
+        rf_log_request(p_data, length);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/**
+ * @brief FeliCa Plugサービス一括転送完了ハンドラ
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[in]   offset  書込み開始位置
+ * @param[in]   length  受信データ長
+ */
+static void svc_fps_handler_bulk(ble_fps_t *p_fps, uint16_t offset, uint16_t length)
+{
+    app_trace_log("svc_fps_handler_bulk offset=%d len=%d\r\n", offset, length);
+    lcd_show("download");
+
+    blk_image_updated(offset, length);
+}
+
+
+/**
+ * @brief FeliCa Plugサービス書込み開始ハンドラ
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[in]   offset  書込み開始位置
+ * @param[in]   length  書き込む長さ
+ */
+static void svc_fps_handler_write_begin(ble_fps_t *p_fps, uint16_t offset, uint16_t length)
+{
+    app_trace_log("svc_fps_handler_write_begin offset=%d len=%d\r\n", offset, length);
+
+    blk_image_begin(offset, length);
+}
+
+
+/**
+ * @brief FeliCa Plugサービスブロック窓書込みハンドラ
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[in]   offset  ブロック窓の書込み開始位置
+ * @param[in]   length  書き込んだ長さ
+ */
+static void svc_fps_handler_block(ble_fps_t *p_fps, uint16_t offset, uint16_t length)
+{
+    app_trace_log("svc_fps_handler_block offset=%d len=%d\r\n", offset, length);
+
+    //ブロックイメージ全体での位置に換算する
+    blk_image_updated((uint16_t)(m_blk_win - m_blk_buf) + offset, length);
+}
+
+
+/**
+ * @brief テレメトリ作成
+ *
+ * Readの認可要求とNotificationの前に呼ばれる。形式はble_fps.hを参照。
+ * カウンタを読んで詰めるだけなので、メモリ確保もI2Cアクセスも無い。
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[out]  p_value スナップショット(FPS_TELEM_LEN byte)
+ */
+static void svc_fps_telem_snapshot(ble_fps_t *p_fps, uint8_t *p_value)
+{
+    RCS730_stat_t rcs;
+    uint16_t hist[FPS_TELEM_HIST_NUM];
+    uint32_t total;
+    uint16_t val;
+
+    //IRQの中で更新されるものは揃えて読む
+    CRITICAL_REGION_ENTER();
+    RCS730_getStat(&rcs);
+    memcpy(hist, m_telem.rf_hist, sizeof(hist));
+    CRITICAL_REGION_EXIT();
+
+    total = m_telem.run_ticks + m_telem.sleep_ticks;
+
+    p_value[0] = FPS_TELEM_FORMAT;
+    val = (uint16_t)(total / 32768);
+    p_value[1] = (uint8_t)val;
+    p_value[2] = (uint8_t)(val >> 8);
+    val = (uint16_t)(rcs.IrqCount - m_telem.base_irq);
+    p_value[3] = (uint8_t)val;
+    p_value[4] = (uint8_t)(val >> 8);
+    for (int i = 0; i < FPS_TELEM_HIST_NUM; i++) {
+        p_value[5 + 2 * i] = (uint8_t)hist[i];
+        p_value[6 + 2 * i] = (uint8_t)(hist[i] >> 8);
+    }
+    val = (uint16_t)(rcs.I2cFails - rcs.I2cErrors - m_telem.base_i2c_retries);
+    p_value[13] = (uint8_t)val;
+    p_value[14] = (uint8_t)(val >> 8);
+    p_value[15] = p_fps->tx_stat.depth_max;
+    val = (uint16_t)(p_fps->tx_stat.drops - m_telem.base_drops);
+    p_value[16] = (uint8_t)val;
+    p_value[17] = (uint8_t)(val >> 8);
+    p_value[18] = m_telem.sched_max;
+    //sleep * 100がオーバーフローしないよう、先にtotalを割る
+    p_value[19] = (total >= 100) ? (uint8_t)(m_telem.sleep_ticks / (total / 100)) : 0;
+}
+
+
+/**
+ * @brief テレメトリコマンド
+ *
+ * @param[in]   p_fps   FPサービス構造体
+ * @param[in]   p_cmd   コマンド
+ * @param[in]   length  コマンド長
+ */
+static void svc_fps_telem_handler(ble_fps_t *p_fps, const uint8_t *p_cmd, uint16_t length)
+{
+    uint32_t err_code;
+
+    if (length < 1) {
+        return;
+    }
+
+    switch (p_cmd[0]) {
+    case FPS_TELEM_CMD_RESET:
+        telem_reset();
+        break;
+
+    case FPS_TELEM_CMD_PROFILE:
+#ifdef DEV_PROFILE
+        prof_dump();
+#endif  //DEV_PROFILE
+        break;
+
+    case FPS_TELEM_CMD_PERIOD:
+        if (length < 2) {
+            break;
+        }
+        err_code = app_timer_stop(m_timer_telem);
+        APP_ERROR_CHECK(err_code);
+        m_telem.period = p_cmd[1];
+        if (m_telem.period != 0) {
+            err_code = app_timer_start(m_timer_telem,
+                            APP_TIMER_TICKS(m_telem.period * 1000, APP_TIMER_PRESCALER), NULL);
+            APP_ERROR_CHECK(err_code);
+        }
+        break;
+
+    default:
+        break;
+    }
+    app_trace_log("telem cmd=%d period=%d\r\n", p_cmd[0], m_telem.period);
+}
+
+
+/**********************************************
+ * Telemetry
+ **********************************************/
+
+/**
+ * @brief テレメトリのリセット
+ *
+ * 各モジュールの積算値は残し、今の値を基準にする。
+ */
+static void telem_reset(void)
+{
+    RCS730_stat_t rcs;
+
+    CRITICAL_REGION_ENTER();
+    RCS730_getStat(&rcs);
+    memset(m_telem.rf_hist, 0, sizeof(m_telem.rf_hist));
+    m_telem.sched_max = m_telem.sched_depth;
+    CRITICAL_REGION_EXIT();
+
+    m_telem.base_irq = rcs.IrqCount;
+    m_telem.base_i2c_retries = rcs.I2cFails - rcs.I2cErrors;
+    m_telem.base_drops = m_fps.tx_stat.drops;
+    m_fps.tx_stat.depth_max = m_fps.tx_cnt;
+    m_telem.run_ticks = 0;
+    m_telem.sleep_ticks = 0;
+#ifdef DEV_PROFILE
+    prof_reset();
+#endif  //DEV_PROFILE
+
+    app_trace_log("telem reset sched drops=%d\r\n", m_telem.sched_drops);
+}
+
+
+/**
+ * @brief テレメトリの周期通知
+ *
+ * @param[in]   p_context   未使用
+ */
+static void telem_timeout_handler(void *p_context)
+{
+    //Notification不許可やTXバッファ不足なら、次の周期に送る
+    (void)ble_fps_telem_notify(&m_fps);
+}
+
+
+/**********************************************
+ * LCD
+ **********************************************/
+
+/**
+ * @brief LCD表示(スケジューラ)
+ *
+ * @param[in]   p_context   未使用
+ */
+static void lcd_update_handler(void *p_context)
+{
+    const char *p_str = m_lcd_str;
+    dev_bus_t bus;
+
+    dev_bus_begin(&bus);
+    ST7032I_clear();
+    ST7032I_writeString(p_str);
+    dev_bus_end(&bus, DEV_BUS_UI);
+}
+
+
+/**********************************************
+ * I2C
+ **********************************************/
+
+/**
+ * @brief 無線イベントの通知
+ *
+ * 無線イベントのRADIO_NOTIFICATION_DISTANCE前と、終了時に呼ばれる(SWI1割込み)。
+ * 終了時の割込みでsd_app_evt_wait()から戻り、待たせていたイベントを実行する。
+ *
+ * @param[in]   radio_active    true:無線イベント開始前 / false:終了
+ */
+static void radio_notification_handler(bool radio_active)
+{
+    m_bus.radio_active = radio_active;
+    if (radio_active) {
+        m_bus.radio_events++;
+    }
+}
+
+
+/**
+ * @brief I2C統計のログ出力
+ */
+static void bus_trace(void)
+{
+    RCS730_stat_t rcs;
+
+    RCS730_getStat(&rcs);
+    app_trace_log("bus radio=%d held=%d i2c retries=%d errors=%d\r\n",
+                    m_bus.radio_events, m_bus.held, rcs.I2cFails - rcs.I2cErrors, rcs.I2cErrors);
+    for (int i = 0; i < DEV_BUS_NUM; i++) {
+        app_trace_log("bus user=%d n=%d stretched=%d max=%d\r\n",
+                        i, m_bus.bursts[i], m_bus.stretched[i], m_bus.ticks_max[i]);
+    }
+}
+
+
 /**********************************************
  * BLE stack
  **********************************************/
@@ -836,8 +2764,6 @@ static void svc_fps_handler_ndef(ble_fps_t *p_fps, const uint8_t *p_value, uint1
 static void ble_evt_handler(ble_evt_t *p_ble_evt)
 {
     uint32_t                         err_code;
-    static ble_gap_evt_auth_status_t m_auth_status;
-    ble_gap_enc_info_t               *p_enc_info;
 
     switch (p_ble_evt->header.evt_id) {
     /*************
@@ -847,11 +2773,40 @@ static void ble_evt_handler(ble_evt_t *p_ble_evt)
     //接続が成立したとき
     case BLE_GAP_EVT_CONNECTED:
         app_trace_log("BLE_GAP_EVT_CONNECTED\r\n");
-        ST7032I_clear();
-        ST7032I_writeString("connect");
+        lcd_show("connect");
         led_on(LED_PIN_NO_CONNECTED);
         led_off(LED_PIN_NO_ADVERTISING);
         m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+
+        //Advertising開始から接続までの時間
+        {
+            uint32_t latency;
+
+            adv_phase_account();
+            app_timer_cnt_diff_compute(m_adv.phase_start, m_adv.start_ticks, &latency);
+            m_adv.connects[m_adv.phase]++;
+            if (latency > m_adv.latency_max[m_adv.phase]) {
+                m_adv.latency_max[m_adv.phase] = latency;
+            }
+            app_trace_log("adv connect phase=%d latency=%d\r\n", m_adv.phase, latency);
+            app_trace_log("adv ticks(direct/fast/slow/idle/burst)=%d/%d/%d/%d/%d\r\n",
+                            m_adv.phase_ticks[ADV_PHASE_DIRECT], m_adv.phase_ticks[ADV_PHASE_FAST],
+                            m_adv.phase_ticks[ADV_PHASE_SLOW], m_adv.phase_ticks[ADV_PHASE_IDLE],
+                            m_adv.phase_ticks[ADV_PHASE_BURST]);
+        }
+
+        m_conn_gov.req = CONN_MODE_IDLE;
+        m_conn_gov.cur = CONN_MODE_IDLE;
+        m_conn_gov.pending = false;
+        app_timer_cnt_get(&m_conn_gov.mode_start);
+        m_conn_gov.connect_interval = p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval;
+        conn_mode_update(&p_ble_evt->evt.gap_evt.params.connected.conn_params);
+        break;
+
+    //Connectionパラメータが更新されたとき
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+        app_trace_log("BLE_GAP_EVT_CONN_PARAM_UPDATE\r\n");
+        conn_mode_update(&p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params);
         break;
 
     //相手から切断されたとき
@@ -859,67 +2814,69 @@ static void ble_evt_handler(ble_evt_t *p_ble_evt)
     //保持したSystem Attributeは、EVT_SYS_ATTR_MISSINGで返すことになる。
     case BLE_GAP_EVT_DISCONNECTED:
         app_trace_log("BLE_GAP_EVT_DISCONNECTED\r\n");
-        ST7032I_clear();
-        ST7032I_writeString("disconnect");
+        lcd_show("disconnect");
         led_off(LED_PIN_NO_CONNECTED);
         m_conn_handle = BLE_CONN_HANDLE_INVALID;
 
-        ble_advertising_start();
-        break;
-
-    //SMP Paring要求を受信したとき
-    //sd_ble_gap_sec_params_reply()で値を返したあと、SMP Paring Phase 2に状態遷移する
-    case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-        app_trace_log("BLE_GAP_EVT_SEC_PARAMS_REQUEST\r\n");
+        conn_mode_account();
+        gatt_ready_account();
+        sched_trace();
         {
-            ble_gap_sec_params_t sec_param;
-            sec_param.timeout      = SEC_PARAM_TIMEOUT;
-            sec_param.bond         = SEC_PARAM_BOND;
-            sec_param.mitm         = SEC_PARAM_MITM;
-            sec_param.io_caps      = SEC_PARAM_IO_CAPABILITIES;
-            sec_param.oob          = SEC_PARAM_OOB;
-            sec_param.min_key_size = SEC_PARAM_MIN_KEY_SIZE;
-            sec_param.max_key_size = SEC_PARAM_MAX_KEY_SIZE;
-            err_code = sd_ble_gap_sec_params_reply(m_conn_handle,
-                                               BLE_GAP_SEC_STATUS_SUCCESS,
-                                               &sec_param);
-            APP_ERROR_CHECK(err_code);
-        }
-        break;
-
-    //Just Works(Bonding有り)の場合、SMP Paring Phase 3のあとでPeripheral Keyが渡される。
-    //ここではPeripheral Keyを保存だけしておき、次のBLE_GAP_EVT_SEC_INFO_REQUESTで処理する。
-    case BLE_GAP_EVT_AUTH_STATUS:
-        app_trace_log("BLE_GAP_EVT_AUTH_STATUS\r\n");
-        m_auth_status = p_ble_evt->evt.gap_evt.params.auth_status;
-        break;
+            RCS730_stat_t rcs;
 
-    //SMP Paringが終わったとき？
-    case BLE_GAP_EVT_SEC_INFO_REQUEST:
-        app_trace_log("BLE_GAP_EVT_SEC_INFO_REQUEST\r\n");
-        p_enc_info = &m_auth_status.periph_keys.enc_info;
-        if (p_enc_info->div == p_ble_evt->evt.gap_evt.params.sec_info_request.div) {
-            //Peripheral Keyが有る
-            err_code = sd_ble_gap_sec_info_reply(m_conn_handle, p_enc_info, NULL);
-        }
-        else {
-            //Peripheral Keyが無い
-            err_code = sd_ble_gap_sec_info_reply(m_conn_handle, NULL, NULL);
+            RCS730_getStat(&rcs);
+            app_trace_log("rcs730 irq=%d events=%d coalesced=%d empty=%d missed=%d giveup=%d\r\n",
+                            rcs.IrqCount, rcs.IrqEvents, rcs.IrqCoalesced, rcs.IrqEmpty, rcs.IrqMissed,
+                            rcs.IrqGiveUps);
         }
+        bus_trace();
+        app_trace_log("conn: idle=%d fast=%d update(n/max)=%d/%d\r\n",
+                        m_conn_gov.mode_ticks[CONN_MODE_IDLE], m_conn_gov.mode_ticks[CONN_MODE_FAST],
+                        m_conn_gov.update_cnt, m_conn_gov.update_max);
+        err_code = app_timer_stop(m_timer_conn_idle);
         APP_ERROR_CHECK(err_code);
+        //テレメトリの周期通知は接続毎に設定する
+        err_code = app_timer_stop(m_timer_telem);
+        APP_ERROR_CHECK(err_code);
+        m_telem.period = 0;
+        if (m_conn_gov.req != CONN_MODE_IDLE) {
+            //次の接続はPPCP(省電力)から始める
+            conn_mode_request(CONN_MODE_IDLE);
+        }
+
+        ble_advertising_start();
         break;
 
+    //SMP(SEC_PARAMS_REQUEST, AUTH_STATUS, SEC_INFO_REQUEST)は
+    //Device Managerが処理し、鍵とSystem Attributeをpstorageに保存する
+
     //Advertisingか認証のタイムアウト発生
     case BLE_GAP_EVT_TIMEOUT:
         app_trace_log("BLE_GAP_EVT_TIMEOUT\r\n");
         switch (p_ble_evt->evt.gap_evt.params.timeout.src) {
         case BLE_GAP_TIMEOUT_SRC_ADVERTISEMENT: //Advertisingのタイムアウト
-            /* Advertising LEDを消灯 */
-            led_off(LED_PIN_NO_ADVERTISING);
-
-            /* System-OFFにする(もう戻ってこない) */
-            err_code = sd_power_system_off();
-            APP_ERROR_CHECK(err_code);
+            adv_phase_account();
+#ifdef ADV_BCAST_RF_EVENT
+            if (m_adv.phase == ADV_PHASE_BURST) {
+                /* BURST前のフェーズへ戻る(タイムアウトはやり直し) */
+                adv_phase_start(m_bcast.resume);
+            }
+            else if ((m_adv.phase == ADV_PHASE_DIRECT) && m_bcast.deferred) {
+                /* DIRECT中に来たRFイベントをBURSTで流し、FASTへ進む */
+                m_bcast.deferred = false;
+                m_bcast.resume = ADV_PHASE_FAST;
+                adv_phase_start(ADV_PHASE_BURST);
+            }
+            else
+#endif  //ADV_BCAST_RF_EVENT
+            if (m_adv.phase + 1 < ADV_PHASE_BURST) {
+                /* 次のフェーズへ */
+                adv_phase_start((adv_phase_t)(m_adv.phase + 1));
+            }
+            else {
+                /* System-OFFにする(IRQで起動し直す) */
+                system_off();
+            }
             break;
 
         case BLE_GAP_TIMEOUT_SRC_SECURITY_REQUEST:  //Security requestのタイムアウト
@@ -934,14 +2891,13 @@ static void ble_evt_handler(ble_evt_t *p_ble_evt)
      * GATT Server event
      *********************/
 
-    //接続後、Bondingした相手からSystem Attribute要求を受信したとき
-    //System Attributeは、EVT_DISCONNECTEDで保持するが、今回は保持しないのでNULLを返す。
-    case BLE_GATTS_EVT_SYS_ATTR_MISSING:
-        app_trace_log("BLE_GATTS_EVT_SYS_ATTR_MISSING\r\n");
-        err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0);
-        APP_ERROR_CHECK(err_code);
+    //Centralからの書込み
+    case BLE_GATTS_EVT_WRITE:
+        ble_conn_activity();
         break;
 
+    //BLE_GATTS_EVT_SYS_ATTR_MISSINGはDevice Managerが保存済みの値で応答する
+
     default:
         // No implementation needed.
         break;
@@ -958,11 +2914,21 @@ static void ble_evt_handler(ble_evt_t *p_ble_evt)
  */
 static void ble_evt_dispatch(ble_evt_t *p_ble_evt)
 {
+    //System Attributeを復元してから各サービスに渡す
+    dm_ble_evt_handler(p_ble_evt);
     ble_evt_handler(p_ble_evt);
     ble_conn_params_on_ble_evt(p_ble_evt);
 
     //I/O Service
     ble_fps_on_ble_evt(&m_fps, p_ble_evt);
+    if (p_ble_evt->header.evt_id == BLE_EVT_TX_COMPLETE) {
+        //送信キューが空いたので、送れなかったメッセージを送り直す
+        ble_tx_ready();
+    }
+    else if (p_ble_evt->header.evt_id == BLE_GAP_EVT_DISCONNECTED) {
+        //送れなかったメッセージは次の接続に持ち越さない
+        ble_tx_clear();
+    }
 
 #ifdef BLE_DFU_APP_SUPPORT
     /** @snippet [Propagating BLE Stack events to DFU Service] */
@@ -989,8 +2955,7 @@ static void ble_evt_dispatch(ble_evt_t *p_ble_evt)
  */
 static void sys_evt_dispatch(uint32_t sys_evt)
 {
-    //ここでは異常発生のように扱っているが、必ずそうではないようなので、
-    //実装する際には注意しよう。
-    app_error_handler(DEAD_BEEF, 0, NULL);
+    //Flash操作の完了(NRF_EVT_FLASH_OPERATION_xxx)
+    pstorage_sys_event_handler(sys_evt);
 }
 
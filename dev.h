@@ -33,6 +33,42 @@
 #include "ble_fps.h"
 
 
+/**************************************************************************
+ * typedef
+ **************************************************************************/
+
+/**
+ * @brief スケジューラの優先度
+ *
+ * 値の小さい方が先に実行される。
+ */
+typedef enum dev_prio_t {
+    DEV_PRIO_RF,                ///< RFイベントの後処理(Connection間隔、ブロードキャスト)
+    DEV_PRIO_BLE,               ///< SoftDeviceイベント、タイマ
+    DEV_PRIO_UI,                ///< LCD表示
+    DEV_PRIO_HOUSEKEEPING,      ///< フラッシュへの保存など
+    DEV_PRIO_NUM
+} dev_prio_t;
+
+/** スケジューラのイベントハンドラ(app_timer_timeout_handler_tと同じ形) */
+typedef void (*dev_sched_handler_t)(void *p_context);
+
+/** I2Cバスの利用者(統計用) */
+typedef enum dev_bus_user_t {
+    DEV_BUS_RF,                 ///< RC-S730のIRQ処理(無線イベント中でもすぐに行う)
+    DEV_BUS_UI,                 ///< LCD表示(無線イベントの合間に行う)
+    DEV_BUS_CONFIG,             ///< RC-S730の設定など(一括実行)
+    DEV_BUS_NUM
+} dev_bus_user_t;
+
+/** I2Cの一連の転送(dev_bus_begin()からdev_bus_end()まで) */
+typedef struct dev_bus_t {
+    uint32_t        start;                      ///< 開始時刻
+    uint32_t        radio_events;               ///< 開始時の無線イベント数
+    bool            radio_active;               ///< 開始時に無線イベント中だった
+} dev_bus_t;
+
+
 /**************************************************************************
  * prototype
  **************************************************************************/
@@ -40,17 +76,33 @@
 /* DEV */
 void dev_init(void);
 void dev_event_exec(void);
+bool dev_is_resumed(void);
+uint32_t dev_sched_put(dev_prio_t prio, dev_sched_handler_t handler, void *p_context);
+void dev_telem_rf_response(uint32_t ticks);
+void dev_rf_retry(void);
+void dev_bus_begin(dev_bus_t *p_bus);
+void dev_bus_end(dev_bus_t *p_bus, dev_bus_user_t user);
 
 /* LED */
 void led_on(int pin);
 void led_off(int pin);
 
+/* LCD */
+void lcd_show(const char *p_str);
+
 /* BLE */
 void ble_advertising_start(void);
 #ifdef BLE_DFU_APP_SUPPORT
 void advertising_stop(void)
 #endif	//BLE_DFU_APP_SUPPORT
 int ble_is_connected(void);
-void ble_nofify(const uint8_t *p_data, uint16_t length);
+void ble_conn_activity(void);
+void ble_broadcast_rf_event(uint8_t cmd, uint8_t status, const uint8_t *p_idm, uint16_t svc_code);
+uint32_t ble_nofify(const uint8_t *p_data, uint16_t length);
+uint32_t ble_send(uint8_t type, const uint8_t *p_data, uint16_t length);
+uint32_t ble_queue(uint8_t type, const uint8_t *p_data, uint16_t length);
+void ble_blk_buffer_set(uint8_t *p_buf, uint8_t *p_shadow, uint16_t size);
+void ble_blk_window_set(uint8_t *p_buf, uint8_t *p_shadow, uint16_t size);
+bool ble_blk_bulk_active(void);
 
 #endif /* DEV_H */
@@ -0,0 +1,54 @@
+/** FeliCa block image
+ *
+ * @file    blkimage.c
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#include <string.h>
+#include "blkimage.h"
+
+
+//layout is shared with the central
+typedef char blkimg_size_check[(sizeof(BLKIMG_image_t) == BLKIMG_SIZE) ? 1 : -1];
+typedef char blkimg_hdr_check[(sizeof(BLKIMG_header_t) == BLKIMG_HDR_SIZE) ? 1 : -1];
+typedef char blkimg_offset_check[(offsetof(BLKIMG_image_t, Data) == BLKIMG_BLK_OFFSET(0)) ? 1 : -1];
+
+
+void BLKIMG_init(BLKIMG_image_t *pImage)
+{
+    memset(pImage, 0, sizeof(BLKIMG_image_t));
+    pImage->Hdr.Version = BLKIMG_VERSION;
+}
+
+
+bool BLKIMG_validate(const BLKIMG_header_t *pHdr)
+{
+    if ((pHdr->Version != BLKIMG_VERSION) || (pHdr->SvcNum > BLKIMG_SVC_MAX)) {
+        return false;
+    }
+    for (int i = 0; i < pHdr->SvcNum; i++) {
+        if (pHdr->Svc[i].First + pHdr->Svc[i].Num > BLKIMG_BLK_MAX) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int BLKIMG_index(const BLKIMG_header_t *pHdr, uint16_t SvcCode, uint8_t Blk)
+{
+    //index may be rewritten by the central while a reader is served(IRQ),
+    //so never go out of the image
+    for (int i = 0; (i < pHdr->SvcNum) && (i < BLKIMG_SVC_MAX); i++) {
+        if (pHdr->Svc[i].SvcCode == SvcCode) {
+            if ((Blk >= pHdr->Svc[i].Num) || (pHdr->Svc[i].First + Blk >= BLKIMG_BLK_MAX)) {
+                return -1;
+            }
+            return pHdr->Svc[i].First + Blk;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,91 @@
+/** FeliCa block image
+ *
+ * @file    blkimage.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Block data served to a reader by Read/Write w/o Encryption.
+ * The central uploads the whole structure as is (little endian),
+ * and updates a part of it later(for example, one block at BLKIMG_BLK_OFFSET(n)).
+ */
+
+#ifndef BLKIMAGE_H
+#define BLKIMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define BLKIMG_VERSION          (1)         //!< image format version
+#define BLKIMG_BLK_SIZE         (16)        //!< block size
+#define BLKIMG_SVC_MAX          (4)         //!< max number of services
+#define BLKIMG_BLK_MAX          (30)        //!< max number of blocks(all services)
+
+/** header size(version and service index) */
+#define BLKIMG_HDR_SIZE         (4 + 4 * BLKIMG_SVC_MAX)
+
+/** image size */
+#define BLKIMG_SIZE             (BLKIMG_HDR_SIZE + BLKIMG_BLK_SIZE * BLKIMG_BLK_MAX)
+
+/** offset of block data in image */
+#define BLKIMG_BLK_OFFSET(idx)  (BLKIMG_HDR_SIZE + BLKIMG_BLK_SIZE * (idx))
+
+#if (BLKIMG_SIZE > 512)
+#error block image must be within 512 bytes(max attribute length)
+#endif
+
+
+/** service index entry */
+typedef struct BLKIMG_service_t {
+    uint16_t    SvcCode;            //!< Service Code
+    uint8_t     First;              //!< first block index in Data[]
+    uint8_t     Num;                //!< number of blocks
+} BLKIMG_service_t;
+
+
+/** image header */
+typedef struct BLKIMG_header_t {
+    uint8_t             Version;                    //!< BLKIMG_VERSION
+    uint8_t             SvcNum;                     //!< number of valid Svc[]
+    uint16_t            Seq;                        //!< image sequence number(set by the central)
+    BLKIMG_service_t    Svc[BLKIMG_SVC_MAX];        //!< service index
+} BLKIMG_header_t;
+
+
+/** block image */
+typedef struct BLKIMG_image_t {
+    BLKIMG_header_t     Hdr;                        //!< header
+    uint8_t             Data[BLKIMG_BLK_MAX][BLKIMG_BLK_SIZE];  //!< block data
+} BLKIMG_image_t;
+
+
+/** clear image
+ *
+ * @param   [out]   pImage      image
+ */
+void BLKIMG_init(BLKIMG_image_t *pImage);
+
+
+/** check image header and service index
+ *
+ * @param   [in]    pHdr        image header
+ * @retval  true    image can be served
+ */
+bool BLKIMG_validate(const BLKIMG_header_t *pHdr);
+
+
+/** find block
+ *
+ * pHdr must be validated by BLKIMG_validate().
+ * The header and the blocks may be placed apart(RAM or flash),
+ * so this returns the index of the block, not the data.
+ *
+ * @param   [in]    pHdr        image header
+ * @param   [in]    SvcCode     Service Code
+ * @param   [in]    Blk         block number in the service
+ * @return  block index(0 - BLKIMG_BLK_MAX-1), or -1
+ */
+int BLKIMG_index(const BLKIMG_header_t *pHdr, uint16_t SvcCode, uint8_t Blk);
+
+#endif /* BLKIMAGE_H */
@@ -0,0 +1,530 @@
+/** FeliCa block image store
+ *
+ * @file    blkstore.c
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#include <string.h>
+#include "blkstore.h"
+#include "nrf.h"
+#include "nrf_error.h"
+#include "pstorage.h"
+#include "app_util_platform.h"
+
+
+#define PAGE_MAGIC      (0x534b4c42)    //"BLKS"
+#define PAGE_NONE       (0xff)
+#define REC_NUM         ((BLKSTORE_PAGE_SIZE - sizeof(page_hdr_t)) / sizeof(rec_t))
+#define REC_OFFSET(pos) (sizeof(page_hdr_t) + sizeof(rec_t) * (pos))
+#define BUF_NUM         (4)             //records in flight(<= PSTORAGE_CMD_QUEUE_SIZE)
+
+
+/** page header(first word of a page) */
+typedef struct page_hdr_t {
+    uint32_t    Magic;          //PAGE_MAGIC
+    uint32_t    Seq;            //page sequence : the largest is the head page
+} page_hdr_t;
+
+/** record
+ *
+ * Flash is written from the lower address, so the commit fields are placed last.
+ * A record cut off by reset is never taken as valid.
+ */
+typedef struct rec_t {
+    uint8_t     Data[BLKSTORE_DATA_SIZE];
+    uint16_t    Ver;            //version of the index
+    uint8_t     Idx;            //block index, or BLKSTORE_IDX_HDR
+    uint8_t     Check;          //~Idx
+} rec_t;
+
+typedef char rec_size_check[(sizeof(rec_t) % 4 == 0) ? 1 : -1];
+
+/** store buffer(kept until pstorage completes) */
+typedef struct buf_t {
+    union {
+        rec_t       Rec;
+        uint32_t    Align;      //flash is written by word
+    } u;
+    bool        Busy;
+    bool        Copy;           //true:copy by compaction
+    uint8_t     Page;
+    uint8_t     Pos;
+} buf_t;
+
+
+static pstorage_handle_t    _page[BLKSTORE_PAGE_NUM];
+static BLKSTORE_GETDATA_T   _getData;
+static const rec_t          *_newest[BLKSTORE_IDX_NUM];
+static uint16_t             _ver[BLKSTORE_IDX_NUM];     //last version written or in flight
+static volatile uint32_t    _dirty;
+static uint8_t              _head;
+static uint8_t              _pos;           //next record position in the head page
+static page_hdr_t           _pageHdr;       //head page header(store buffer)
+static bool                 _hdrPending;
+static uint8_t              _erase;         //pages to erase(bit)
+static uint8_t              _gc;            //page under compaction, or PAGE_NONE
+static uint8_t              _pending;       //pstorage operations in flight
+static buf_t                _buf[BUF_NUM];
+static BLKSTORE_stat_t      _stat;
+
+
+static void pump(void);
+static bool append(void);
+static bool compact(void);
+static void rotate(void);
+static bool rec_store(buf_t *pBuf, bool Copy);
+static void rec_done(buf_t *pBuf, bool Ok);
+static void storage_cb(pstorage_handle_t *pHandle, uint8_t OpCode, uint32_t Result, uint8_t *pData, uint32_t DataLen);
+
+
+static const page_hdr_t *page_addr(uint8_t Page)
+{
+    return (const page_hdr_t *)_page[Page].block_id;
+}
+
+
+static const rec_t *rec_addr(uint8_t Page, uint8_t Pos)
+{
+    return (const rec_t *)(_page[Page].block_id + REC_OFFSET(Pos));
+}
+
+
+static uint8_t rec_page(const rec_t *pRec)
+{
+    for (uint8_t p = 0; p < BLKSTORE_PAGE_NUM; p++) {
+        if (((uint32_t)pRec >= _page[p].block_id) && ((uint32_t)pRec < _page[p].block_id + BLKSTORE_PAGE_SIZE)) {
+            return p;
+        }
+    }
+    return PAGE_NONE;
+}
+
+
+static bool rec_valid(const rec_t *pRec)
+{
+    return (pRec->Idx < BLKSTORE_IDX_NUM) && ((uint8_t)(pRec->Check ^ pRec->Idx) == 0xff);
+}
+
+
+static bool is_erased(const void *pAddr, uint32_t Len)
+{
+    const uint32_t *p = (const uint32_t *)pAddr;
+
+    for (uint32_t i = 0; i < Len / sizeof(uint32_t); i++) {
+        if (p[i] != 0xffffffff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool ver_newer(uint16_t Ver, uint16_t Base)
+{
+    return (int16_t)(Ver - Base) > 0;
+}
+
+
+static uint8_t data_len(uint8_t Idx)
+{
+    return (Idx == BLKSTORE_IDX_HDR) ? BLKIMG_HDR_SIZE : BLKIMG_BLK_SIZE;
+}
+
+
+static buf_t *buf_alloc(void)
+{
+    for (int i = 0; i < BUF_NUM; i++) {
+        if (!_buf[i].Busy) {
+            return &_buf[i];
+        }
+    }
+    return NULL;
+}
+
+
+uint32_t BLKSTORE_init(BLKSTORE_GETDATA_T pGetData)
+{
+    uint32_t err_code;
+    pstorage_module_param_t param;
+    uint8_t valid = 0;
+    uint32_t seq = 0;
+
+    if (NRF_FICR->CODEPAGESIZE != BLKSTORE_PAGE_SIZE) {
+        return NRF_ERROR_NOT_SUPPORTED;
+    }
+
+    _getData = pGetData;
+    _dirty = 0;
+    _erase = 0;
+    _gc = PAGE_NONE;
+    _pending = 0;
+    _hdrPending = false;
+    memset(_newest, 0, sizeof(_newest));
+    memset(_ver, 0, sizeof(_ver));
+    memset(_buf, 0, sizeof(_buf));
+    memset(&_stat, 0, sizeof(_stat));
+
+    //one page per module : pstorage_clear() erases a whole module
+    param.cb = storage_cb;
+    param.block_size = BLKSTORE_PAGE_SIZE;
+    param.block_count = 1;
+    for (uint8_t p = 0; p < BLKSTORE_PAGE_NUM; p++) {
+        err_code = pstorage_register(&param, &_page[p]);
+        if (err_code != NRF_SUCCESS) {
+            return err_code;
+        }
+    }
+
+    //head page : the largest sequence
+    for (uint8_t p = 0; p < BLKSTORE_PAGE_NUM; p++) {
+        const page_hdr_t *p_hdr = page_addr(p);
+
+        if (p_hdr->Magic == PAGE_MAGIC) {
+            if ((valid == 0) || ((int32_t)(p_hdr->Seq - seq) > 0)) {
+                seq = p_hdr->Seq;
+                _head = p;
+            }
+            valid |= 1 << p;
+        }
+        else if (!is_erased(p_hdr, BLKSTORE_PAGE_SIZE)) {
+            //broken header or other data
+            _erase |= 1 << p;
+        }
+    }
+    _pageHdr.Magic = PAGE_MAGIC;
+    if (valid == 0) {
+        //empty : start from page 0
+        _head = 0;
+        _pos = 0;
+        _pageHdr.Seq = 0;
+        _hdrPending = true;
+        return NRF_SUCCESS;
+    }
+    _pageHdr.Seq = seq;
+
+    //newest record of each index
+    //  search from the head page backward, so a copy wins over its original
+    for (uint8_t k = 0; k < BLKSTORE_PAGE_NUM; k++) {
+        uint8_t p = (_head + BLKSTORE_PAGE_NUM - k) % BLKSTORE_PAGE_NUM;
+
+        if ((valid & (1 << p)) == 0) {
+            continue;
+        }
+        for (uint8_t pos = 0; pos < REC_NUM; pos++) {
+            const rec_t *p_rec = rec_addr(p, pos);
+
+            if (rec_valid(p_rec)
+              && ((_newest[p_rec->Idx] == NULL) || ver_newer(p_rec->Ver, _ver[p_rec->Idx]))) {
+                _newest[p_rec->Idx] = p_rec;
+                _ver[p_rec->Idx] = p_rec->Ver;
+            }
+        }
+    }
+
+    //append after the last written record(a broken one is not reused)
+    _pos = REC_NUM;
+    while ((_pos > 0) && is_erased(rec_addr(_head, _pos - 1), sizeof(rec_t))) {
+        _pos--;
+    }
+
+    //the page after the head must be erased : compaction was cut off
+    if (valid & (1 << ((_head + 1) % BLKSTORE_PAGE_NUM))) {
+        _gc = (_head + 1) % BLKSTORE_PAGE_NUM;
+    }
+
+    return NRF_SUCCESS;
+}
+
+
+const uint8_t *BLKSTORE_find(uint8_t Idx)
+{
+    if ((Idx >= BLKSTORE_IDX_NUM) || (_newest[Idx] == NULL)) {
+        return NULL;
+    }
+    return _newest[Idx]->Data;
+}
+
+
+void BLKSTORE_write(uint8_t Idx)
+{
+    if (Idx >= BLKSTORE_IDX_NUM) {
+        return;
+    }
+
+    CRITICAL_REGION_ENTER();
+    _dirty |= 1UL << Idx;
+    CRITICAL_REGION_EXIT();
+}
+
+
+void BLKSTORE_process(void)
+{
+    pump();
+}
+
+
+bool BLKSTORE_idle(void)
+{
+    return (_dirty == 0) && (_pending == 0) && (_erase == 0) && (_gc == PAGE_NONE) && !_hdrPending;
+}
+
+
+void BLKSTORE_getStat(BLKSTORE_stat_t *pStat)
+{
+    *pStat = _stat;
+}
+
+
+/** issue pstorage operations as far as possible
+ *
+ * order : erase -> page header -> compaction -> requested records
+ */
+static void pump(void)
+{
+    uint32_t err_code;
+
+    while (true) {
+        if (_erase != 0) {
+            for (uint8_t p = 0; p < BLKSTORE_PAGE_NUM; p++) {
+                if (_erase & (1 << p)) {
+                    err_code = pstorage_clear(&_page[p], BLKSTORE_PAGE_SIZE);
+                    if (err_code != NRF_SUCCESS) {
+                        _stat.Errors++;
+                        return;
+                    }
+                    _erase &= ~(1 << p);
+                    _pending++;
+                }
+            }
+            continue;
+        }
+        if (_hdrPending) {
+            //the page must be erased before
+            if (_pending != 0) {
+                return;
+            }
+            err_code = pstorage_store(&_page[_head], (uint8_t *)&_pageHdr, sizeof(page_hdr_t), 0);
+            if (err_code != NRF_SUCCESS) {
+                _stat.Errors++;
+                return;
+            }
+            _hdrPending = false;
+            _pending++;
+            _stat.FlashBytes += sizeof(page_hdr_t);
+            continue;
+        }
+        if (_gc != PAGE_NONE) {
+            if (!compact()) {
+                return;
+            }
+            continue;
+        }
+        if (_dirty != 0) {
+            if (_pos >= REC_NUM) {
+                //head page is full
+                if (_pending != 0) {
+                    return;
+                }
+                rotate();
+                continue;
+            }
+            if (!append()) {
+                return;
+            }
+            continue;
+        }
+        return;
+    }
+}
+
+
+/** write one requested record */
+static bool append(void)
+{
+    buf_t *p_buf = buf_alloc();
+    uint8_t idx;
+
+    if (p_buf == NULL) {
+        return false;
+    }
+
+    for (idx = 0; (_dirty & (1UL << idx)) == 0; idx++) {
+        ;
+    }
+
+    //clear before copy : an update during the copy marks it again
+    CRITICAL_REGION_ENTER();
+    _dirty &= ~(1UL << idx);
+    CRITICAL_REGION_EXIT();
+
+    memset(p_buf->u.Rec.Data, 0xff, BLKSTORE_DATA_SIZE);
+    memcpy(p_buf->u.Rec.Data, _getData(idx), data_len(idx));
+    p_buf->u.Rec.Ver = _ver[idx] + 1;
+    p_buf->u.Rec.Idx = idx;
+    p_buf->u.Rec.Check = (uint8_t)~idx;
+    if (!rec_store(p_buf, false)) {
+        BLKSTORE_write(idx);
+        return false;
+    }
+    _ver[idx]++;
+    _stat.Records++;
+    _stat.UserBytes += data_len(idx);
+
+    return true;
+}
+
+
+/** copy live records of the oldest page(_gc) to the head page, then erase it */
+static bool compact(void)
+{
+    uint32_t err_code;
+
+    for (uint8_t idx = 0; idx < BLKSTORE_IDX_NUM; idx++) {
+        bool copying = false;
+        buf_t *p_buf;
+
+        if ((_newest[idx] == NULL) || (rec_page(_newest[idx]) != _gc)) {
+            continue;
+        }
+        for (int i = 0; i < BUF_NUM; i++) {
+            if (_buf[i].Busy && _buf[i].Copy && (_buf[i].u.Rec.Idx == idx)) {
+                copying = true;
+            }
+        }
+        if (copying) {
+            continue;
+        }
+
+        //live records(<= BLKSTORE_IDX_NUM) always fit in a new head page
+        p_buf = buf_alloc();
+        if ((p_buf == NULL) || (_pos >= REC_NUM)) {
+            return false;
+        }
+        memcpy(&p_buf->u.Rec, _newest[idx], sizeof(rec_t));
+        if (!rec_store(p_buf, true)) {
+            return false;
+        }
+        _stat.Copies++;
+    }
+
+    //erase after all copies are written(a failed copy is retried above)
+    if (_pending != 0) {
+        return false;
+    }
+    if (!is_erased(page_addr(_gc), BLKSTORE_PAGE_SIZE)) {
+        err_code = pstorage_clear(&_page[_gc], BLKSTORE_PAGE_SIZE);
+        if (err_code != NRF_SUCCESS) {
+            _stat.Errors++;
+            return false;
+        }
+        _pending++;
+    }
+    _gc = PAGE_NONE;
+
+    return true;
+}
+
+
+/** move the head to the next(erased) page and compact the oldest page */
+static void rotate(void)
+{
+    _head = (_head + 1) % BLKSTORE_PAGE_NUM;
+    _pos = 0;
+    _pageHdr.Seq++;
+    _hdrPending = true;
+    if (!is_erased(page_addr(_head), BLKSTORE_PAGE_SIZE)) {
+        _erase |= 1 << _head;
+    }
+    _gc = (_head + 1) % BLKSTORE_PAGE_NUM;
+}
+
+
+static bool rec_store(buf_t *pBuf, bool Copy)
+{
+    uint32_t err_code;
+
+    err_code = pstorage_store(&_page[_head], (uint8_t *)&pBuf->u.Rec, sizeof(rec_t), REC_OFFSET(_pos));
+    if (err_code != NRF_SUCCESS) {
+        _stat.Errors++;
+        return false;
+    }
+    pBuf->Busy = true;
+    pBuf->Copy = Copy;
+    pBuf->Page = _head;
+    pBuf->Pos = _pos;
+    _pos++;
+    _pending++;
+    _stat.FlashBytes += sizeof(rec_t);
+
+    return true;
+}
+
+
+static void rec_done(buf_t *pBuf, bool Ok)
+{
+    const rec_t *p_rec = rec_addr(pBuf->Page, pBuf->Pos);
+    uint8_t idx = pBuf->u.Rec.Idx;
+
+    if (!Ok) {
+        if (!pBuf->Copy) {
+            BLKSTORE_write(idx);
+        }
+        return;
+    }
+
+    if (pBuf->Copy) {
+        //not superseded during the copy
+        if ((_newest[idx] != NULL) && (_newest[idx]->Ver == p_rec->Ver)) {
+            _newest[idx] = p_rec;
+        }
+    }
+    else if ((_newest[idx] == NULL) || ver_newer(p_rec->Ver, _newest[idx]->Ver)) {
+        _newest[idx] = p_rec;
+    }
+}
+
+
+static void storage_cb(pstorage_handle_t *pHandle, uint8_t OpCode, uint32_t Result, uint8_t *pData, uint32_t DataLen)
+{
+    _pending--;
+    if (Result != NRF_SUCCESS) {
+        _stat.Errors++;
+    }
+
+    switch (OpCode) {
+    case PSTORAGE_STORE_OP_CODE:
+        if (pData == (uint8_t *)&_pageHdr) {
+            if (Result != NRF_SUCCESS) {
+                _hdrPending = true;
+            }
+            break;
+        }
+        for (int i = 0; i < BUF_NUM; i++) {
+            if (_buf[i].Busy && (pData == (uint8_t *)&_buf[i].u.Rec)) {
+                rec_done(&_buf[i], Result == NRF_SUCCESS);
+                _buf[i].Busy = false;
+                break;
+            }
+        }
+        break;
+
+    case PSTORAGE_CLEAR_OP_CODE:
+        for (uint8_t p = 0; p < BLKSTORE_PAGE_NUM; p++) {
+            if (pHandle->block_id == _page[p].block_id) {
+                if (Result == NRF_SUCCESS) {
+                    _stat.Erases++;
+                }
+                else {
+                    _erase |= 1 << p;
+                }
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    pump();
+}
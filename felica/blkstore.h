@@ -0,0 +1,115 @@
+/** FeliCa block image store
+ *
+ * @file    blkstore.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Keeps the block image(blkimage.h) in flash with pstorage.
+ *
+ * The flash area is a log of fixed size records over BLKSTORE_PAGE_NUM pages.
+ * A record holds one block(or the image header) with a version of its own,
+ * and the newest version of a block supersedes the older ones.
+ * So updating a block writes one record, without erasing a page.
+ * When the head page is full, the log moves on to the next(erased) page,
+ * the live records of the oldest page are copied forward and the oldest page is erased.
+ * All pages are erased in turn(wear levelling).
+ *
+ * The newest records are used in place(BLKSTORE_find()), they need not be copied to RAM.
+ */
+
+#ifndef BLKSTORE_H
+#define BLKSTORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blkimage.h"
+
+
+#define BLKSTORE_PAGE_NUM       (4)                 //!< pages of the log(one pstorage module each)
+#define BLKSTORE_PAGE_SIZE      (1024)              //!< flash page size
+#define BLKSTORE_DATA_SIZE      (20)                //!< record payload size
+
+#define BLKSTORE_IDX_HDR        (BLKIMG_BLK_MAX)    //!< record index of the image header
+#define BLKSTORE_IDX_NUM        (BLKIMG_BLK_MAX + 1)//!< number of record indexes
+
+#if (BLKIMG_HDR_SIZE > BLKSTORE_DATA_SIZE) || (BLKIMG_BLK_SIZE > BLKSTORE_DATA_SIZE)
+#error image header and block must be within a record
+#endif
+#if (BLKSTORE_IDX_NUM > 32)
+#error record index must be within 32bit mask
+#endif
+
+
+/** get current data to write
+ *
+ * @param   [in]    Idx     block index, or BLKSTORE_IDX_HDR
+ * @return  data(BLKIMG_BLK_SIZE bytes, or BLKIMG_HDR_SIZE bytes for the header)
+ */
+typedef const uint8_t *(*BLKSTORE_GETDATA_T)(uint8_t Idx);
+
+
+/** statistics */
+typedef struct BLKSTORE_stat_t {
+    uint32_t    UserBytes;          //!< payload bytes requested to store
+    uint32_t    FlashBytes;         //!< bytes written to flash(records, copies, page headers)
+    uint32_t    Records;            //!< records written by request
+    uint32_t    Copies;             //!< records copied by compaction
+    uint32_t    Erases;             //!< pages erased
+    uint32_t    Errors;             //!< pstorage errors
+} BLKSTORE_stat_t;
+
+
+/** initialize and scan the log
+ *
+ * Call after pstorage_init().
+ * Broken or unknown pages are erased later by BLKSTORE_process().
+ *
+ * @param   [in]    pGetData    data getter for BLKSTORE_process()
+ * @retval  NRF_SUCCESS     success
+ * @retval  other           pstorage error
+ */
+uint32_t BLKSTORE_init(BLKSTORE_GETDATA_T pGetData);
+
+
+/** find the newest record
+ *
+ * @param   [in]    Idx     block index, or BLKSTORE_IDX_HDR
+ * @return  data in flash, or NULL if never stored
+ */
+const uint8_t *BLKSTORE_find(uint8_t Idx);
+
+
+/** request to store
+ *
+ * Only marks the index. Data is taken by BLKSTORE_process(), so
+ * several updates before that are written as one record.
+ * Can be called from interrupt.
+ *
+ * @param   [in]    Idx     block index, or BLKSTORE_IDX_HDR
+ */
+void BLKSTORE_write(uint8_t Idx);
+
+
+/** write marked records
+ *
+ * Call from the main context(not interrupt). It continues by itself on pstorage events.
+ */
+void BLKSTORE_process(void);
+
+
+/** check whether all requests are written
+ *
+ * @retval  true    nothing to write
+ */
+bool BLKSTORE_idle(void);
+
+
+/** get statistics
+ *
+ * Write amplification is FlashBytes / UserBytes.
+ *
+ * @param   [out]   pStat       statistics
+ */
+void BLKSTORE_getStat(BLKSTORE_stat_t *pStat);
+
+#endif /* BLKSTORE_H */
@@ -12,10 +12,12 @@
 
 #define I2C_SLV_ADDR    (0x80)      //Default Slave Address(8bit)
 #define RETRY_NUM       (10)         //max I2C Retry count
+#define IRQ_BUDGET      (4)         //max INT_STATUS passes in RCS730_isrIrq()
 
 
 static uint8_t                  _slvAddr;
 static RCS730_callbacktable_t   _cbTable;
+static RCS730_stat_t            _stat;
 
 
 __STATIC_INLINE int set_tag_rf_send_enable(void)
@@ -24,6 +26,13 @@ __STATIC_INLINE int set_tag_rf_send_enable(void)
     return RCS730_pageWrite(RCS730_REG_TAG_TX_CTRL, (const uint8_t*)&val, sizeof(val));
 }
 
+static void timestamp(RCS730_TsPoint Point, uint8_t Cmd)
+{
+    if (_cbTable.pCbTimestamp) {
+        (*_cbTable.pCbTimestamp)(_cbTable.pUserData, Point, Cmd);
+    }
+}
+
 static int read_rf_buf(uint8_t *pData)
 {
     const int LEN_FIRST = 16;
@@ -52,6 +61,8 @@ void RCS730_init(void)
     _cbTable.pUserData = 0;
     _cbTable.pCbRxHTRDone = 0;
     _cbTable.pCbRxHTWDone = 0;
+    _cbTable.pCbRxPlDone = 0;
+    _cbTable.pCbTimestamp = 0;
 }
 
 
@@ -97,7 +108,13 @@ int RCS730_pageWrite(uint16_t MemAddr, const uint8_t *pData, uint8_t Length)
 
     do {
         ret = twi_master_transfer(_slvAddr, buf, (uint8_t)(2 + Length), TWI_ISSUE_STOP);
+        if (!ret) {
+            _stat.I2cFails++;
+        }
     } while (!ret && (retry--));
+    if (!ret) {
+        _stat.I2cErrors++;
+    }
 
     return (int)((ret) ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
 }
@@ -126,9 +143,18 @@ int RCS730_sequentialRead(uint16_t MemAddr, uint8_t *pData, uint8_t Length)
 
     do {
         ret = twi_master_transfer(_slvAddr, buf, 2, TWI_DONT_ISSUE_STOP);
+        if (!ret) {
+            _stat.I2cFails++;
+        }
     } while (!ret && (retry--));
     if (ret) {
         ret = twi_master_transfer((uint8_t)(_slvAddr | TWI_READ_BIT), pData, Length, TWI_ISSUE_STOP);
+        if (!ret) {
+            _stat.I2cFails++;
+        }
+    }
+    if (!ret) {
+        _stat.I2cErrors++;
     }
 
     return (int)((ret) ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
@@ -228,13 +254,34 @@ int RCS730_initFTMode(RCS730_OpMode Mode)
 
     ret = RCS730_setRegOpMode(Mode);
     if (ret == 0) {
-        ret = RCS730_setRegInterruptMask(RCS730_MSK_INT_TAG_RW_RX_DONE2, 0);
+        ret = RCS730_setRegInterruptMask(RCS730_MSK_INT_TAG_RW_RX_DONE2 | RCS730_MSK_INT_TAG_PL_RX_DONE, 0);
     }
 
     return ret;
 }
 
 
+int RCS730_resumeFTMode(RCS730_OpMode Mode)
+{
+    const uint32_t msk = RCS730_MSK_INT_TAG_RW_RX_DONE2 | RCS730_MSK_INT_TAG_PL_RX_DONE;
+    int ret;
+    uint32_t opmode;
+    uint32_t intmask;
+
+    ret = RCS730_readRegister(RCS730_REG_OPMODE, &opmode);
+    if (ret == 0) {
+        ret = RCS730_readRegister(RCS730_REG_INT_MASK, &intmask);
+    }
+    if ((ret == 0) && ((opmode & RCS730_REG_MASK_VAL) == (uint32_t)Mode) && ((intmask & msk) == 0)) {
+        //chip state was kept
+        return 0;
+    }
+
+    ret = RCS730_initFTMode(Mode);
+    return (ret == 0) ? 1 : ret;
+}
+
+
 #if 0
 int RCS730_initNfcDepMode(void)
 {
@@ -250,29 +297,76 @@ int RCS730_initNfcDepMode(void)
 #endif
 
 
-void RCS730_isrIrq(void)
+bool RCS730_isrIrq(void)
 {
     int ret;
-    bool b_send = false;
+    int pass;
+    bool b_send;
+    uint8_t cmd = 0;
     uint32_t intstat;
     uint8_t rf_buf[256];
 
-    ret = RCS730_readRegister(RCS730_REG_INT_STATUS, &intstat);
-    if (ret == 0) {
+    _stat.IrqCount++;
+    timestamp(RCS730_TS_IRQ, 0);
+    for (pass = 0; ; pass++) {
+        ret = RCS730_readRegister(RCS730_REG_INT_STATUS, &intstat);
+        if (ret != 0) {
+            //unknown whether an event is left
+            _stat.IrqMissed++;
+            return true;
+        }
+        if (intstat == 0) {
+            if (pass == 0) {
+                //already serviced in the previous call
+                _stat.IrqEmpty++;
+            }
+            break;
+        }
+        if (pass == IRQ_BUDGET) {
+            //leave it to the caller
+            _stat.IrqMissed++;
+            return true;
+        }
+        timestamp(RCS730_TS_STATUS, 0);
+        _stat.IrqEvents++;
+        if (pass > 0) {
+            //arrived while servicing, would have needed another IRQ edge
+            _stat.IrqCoalesced++;
+        }
+        b_send = false;
+
+        //clear before servicing.
+        //the next command may arrive as soon as the response is sent,
+        //clearing after that would lose its event.
+        RCS730_writeRegisterForce(RCS730_REG_INT_CLEAR, intstat);
+
+        if (_cbTable.pCbRxPlDone && (intstat & RCS730_MSK_INT_TAG_PL_RX_DONE)) {
+            //Polling Rx done : reader field is present
+            uint32_t rfstat = 0;
+            RCS730_readRegister(RCS730_REG_RF_STATUS, &rfstat);
+            timestamp(RCS730_TS_CB_ENTER, 0x00);
+            (*_cbTable.pCbRxPlDone)(_cbTable.pUserData, intstat, rfstat);
+            timestamp(RCS730_TS_CB_EXIT, 0x00);
+        }
 
         if (intstat & RCS730_MSK_INT_TAG_RW_RX_DONE2) {
             //Read or Write w/o Enc Rx done for HT block
             int len = read_rf_buf(rf_buf);
             if (len > 0) {
-                switch (rf_buf[1]) {
+                cmd = rf_buf[1];
+                switch (cmd) {
                     case 0x06:  //Read w/o Enc
                         if (_cbTable.pCbRxHTRDone) {
+                            timestamp(RCS730_TS_CB_ENTER, 0x06);
                             b_send = (*_cbTable.pCbRxHTRDone)(_cbTable.pUserData, rf_buf, len);
+                            timestamp(RCS730_TS_CB_EXIT, 0x06);
                         }
                         break;
                     case 0x08:  //Write w/o Enc;
                         if (_cbTable.pCbRxHTWDone) {
+                            timestamp(RCS730_TS_CB_ENTER, 0x08);
                             b_send = (*_cbTable.pCbRxHTWDone)(_cbTable.pUserData, rf_buf, len);
+                            timestamp(RCS730_TS_CB_EXIT, 0x08);
                         }
                         break;
                     default:
@@ -302,10 +396,24 @@ void RCS730_isrIrq(void)
         if (b_send) {
             ret = RCS730_pageWrite(RCS730_BUF_RF_COMM, rf_buf, rf_buf[0]);
             if (ret == 0) {
+                timestamp(RCS730_TS_RESPONSE, cmd);
                 set_tag_rf_send_enable();
+                timestamp(RCS730_TS_TX_ENABLE, cmd);
             }
         }
-
-        RCS730_writeRegisterForce(RCS730_REG_INT_CLEAR, intstat);
     }
+
+    return false;
+}
+
+
+void RCS730_getStat(RCS730_stat_t *pStat)
+{
+    *pStat = _stat;
+}
+
+
+void RCS730_irqGiveUp(void)
+{
+    _stat.IrqGiveUps++;
 }
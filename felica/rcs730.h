@@ -16,6 +16,38 @@
 /** callback function type */
 typedef bool (*RCS730_CALLBACK_T)(void *pUser, uint8_t *pData, uint8_t Len);
 
+/** event callback function type
+ *
+ * @param   [in]    pUser       User Data pointer
+ * @param   [in]    IntStat     INT_STATUS register value
+ * @param   [in]    RfStatus    RF_STATUS register value
+ */
+typedef void (*RCS730_EVENT_CALLBACK_T)(void *pUser, uint32_t IntStat, uint32_t RfStatus);
+
+/** timestamp points of a transaction in RCS730_isrIrq()
+ *
+ * @enum    TsPoint
+ */
+typedef enum RCS730_TsPoint {
+    RCS730_TS_IRQ,                  //!< RCS730_isrIrq() entry
+    RCS730_TS_STATUS,               //!< INT_STATUS read(with events)
+    RCS730_TS_CB_ENTER,             //!< callback entry
+    RCS730_TS_CB_EXIT,              //!< callback exit
+    RCS730_TS_RESPONSE,             //!< response written to RF buffer
+    RCS730_TS_TX_ENABLE,            //!< TX enabled
+    RCS730_TS_NUM
+} RCS730_TsPoint;
+
+/** timestamp callback function type
+ *
+ * Called from RCS730_isrIrq(), so keep it short.
+ *
+ * @param   [in]    pUser       User Data pointer
+ * @param   [in]    Point       timestamp point
+ * @param   [in]    Cmd         command code(0x00:Polling), valid from RCS730_TS_CB_ENTER
+ */
+typedef void (*RCS730_TIMESTAMP_T)(void *pUser, RCS730_TsPoint Point, uint8_t Cmd);
+
 
 #define RCS730_BLK_PAD0             ((uint16_t)0x0000)  //!< [addr]PAD0
 #define RCS730_BLK_PAD1             ((uint16_t)0x0001)  //!< [addr]PAD1
@@ -127,6 +159,8 @@ typedef struct RCS730_callbacktable_t {
     void                    *pUserData;         //!< User Data pointer
     RCS730_CALLBACK_T       pCbRxHTRDone;       //!< Rx Done(Read w/o Enc[HT mode])
     RCS730_CALLBACK_T       pCbRxHTWDone;       //!< Rx Done(Write w/o Enc[HT mode])
+    RCS730_EVENT_CALLBACK_T pCbRxPlDone;        //!< Rx Done(Polling) : reader field is present
+    RCS730_TIMESTAMP_T      pCbTimestamp;       //!< timestamp of each point(optional)
 #if 0
     RCS730_CALLBACK_T       pCbTxDone;          //!< Tx Done
     RCS730_CALLBACK_T       pCbRxDepDone;       //!< Rx Done(DEP mode)
@@ -135,6 +169,24 @@ typedef struct RCS730_callbacktable_t {
 } RCS730_callbacktable_t;
 
 
+/** Statistics
+ *
+ * @struct  stat_t
+ */
+typedef struct RCS730_stat_t {
+    uint32_t                IrqCount;           //!< RCS730_isrIrq() calls
+    uint32_t                IrqEvents;          //!< INT_STATUS passes with events
+    uint32_t                IrqCoalesced;       //!< passes after the first in one call(events while servicing)
+    uint32_t                IrqEmpty;           //!< calls with no event(serviced by the previous call)
+    uint32_t                IrqMissed;          //!< calls returned with events maybe left(budget over, I2C error)
+    uint32_t                IrqGiveUps;         //!< events left by the caller(RCS730_irqGiveUp())
+    uint32_t                I2cFails;           //!< I2C transfers failed(including the last retry)
+    uint32_t                I2cErrors;          //!< I2C accesses failed after all retries
+
+    // retried transfers = I2cFails - I2cErrors
+} RCS730_stat_t;
+
+
 /** constructor
  *
  */
@@ -300,10 +352,26 @@ int RCS730_goToInitializeStatus(void);
  *
  * @param   [in]    Mode    Operation Mode(OPMODE_LITES_HT or OPMODE_PLUG)
  * @retval  0       success
+ *
+ * @note
+ *      - Polling Rx done interrupt is also unmasked,
+ *        so that the host knows a reader is present before the first Read/Write command.
  */
 int RCS730_initFTMode(RCS730_OpMode Mode);
 
 
+/** resume FeliCa Through(FT) mode after the host was reset
+ *
+ * OPMODE and INT_MASK are kept by the chip, so they are only read back.
+ * Pending interrupts are not cleared, call RCS730_isrIrq() if IRQ pin is low.
+ *
+ * @param   [in]    Mode    Operation Mode(OPMODE_LITES_HT or OPMODE_PLUG)
+ * @retval  0       success(chip state was kept)
+ * @retval  1       success(chip was initialized again)
+ */
+int RCS730_resumeFTMode(RCS730_OpMode Mode);
+
+
 #if 0
 /** initialize to NFC-DEP mode
  *
@@ -315,7 +383,30 @@ int RCS730_initNfcDepMode(void);
 
 /** Interrupt Service Routine(IRQ pin)
  *
+ * Services INT_STATUS until it reads 0, so events arriving while servicing
+ * do not depend on another IRQ edge.
+ * The number of passes is bounded, the rest is left to the caller.
+ *
+ * @retval  false   no event is pending
+ * @retval  true    events may be left, call again later
+ */
+bool RCS730_isrIrq(void);
+
+
+/** Get statistics
+ *
+ * Counters are never cleared. Take the difference to reset.
+ *
+ * @param   [out]   pStat       statistics
+ */
+void RCS730_getStat(RCS730_stat_t *pStat);
+
+
+/** Count events left by the caller
+ *
+ * Call when RCS730_isrIrq() kept returning true and the caller
+ * stops calling it again right away.
  */
-void RCS730_isrIrq(void);
+void RCS730_irqGiveUp(void);
 
 #endif /* RCS730_H */
@@ -0,0 +1,242 @@
+/** RF transaction log
+ *
+ * @file    rflog.c
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#include <string.h>
+#include "rflog.h"
+#include "app_util_platform.h"
+
+
+/** running summary of a command code */
+typedef struct sum_t {
+    uint32_t    Count;
+    uint32_t    Total;          //sum of response time
+    uint16_t    Min;
+    uint16_t    Max;
+} sum_t;
+
+
+static const uint8_t        _sumCmd[RFLOG_SUM_NUM] = { 0x00, 0x06, 0x08 };
+
+static RFLOG_record_t       _ring[RFLOG_NUM];
+static uint16_t             _seq;           //sequence number of the next record
+static uint16_t             _cnt;           //records in the ring
+static RFLOG_record_t       _cur;           //current transaction
+static bool                 _open;          //true:_cur is in use
+static uint32_t             _irq;           //ticks at RCS730_TS_IRQ
+static uint8_t              _pass;          //INT_STATUS passes in this IRQ
+static sum_t                _sum[RFLOG_SUM_NUM];
+
+
+static void trans_open(uint8_t Flags);
+static void trans_close(void);
+static uint16_t response(const RFLOG_record_t *pRec);
+
+
+/** ticks from the IRQ */
+static uint16_t delta(uint32_t Ticks)
+{
+    uint32_t d = (Ticks - _irq) & RFLOG_TICKS_MASK;
+    return (d < RFLOG_DELTA_NONE) ? (uint16_t)d : (uint16_t)(RFLOG_DELTA_NONE - 1);
+}
+
+
+static int sum_index(uint8_t Cmd)
+{
+    for (int i = 0; i < RFLOG_SUM_NUM; i++) {
+        if (_sumCmd[i] == Cmd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void RFLOG_reset(void)
+{
+    CRITICAL_REGION_ENTER();
+    _cnt = 0;
+    _open = false;
+    memset(_sum, 0, sizeof(_sum));
+    CRITICAL_REGION_EXIT();
+}
+
+
+void RFLOG_stamp(RCS730_TsPoint Point, uint8_t Cmd, uint32_t Ticks)
+{
+    uint16_t status;
+
+    switch (Point) {
+    case RCS730_TS_IRQ:
+        trans_close();
+        _irq = Ticks;
+        _pass = 0;
+        break;
+
+    case RCS730_TS_STATUS:
+        trans_close();
+        trans_open((_pass > 0) ? RFLOG_FLAG_COALESCED : 0);
+        _cur.Delta[RCS730_TS_STATUS - 1] = delta(Ticks);
+        _pass++;
+        break;
+
+    case RCS730_TS_CB_ENTER:
+        if (!_open) {
+            trans_open(0);
+        }
+        else if (_cur.Cmd != RFLOG_CMD_NONE) {
+            //second callback in this pass : new transaction with the same INT_STATUS read
+            status = _cur.Delta[RCS730_TS_STATUS - 1];
+            trans_close();
+            trans_open(RFLOG_FLAG_SHARED | ((_pass > 1) ? RFLOG_FLAG_COALESCED : 0));
+            _cur.Delta[RCS730_TS_STATUS - 1] = status;
+        }
+        _cur.Cmd = Cmd;
+        _cur.Delta[Point - 1] = delta(Ticks);
+        break;
+
+    default:
+        if (_open && (Point < RCS730_TS_NUM)) {
+            _cur.Delta[Point - 1] = delta(Ticks);
+        }
+        break;
+    }
+}
+
+
+void RFLOG_end(void)
+{
+    trans_close();
+}
+
+
+uint16_t RFLOG_getRecords(uint16_t Seq, RFLOG_record_t *pRec, uint16_t Num)
+{
+    uint16_t n = 0;
+
+    CRITICAL_REGION_ENTER();
+    uint16_t oldest = (uint16_t)(_seq - _cnt);
+    if ((uint16_t)(Seq - oldest) > _cnt) {
+        //older than the oldest(or wrapped)
+        Seq = oldest;
+    }
+    while ((n < Num) && (Seq != _seq)) {
+        pRec[n++] = _ring[Seq % RFLOG_NUM];
+        Seq++;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return n;
+}
+
+
+void RFLOG_getSummary(RFLOG_summary_t *pSum)
+{
+    uint16_t val[RFLOG_NUM];
+
+    for (int i = 0; i < RFLOG_SUM_NUM; i++) {
+        RFLOG_summary_t *p = &pSum[i];
+        int n = 0;
+
+        memset(p, 0, sizeof(RFLOG_summary_t));
+        p->Cmd = _sumCmd[i];
+
+        CRITICAL_REGION_ENTER();
+        p->Count = _sum[i].Count;
+        if (_sum[i].Count != 0) {
+            p->Min = _sum[i].Min;
+            p->Avg = (uint16_t)(_sum[i].Total / _sum[i].Count);
+            p->Max = _sum[i].Max;
+        }
+        for (uint16_t j = 0; j < _cnt; j++) {
+            const RFLOG_record_t *pRec = &_ring[(uint16_t)(_seq - 1 - j) % RFLOG_NUM];
+            uint16_t resp = response(pRec);
+            if ((pRec->Cmd == _sumCmd[i]) && (resp != RFLOG_DELTA_NONE)) {
+                val[n++] = resp;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (n == 0) {
+            continue;
+        }
+
+        //insertion sort(RFLOG_NUM at most)
+        for (int j = 1; j < n; j++) {
+            uint16_t v = val[j];
+            int k = j;
+            while ((k > 0) && (val[k - 1] > v)) {
+                val[k] = val[k - 1];
+                k--;
+            }
+            val[k] = v;
+        }
+        //nearest rank
+        p->P50 = val[(50 * n + 99) / 100 - 1];
+        p->P90 = val[(90 * n + 99) / 100 - 1];
+        p->P99 = val[(99 * n + 99) / 100 - 1];
+    }
+}
+
+
+/** start a transaction */
+static void trans_open(uint8_t Flags)
+{
+    _cur.Cmd = RFLOG_CMD_NONE;
+    _cur.Flags = Flags;
+    _cur.Irq = _irq;
+    for (int i = 0; i < RFLOG_DELTA_NUM; i++) {
+        _cur.Delta[i] = RFLOG_DELTA_NONE;
+    }
+    _open = true;
+}
+
+
+/** put the current transaction into the ring */
+static void trans_close(void)
+{
+    uint16_t resp;
+    int idx;
+
+    if (!_open) {
+        return;
+    }
+    _open = false;
+
+    _cur.Seq = _seq;
+    _ring[_seq % RFLOG_NUM] = _cur;
+    _seq++;
+    if (_cnt < RFLOG_NUM) {
+        _cnt++;
+    }
+
+    resp = response(&_cur);
+    idx = sum_index(_cur.Cmd);
+    if ((idx >= 0) && (resp != RFLOG_DELTA_NONE)) {
+        sum_t *p = &_sum[idx];
+
+        if ((p->Count == 0) || (resp < p->Min)) {
+            p->Min = resp;
+        }
+        if (resp > p->Max) {
+            p->Max = resp;
+        }
+        p->Count++;
+        p->Total += resp;
+    }
+}
+
+
+/** response time(ticks), or RFLOG_DELTA_NONE */
+static uint16_t response(const RFLOG_record_t *pRec)
+{
+    uint16_t resp = pRec->Delta[RCS730_TS_TX_ENABLE - 1];
+
+    if (resp == RFLOG_DELTA_NONE) {
+        resp = pRec->Delta[RCS730_TS_CB_EXIT - 1];
+    }
+    return resp;
+}
@@ -0,0 +1,101 @@
+/** RF transaction log
+ *
+ * @file    rflog.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Keeps the timestamps of RC-S730 transactions(RCS730_TIMESTAMP_T) in a ring of RFLOG_NUM records.
+ * A transaction starts at INT_STATUS read(or at the second callback in one pass),
+ * and its points are kept as ticks from the IRQ.
+ *
+ * The response time of a transaction is the ticks to RCS730_TS_TX_ENABLE,
+ * or to RCS730_TS_CB_EXIT if no response was sent(Polling, errors).
+ * Count, min, avg and max of the response time are kept per command code since RFLOG_reset(),
+ * the percentiles are taken from the records in the ring.
+ */
+
+#ifndef RFLOG_H
+#define RFLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "rcs730.h"
+
+
+#define RFLOG_NUM               (32)                //!< records in the ring
+#define RFLOG_SUM_NUM           (3)                 //!< command codes summarized(Polling, Read, Write)
+#define RFLOG_DELTA_NUM         (RCS730_TS_NUM - 1) //!< points after RCS730_TS_IRQ
+#define RFLOG_TICKS_MASK        (0x00ffffff)        //!< counter width of the ticks(RTC 24bit)
+
+#define RFLOG_CMD_NONE          (0xff)              //!< no callback was called
+#define RFLOG_DELTA_NONE        (0xffff)            //!< point not reached
+
+#define RFLOG_FLAG_COALESCED    (0x01)              //!< not the first pass in RCS730_isrIrq()
+#define RFLOG_FLAG_SHARED       (0x02)              //!< second callback in one INT_STATUS pass
+
+
+/** record */
+typedef struct RFLOG_record_t {
+    uint16_t    Seq;                        //!< record sequence number
+    uint8_t     Cmd;                        //!< command code, or RFLOG_CMD_NONE
+    uint8_t     Flags;                      //!< RFLOG_FLAG_xxx
+    uint32_t    Irq;                        //!< ticks at RCS730_TS_IRQ
+    uint16_t    Delta[RFLOG_DELTA_NUM];     //!< ticks from Irq to RCS730_TS_STATUS.., or RFLOG_DELTA_NONE
+} RFLOG_record_t;
+
+
+/** summary of a command code(ticks) */
+typedef struct RFLOG_summary_t {
+    uint8_t     Cmd;                        //!< command code
+    uint32_t    Count;                      //!< transactions since RFLOG_reset()
+    uint16_t    Min;                        //!< min response time
+    uint16_t    Avg;                        //!< average response time
+    uint16_t    Max;                        //!< max response time
+    uint16_t    P50;                        //!< 50th percentile(records in the ring)
+    uint16_t    P90;                        //!< 90th percentile(records in the ring)
+    uint16_t    P99;                        //!< 99th percentile(records in the ring)
+} RFLOG_summary_t;
+
+
+/** clear the records and summaries
+ *
+ * Sequence numbers continue.
+ */
+void RFLOG_reset(void);
+
+
+/** timestamp a point
+ *
+ * Call from RCS730_TIMESTAMP_T.
+ *
+ * @param   [in]    Point       timestamp point
+ * @param   [in]    Cmd         command code, valid from RCS730_TS_CB_ENTER
+ * @param   [in]    Ticks       counter value
+ */
+void RFLOG_stamp(RCS730_TsPoint Point, uint8_t Cmd, uint32_t Ticks);
+
+
+/** close the current transaction
+ *
+ * Call after RCS730_isrIrq().
+ */
+void RFLOG_end(void);
+
+
+/** get records
+ *
+ * @param   [in]    Seq         first sequence number(older than the oldest : from the oldest)
+ * @param   [out]   pRec        records
+ * @param   [in]    Num         max number of records
+ * @return  number of records
+ */
+uint16_t RFLOG_getRecords(uint16_t Seq, RFLOG_record_t *pRec, uint16_t Num);
+
+
+/** get summaries
+ *
+ * @param   [out]   pSum        summaries(RFLOG_SUM_NUM)
+ */
+void RFLOG_getSummary(RFLOG_summary_t *pSum);
+
+#endif /* RFLOG_H */
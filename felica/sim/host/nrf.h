@@ -0,0 +1,17 @@
+/** host stand-in of nrf.h for the simulator build
+ *
+ * @file    nrf.h
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#ifndef NRF_H
+#define NRF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define __INLINE                inline
+#define __STATIC_INLINE         static inline
+
+#endif /* NRF_H */
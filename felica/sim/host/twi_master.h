@@ -0,0 +1,22 @@
+/** host stand-in of twi_master.h for the simulator build
+ *
+ * @file    twi_master.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * twi_master_transfer() is in rcs730sim.c.
+ */
+
+#ifndef TWI_MASTER_H
+#define TWI_MASTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TWI_READ_BIT            (0x01)
+#define TWI_ISSUE_STOP          ((bool)true)
+#define TWI_DONT_ISSUE_STOP     ((bool)false)
+
+bool twi_master_transfer(uint8_t address, uint8_t *data, uint8_t data_length, bool issue_stop);
+
+#endif /* TWI_MASTER_H */
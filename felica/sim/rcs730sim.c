@@ -0,0 +1,275 @@
+/** FeliCa Link(RC-S730) simulator for host build
+ *
+ * @file    rcs730sim.c
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#include <string.h>
+#include "rcs730sim.h"
+#include "rcs730.h"
+#include "twi_master.h"
+
+
+#define REG_TOP         (0x0b00)
+#define REG_NUM         (64)
+#define REG_INDEX(reg)  (((reg) - REG_TOP) / 4)
+#define INT_BITS        (0x0000007f)    //INT_xxx defined in rcs730.h
+#define TX_ENABLE       (0x00000001)    //TAG_TX_CTRL
+#define INIT_KEY        (0x0000004a)    //INIT_CTRL
+
+
+/** reset value of a register */
+typedef struct reset_t {
+    uint16_t    Reg;
+    uint32_t    Val;
+} reset_t;
+
+
+//registers not listed here are 0
+static const reset_t _resetVal[] = {
+    { RCS730_REG_OPMODE,         RCS730_OPMODE_LITES },
+    { RCS730_REG_I2C_SLAVE_ADDR, 0x00000040 },
+    { RCS730_REG_INT_MASK,       INT_BITS },
+};
+
+
+static uint8_t              _mem[RCS730SIM_MEM_SIZE];
+static uint16_t             _ptr;           //address of the next read
+static uint8_t              _slvAddr;       //8bit
+static uint32_t             _raw;           //INT_RAW_STATUS
+static uint8_t              _resp[256];
+static uint8_t              _respLen;
+static uint32_t             _nack;
+static RCS730SIM_stat_t     _stat;
+
+
+static void reg_reset(void);
+static void reg_written(uint16_t Reg, uint32_t Old);
+static void tx(void);
+
+
+static uint32_t reg_get(uint16_t Reg)
+{
+    const uint8_t *p = &_mem[Reg];
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static void reg_set(uint16_t Reg, uint32_t Val)
+{
+    uint8_t *p = &_mem[Reg];
+    p[0] = (uint8_t)Val;
+    p[1] = (uint8_t)(Val >> 8);
+    p[2] = (uint8_t)(Val >> 16);
+    p[3] = (uint8_t)(Val >> 24);
+}
+
+
+static uint32_t int_status(void)
+{
+    return _raw & ~reg_get(RCS730_REG_INT_MASK) & INT_BITS;
+}
+
+
+/** registers computed from the state */
+static void reg_update(void)
+{
+    reg_set(RCS730_REG_INT_RAW_STATUS, _raw);
+    reg_set(RCS730_REG_INT_STATUS, int_status());
+}
+
+
+void RCS730SIM_reset(void)
+{
+    memset(_mem, 0, sizeof(_mem));
+    _ptr = 0;
+    _respLen = 0;
+    _nack = 0;
+    memset(&_stat, 0, sizeof(_stat));
+    reg_reset();
+}
+
+
+bool RCS730SIM_rfCommand(const uint8_t *pFrame)
+{
+    uint32_t bit;
+
+    if (pFrame[0] < 2) {
+        //no command code
+        return false;
+    }
+
+    memcpy(&_mem[RCS730_BUF_RF_COMM], pFrame, pFrame[0]);
+    switch (pFrame[1]) {
+    case 0x00:  //Polling
+        bit = RCS730_MSK_INT_TAG_PL_RX_DONE;
+        break;
+    case 0x06:  //Read w/o Enc
+    case 0x08:  //Write w/o Enc
+        bit = (reg_get(RCS730_REG_OPMODE) == RCS730_OPMODE_LITES_HT) ? RCS730_MSK_INT_TAG_RW_RX_DONE2 : RCS730_MSK_INT_TAG_RX_DONE;
+        break;
+    default:
+        bit = RCS730_MSK_INT_TAG_RX_DONE;
+        break;
+    }
+    _raw |= bit;
+    _stat.Commands++;
+
+    return true;
+}
+
+
+uint8_t RCS730SIM_getResponse(uint8_t *pFrame)
+{
+    uint8_t len = _respLen;
+
+    memcpy(pFrame, _resp, len);
+    _respLen = 0;
+    return len;
+}
+
+
+bool RCS730SIM_irq(void)
+{
+    return int_status() != 0;
+}
+
+
+void RCS730SIM_setNack(uint32_t Num)
+{
+    _nack = Num;
+}
+
+
+void RCS730SIM_getStat(RCS730SIM_stat_t *pStat)
+{
+    *pStat = _stat;
+}
+
+
+/** host implementation of twi_master.h
+ *
+ * Write : 2 bytes of memory address(big endian) and data.
+ * Read  : from the address of the last write, address increments.
+ */
+bool twi_master_transfer(uint8_t address, uint8_t *data, uint8_t data_length, bool issue_stop)
+{
+    uint8_t old[REG_NUM * 4];
+    uint16_t addr;
+
+    (void)issue_stop;
+
+    _stat.Transfers++;
+    _stat.Bytes++;
+    if ((address & ~TWI_READ_BIT) != _slvAddr) {
+        _stat.Nacks++;
+        return false;
+    }
+    if (_nack > 0) {
+        _nack--;
+        _stat.Nacks++;
+        return false;
+    }
+
+    if (address & TWI_READ_BIT) {
+        reg_update();
+        for (int i = 0; i < data_length; i++) {
+            data[i] = (_ptr < RCS730SIM_MEM_SIZE) ? _mem[_ptr] : 0xff;
+            _ptr++;
+        }
+        _stat.Bytes += data_length;
+        return true;
+    }
+
+    if (data_length < 2) {
+        _stat.Nacks++;
+        return false;
+    }
+    addr = (uint16_t)((data[0] << 8) | data[1]);
+    if ((addr >= RCS730SIM_MEM_SIZE) || (addr + data_length - 2 > RCS730SIM_MEM_SIZE)) {
+        _stat.Nacks++;
+        return false;
+    }
+    _ptr = addr;
+    _stat.Bytes += data_length;
+
+    memcpy(old, &_mem[REG_TOP], sizeof(old));
+    memcpy(&_mem[addr], &data[2], data_length - 2);
+    for (uint16_t reg = REG_TOP; reg < REG_TOP + REG_NUM * 4; reg += 4) {
+        if ((reg + 4 > addr) && (reg < addr + data_length - 2)) {
+            const uint8_t *p = &old[reg - REG_TOP];
+            reg_written(reg, (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        }
+    }
+
+    return true;
+}
+
+
+/** registers to the reset value */
+static void reg_reset(void)
+{
+    memset(&_mem[REG_TOP], 0, REG_NUM * 4);
+    for (size_t i = 0; i < sizeof(_resetVal) / sizeof(_resetVal[0]); i++) {
+        reg_set(_resetVal[i].Reg, _resetVal[i].Val);
+    }
+    _slvAddr = (uint8_t)(reg_get(RCS730_REG_I2C_SLAVE_ADDR) << 1);
+    _raw = 0;
+}
+
+
+/** side effects of a register write */
+static void reg_written(uint16_t Reg, uint32_t Old)
+{
+    uint32_t val = reg_get(Reg);
+
+    switch (Reg) {
+    case RCS730_REG_RF_STATUS:
+    case RCS730_REG_I2C_STATUS:
+    case RCS730_REG_INT_RAW_STATUS:
+    case RCS730_REG_INT_STATUS:
+        //read only
+        reg_set(Reg, Old);
+        break;
+
+    case RCS730_REG_INT_CLEAR:
+        _raw &= ~val;
+        reg_set(Reg, 0);
+        break;
+
+    case RCS730_REG_TAG_TX_CTRL:
+        if (val & TX_ENABLE) {
+            tx();
+        }
+        reg_set(Reg, 0);
+        break;
+
+    case RCS730_REG_I2C_SLAVE_ADDR:
+        //takes effect from the next transfer
+        _slvAddr = (uint8_t)(val << 1);
+        break;
+
+    case RCS730_REG_INIT_CTRL:
+        if (val == INIT_KEY) {
+            reg_reset();
+        }
+        else {
+            reg_set(Reg, 0);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/** send the frame in the RF buffer */
+static void tx(void)
+{
+    _respLen = _mem[RCS730_BUF_RF_COMM];
+    memcpy(_resp, &_mem[RCS730_BUF_RF_COMM], _respLen);
+    _raw |= RCS730_MSK_INT_TAG_TX_DONE;
+    _stat.Responses++;
+}
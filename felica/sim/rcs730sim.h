@@ -0,0 +1,95 @@
+/** FeliCa Link(RC-S730) simulator for host build
+ *
+ * @file    rcs730sim.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Runs rcs730.c on a PC. twi_master_transfer() is implemented here over a simulated
+ * memory map of the RC-S730, and the reader side is driven by RCS730SIM_rfCommand().
+ *
+ *   - 0x0000-0x0aff : FeliCa blocks(plain memory)
+ *   - 0x0b00-0x0bff : registers(reset values, read only registers, INT_CLEAR, TAG_TX_CTRL, INIT_CTRL)
+ *   - 0x0c00-0x0cff : RF communication buffer
+ *   - 0x0d00-0x0dff : I2C FeliCa communication buffer
+ *
+ * INT_STATUS is INT_RAW_STATUS masked by INT_MASK, and the IRQ line is asserted(low)
+ * while INT_STATUS is not 0. Writing 1 to INT_CLEAR clears the bit of INT_RAW_STATUS.
+ * Writing 1 to TAG_TX_CTRL sends the frame in the RF buffer(RCS730SIM_getResponse())
+ * and raises TX done.
+ *
+ * Build with the stand-in SDK headers in host/ :
+ *   gcc -std=gnu99 -Ifelica -Ifelica/sim -Ifelica/sim/host felica/rcs730.c felica/sim/rcs730sim.c (your main)
+ *
+ * The tests in test_rcs730.c run with "make -C felica/sim test".
+ */
+
+#ifndef RCS730SIM_H
+#define RCS730SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define RCS730SIM_MEM_SIZE      (0x0e00)        //!< end of the memory map
+
+
+/** statistics */
+typedef struct RCS730SIM_stat_t {
+    uint32_t    Transfers;          //!< twi_master_transfer() calls
+    uint32_t    Nacks;              //!< transfers not acknowledged(address, range, RCS730SIM_setNack())
+    uint32_t    Bytes;              //!< bytes on the bus(including the slave address)
+    uint32_t    Commands;           //!< frames from RCS730SIM_rfCommand()
+    uint32_t    Responses;          //!< frames sent by TAG_TX_CTRL
+} RCS730SIM_stat_t;
+
+
+/** power on reset
+ *
+ * Registers get the reset values, memory and buffers are cleared, statistics too.
+ */
+void RCS730SIM_reset(void);
+
+
+/** frame from the reader
+ *
+ * Copies the frame to the RF buffer and raises the Rx done of the command:
+ *   - 0x00(Polling)                    : PL_RX_DONE
+ *   - 0x06, 0x08 in Lite-S HT mode     : RW_RX_DONE2(all blocks are taken as HT blocks)
+ *   - others                           : RX_DONE
+ *
+ * @param   [in]    pFrame      frame(LEN, command code, ...)
+ * @retval  true    accepted
+ * @retval  false   LEN is not the frame length
+ */
+bool RCS730SIM_rfCommand(const uint8_t *pFrame);
+
+
+/** get the response sent to the reader
+ *
+ * @param   [out]   pFrame      frame(256 bytes)
+ * @return  LEN of the response, or 0 if none was sent after the last call
+ */
+uint8_t RCS730SIM_getResponse(uint8_t *pFrame);
+
+
+/** IRQ line
+ *
+ * @retval  true    asserted(low)
+ */
+bool RCS730SIM_irq(void);
+
+
+/** fail transfers
+ *
+ * @param   [in]    Num         number of the next transfers to be not acknowledged
+ */
+void RCS730SIM_setNack(uint32_t Num);
+
+
+/** get statistics
+ *
+ * @param   [out]   pStat       statistics
+ */
+void RCS730SIM_getStat(RCS730SIM_stat_t *pStat);
+
+#endif /* RCS730SIM_H */
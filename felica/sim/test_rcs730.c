@@ -0,0 +1,472 @@
+/** tests of rcs730.c on the RC-S730 simulator
+ *
+ * @file    test_rcs730.c
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * make -C felica/sim test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "rcs730.h"
+#include "rcs730sim.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            _fails++; \
+        } \
+    } while (0)
+
+#define RETRY_NUM       (10)        //same as rcs730.c
+#define BLK_NUM         (16)
+#define BLK_SIZE        (16)
+
+
+static int                  _fails;
+static uint8_t              _blk[BLK_NUM][BLK_SIZE];
+static uint32_t             _polls;
+static uint32_t             _reads;
+static uint32_t             _writes;
+
+/** frame injected at a timestamp point(the reader sends it while the host is servicing) */
+static struct {
+    RCS730_TsPoint  Point;
+    uint8_t         Cmd;
+    const uint8_t   *pFrame;
+} _inject[4];
+static int                  _injectNum;
+
+/** responses taken at RCS730_TS_TX_ENABLE */
+static uint8_t              _resp[4][256];
+static int                  _respNum;
+
+
+/**************************************************************************
+ * callbacks(minimal Lite-S HT tag)
+ **************************************************************************/
+
+static void cb_polling(void *pUser, uint32_t IntStat, uint32_t RfStatus)
+{
+    (void)pUser;
+    (void)IntStat;
+    (void)RfStatus;
+    _polls++;
+}
+
+
+/** Read w/o Enc : [LEN][06][IDm(8)][1][svc(2)][n][80 blk]... */
+static bool cb_read(void *pUser, uint8_t *pData, uint8_t Len)
+{
+    uint8_t num = pData[13];
+
+    (void)pUser;
+    if ((Len < 14 + 2 * num) || (num == 0) || (num > 4)) {
+        return false;
+    }
+    _reads++;
+
+    //[LEN][07][IDm(8)][st1][st2][n][data]...
+    uint8_t blk[4];
+    for (int i = 0; i < num; i++) {
+        blk[i] = pData[15 + 2 * i] % BLK_NUM;
+    }
+    pData[1] = 0x07;
+    pData[10] = 0x00;
+    pData[11] = 0x00;
+    pData[12] = num;
+    for (int i = 0; i < num; i++) {
+        memcpy(&pData[13 + BLK_SIZE * i], _blk[blk[i]], BLK_SIZE);
+    }
+    pData[0] = (uint8_t)(13 + BLK_SIZE * num);
+    return true;
+}
+
+
+/** Write w/o Enc : [LEN][08][IDm(8)][1][svc(2)][1][80 blk][data(16)] */
+static bool cb_write(void *pUser, uint8_t *pData, uint8_t Len)
+{
+    (void)pUser;
+    if ((Len < 16 + BLK_SIZE) || (pData[13] != 1)) {
+        return false;
+    }
+    _writes++;
+    memcpy(_blk[pData[15] % BLK_NUM], &pData[16], BLK_SIZE);
+
+    //[LEN][09][IDm(8)][st1][st2]
+    pData[0] = 12;
+    pData[1] = 0x09;
+    pData[10] = 0x00;
+    pData[11] = 0x00;
+    return true;
+}
+
+
+static void cb_timestamp(void *pUser, RCS730_TsPoint Point, uint8_t Cmd)
+{
+    (void)pUser;
+    if (Point == RCS730_TS_TX_ENABLE) {
+        uint8_t len = RCS730SIM_getResponse(_resp[_respNum % 4]);
+        if (len > 0) {
+            _respNum++;
+        }
+    }
+    for (int i = 0; i < _injectNum; i++) {
+        if ((_inject[i].pFrame != NULL) && (_inject[i].Point == Point) && (_inject[i].Cmd == Cmd)) {
+            RCS730SIM_rfCommand(_inject[i].pFrame);
+            _inject[i].pFrame = NULL;
+            break;
+        }
+    }
+}
+
+
+/**************************************************************************
+ * helper
+ **************************************************************************/
+
+static const uint8_t IDM[8] = { 0x03, 0xfe, 0x00, 0x1d, 0xe1, 0x4b, 0x2a, 0x04 };
+
+
+static void frame_polling(uint8_t *pFrame)
+{
+    //[LEN][00][system code(2)][request code][time slot]
+    pFrame[0] = 6;
+    pFrame[1] = 0x00;
+    pFrame[2] = 0x12;
+    pFrame[3] = 0xfc;
+    pFrame[4] = 0x00;
+    pFrame[5] = 0x00;
+}
+
+
+static void frame_read(uint8_t *pFrame, uint8_t Blk)
+{
+    pFrame[0] = 16;
+    pFrame[1] = 0x06;
+    memcpy(&pFrame[2], IDM, sizeof(IDM));
+    pFrame[10] = 1;
+    pFrame[11] = 0x0b;
+    pFrame[12] = 0x00;
+    pFrame[13] = 1;
+    pFrame[14] = 0x80;
+    pFrame[15] = Blk;
+}
+
+
+static void frame_write(uint8_t *pFrame, uint8_t Blk, uint8_t Fill)
+{
+    pFrame[0] = 16 + BLK_SIZE;
+    pFrame[1] = 0x08;
+    memcpy(&pFrame[2], IDM, sizeof(IDM));
+    pFrame[10] = 1;
+    pFrame[11] = 0x09;
+    pFrame[12] = 0x00;
+    pFrame[13] = 1;
+    pFrame[14] = 0x80;
+    pFrame[15] = Blk;
+    for (int i = 0; i < BLK_SIZE; i++) {
+        pFrame[16 + i] = (uint8_t)(Fill + i);
+    }
+}
+
+
+/** power on the chip and the host, and initialize to Lite-S HT mode */
+static void setup(void)
+{
+    RCS730_callbacktable_t tbl;
+
+    RCS730SIM_reset();
+    RCS730_init();
+    memset(&tbl, 0, sizeof(tbl));
+    tbl.pCbRxHTRDone = cb_read;
+    tbl.pCbRxHTWDone = cb_write;
+    tbl.pCbRxPlDone = cb_polling;
+    tbl.pCbTimestamp = cb_timestamp;
+    RCS730_setCallbackTable(&tbl);
+    CHECK(RCS730_initFTMode(RCS730_OPMODE_LITES_HT) == 0);
+
+    memset(_blk, 0, sizeof(_blk));
+    _polls = 0;
+    _reads = 0;
+    _writes = 0;
+    _injectNum = 0;
+    _respNum = 0;
+}
+
+
+/** reader sends Frame at Point of Cmd */
+static void inject(RCS730_TsPoint Point, uint8_t Cmd, const uint8_t *pFrame)
+{
+    _inject[_injectNum].Point = Point;
+    _inject[_injectNum].Cmd = Cmd;
+    _inject[_injectNum].pFrame = pFrame;
+    _injectNum++;
+}
+
+
+/**************************************************************************
+ * test
+ **************************************************************************/
+
+/** init to FT mode, and resume keeps the chip state */
+static void test_init(void)
+{
+    uint32_t val;
+
+    setup();
+    CHECK(RCS730_readRegister(RCS730_REG_OPMODE, &val) == 0);
+    CHECK(val == RCS730_OPMODE_LITES_HT);
+    CHECK(RCS730_readRegister(RCS730_REG_INT_MASK, &val) == 0);
+    CHECK((val & (RCS730_MSK_INT_TAG_RW_RX_DONE2 | RCS730_MSK_INT_TAG_PL_RX_DONE)) == 0);
+    CHECK((val & RCS730_MSK_INT_TAG_TX_DONE) != 0);
+    CHECK(!RCS730SIM_irq());
+
+    //host reset only : chip state was kept
+    RCS730_init();
+    CHECK(RCS730_resumeFTMode(RCS730_OPMODE_LITES_HT) == 0);
+
+    //chip reset too : initialized again
+    RCS730SIM_reset();
+    CHECK(RCS730_resumeFTMode(RCS730_OPMODE_LITES_HT) == 1);
+    CHECK(RCS730_readRegister(RCS730_REG_OPMODE, &val) == 0);
+    CHECK(val == RCS730_OPMODE_LITES_HT);
+}
+
+
+/** Write w/o Enc then Read w/o Enc of the same block */
+static void test_read_write(void)
+{
+    uint8_t frame[256];
+    uint8_t resp[256];
+    uint8_t len;
+    RCS730SIM_stat_t sim;
+
+    setup();
+
+    frame_write(frame, 3, 0x40);
+    CHECK(RCS730SIM_rfCommand(frame));
+    CHECK(RCS730SIM_irq());
+    CHECK(!RCS730_isrIrq());
+    CHECK(!RCS730SIM_irq());
+    CHECK(_writes == 1);
+    CHECK(_respNum == 1);
+    CHECK((_resp[0][0] == 12) && (_resp[0][1] == 0x09) && (_resp[0][10] == 0x00));
+
+    frame_read(frame, 3);
+    CHECK(RCS730SIM_rfCommand(frame));
+    CHECK(!RCS730_isrIrq());
+    CHECK(_reads == 1);
+    CHECK(_respNum == 2);
+    len = _resp[1][0];
+    memcpy(resp, _resp[1], len);
+    CHECK(len == 13 + BLK_SIZE);
+    CHECK((resp[1] == 0x07) && (resp[12] == 1));
+    CHECK(memcmp(&resp[2], IDM, sizeof(IDM)) == 0);
+    frame_write(frame, 3, 0x40);
+    CHECK(memcmp(&resp[13], &frame[16], BLK_SIZE) == 0);
+
+    RCS730SIM_getStat(&sim);
+    CHECK(sim.Commands == 2);
+    CHECK(sim.Responses == 2);
+    CHECK(sim.Nacks == 0);
+}
+
+
+/** NACKed transfers are retried and counted */
+static void test_nack_retry(void)
+{
+    uint8_t frame[256];
+    uint32_t val;
+    RCS730_stat_t before;
+    RCS730_stat_t after;
+    RCS730SIM_stat_t sim;
+
+    setup();
+
+    //recovered by retries
+    RCS730_getStat(&before);
+    RCS730SIM_setNack(3);
+    CHECK(RCS730_readRegister(RCS730_REG_OPMODE, &val) == 0);
+    CHECK(val == RCS730_OPMODE_LITES_HT);
+    RCS730_getStat(&after);
+    CHECK(after.I2cFails - before.I2cFails == 3);
+    CHECK(after.I2cErrors - before.I2cErrors == 0);
+    RCS730SIM_getStat(&sim);
+    CHECK(sim.Nacks == 3);
+
+    //all retries failed
+    RCS730_getStat(&before);
+    RCS730SIM_setNack(RETRY_NUM + 1);
+    CHECK(RCS730_readRegister(RCS730_REG_OPMODE, &val) != 0);
+    RCS730_getStat(&after);
+    CHECK(after.I2cFails - before.I2cFails == RETRY_NUM + 1);
+    CHECK(after.I2cErrors - before.I2cErrors == 1);
+
+    //INT_STATUS not readable : the event is left for the next call, not lost
+    frame_read(frame, 0);
+    CHECK(RCS730SIM_rfCommand(frame));
+    RCS730_getStat(&before);
+    RCS730SIM_setNack(RETRY_NUM + 1);
+    CHECK(RCS730_isrIrq());
+    CHECK(RCS730SIM_irq());
+    CHECK(_reads == 0);
+    CHECK(!RCS730_isrIrq());
+    CHECK(_reads == 1);
+    CHECK(!RCS730SIM_irq());
+    RCS730_getStat(&after);
+    CHECK(after.IrqMissed - before.IrqMissed == 1);
+    CHECK(after.I2cErrors - before.I2cErrors == 1);
+}
+
+
+/** INT_CLEAR is written before the response is sent
+ *
+ * The reader sends the next command as soon as it gets the response.
+ * If INT_CLEAR was written after TAG_TX_CTRL, its Rx done would be cleared and lost.
+ */
+static void test_int_clear_order(void)
+{
+    uint8_t first[256];
+    uint8_t next[256];
+    RCS730_stat_t before;
+    RCS730_stat_t after;
+
+    setup();
+    frame_read(first, 1);
+    frame_read(next, 2);
+    _blk[2][0] = 0x5a;
+    inject(RCS730_TS_TX_ENABLE, 0x06, next);
+
+    RCS730_getStat(&before);
+    CHECK(RCS730SIM_rfCommand(first));
+    CHECK(!RCS730_isrIrq());
+    RCS730_getStat(&after);
+
+    CHECK(_reads == 2);
+    CHECK(_respNum == 2);
+    CHECK(_resp[1][13] == 0x5a);
+    CHECK(after.IrqEvents - before.IrqEvents == 2);
+    CHECK(after.IrqCoalesced - before.IrqCoalesced == 1);
+    CHECK(!RCS730SIM_irq());
+}
+
+
+/** Polling, Read and Write back-to-back are serviced in one call
+ *
+ * The reader sends the next command while the host is servicing the previous one,
+ * so only one IRQ edge is seen.
+ */
+static void test_back_to_back(void)
+{
+    uint8_t polling[256];
+    uint8_t read[256];
+    uint8_t write[256];
+    RCS730_stat_t before;
+    RCS730_stat_t after;
+    RCS730SIM_stat_t sim;
+
+    setup();
+    frame_polling(polling);
+    frame_read(read, 1);
+    frame_write(write, 2, 0x20);
+    inject(RCS730_TS_CB_ENTER, 0x00, read);
+    inject(RCS730_TS_TX_ENABLE, 0x06, write);
+
+    RCS730_getStat(&before);
+    CHECK(RCS730SIM_rfCommand(polling));
+    CHECK(!RCS730_isrIrq());
+    RCS730_getStat(&after);
+
+    CHECK(_polls == 1);
+    CHECK(_reads == 1);
+    CHECK(_writes == 1);
+    CHECK(_blk[2][0] == 0x20);
+    CHECK(after.IrqCount - before.IrqCount == 1);
+    CHECK(after.IrqEvents - before.IrqEvents == 3);
+    CHECK(after.IrqCoalesced - before.IrqCoalesced == 2);
+    CHECK(after.IrqMissed - before.IrqMissed == 0);
+    CHECK(!RCS730SIM_irq());
+    RCS730SIM_getStat(&sim);
+    CHECK(sim.Commands == 3);
+    CHECK(sim.Responses == 2);
+}
+
+
+/** more back-to-back commands than IRQ_BUDGET : the rest is left, not lost */
+static void test_back_to_back_budget(void)
+{
+    uint8_t polling[256];
+    uint8_t read1[256];
+    uint8_t write1[256];
+    uint8_t read2[256];
+    uint8_t write2[256];
+    RCS730_stat_t before;
+    RCS730_stat_t after;
+    RCS730SIM_stat_t sim;
+
+    setup();
+    frame_polling(polling);
+    frame_read(read1, 1);
+    frame_write(write1, 4, 0x40);
+    frame_read(read2, 4);
+    frame_write(write2, 5, 0x50);
+    inject(RCS730_TS_CB_ENTER, 0x00, read1);
+    inject(RCS730_TS_TX_ENABLE, 0x06, write1);
+    inject(RCS730_TS_TX_ENABLE, 0x08, read2);
+    inject(RCS730_TS_TX_ENABLE, 0x06, write2);
+
+    //5 events, 4 passes
+    RCS730_getStat(&before);
+    CHECK(RCS730SIM_rfCommand(polling));
+    CHECK(RCS730_isrIrq());
+    RCS730_getStat(&after);
+    CHECK(after.IrqEvents - before.IrqEvents == 4);
+    CHECK(after.IrqCoalesced - before.IrqCoalesced == 3);
+    CHECK(after.IrqMissed - before.IrqMissed == 1);
+    CHECK(_writes == 1);
+    CHECK(RCS730SIM_irq());
+
+    //the caller calls again
+    CHECK(!RCS730_isrIrq());
+    RCS730_getStat(&after);
+    CHECK(after.IrqCount - before.IrqCount == 2);
+    CHECK(after.IrqEvents - before.IrqEvents == 5);
+    CHECK(after.IrqMissed - before.IrqMissed == 1);
+    CHECK(!RCS730SIM_irq());
+
+    //counted only by the caller
+    CHECK(after.IrqGiveUps == before.IrqGiveUps);
+    RCS730_irqGiveUp();
+    RCS730_getStat(&after);
+    CHECK(after.IrqGiveUps - before.IrqGiveUps == 1);
+
+    CHECK(_polls == 1);
+    CHECK(_reads == 2);
+    CHECK(_writes == 2);
+    CHECK(_resp[2][13] == 0x40);
+    CHECK(_blk[5][0] == 0x50);
+    RCS730SIM_getStat(&sim);
+    CHECK(sim.Commands == 5);
+    CHECK(sim.Responses == 4);
+}
+
+
+int main(void)
+{
+    test_init();
+    test_read_write();
+    test_nack_retry();
+    test_int_clear_order();
+    test_back_to_back();
+    test_back_to_back_budget();
+
+    if (_fails != 0) {
+        printf("test_rcs730: %d failed\n", _fails);
+        return 1;
+    }
+    printf("test_rcs730: ok\n");
+    return 0;
+}
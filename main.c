@@ -36,21 +36,128 @@
 
 #include "st7032i.h"
 #include "rcs730.h"
+#include "blkimage.h"
+#include "blkstore.h"
+#include "rflog.h"
 
 #include "app_error.h"
 #include "app_trace.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
 
 
 /**************************************************************************
  * macro
  **************************************************************************/
 
+/** 1コマンドで扱う最大ブロック数(Read w/o Encの応答が255byteに収まる数: (255 - 13) / 16) */
+#define BLK_NOB_MAX             (15)
+
+/** Value of the RTC1 PRESCALER register(dev.cと合わせる) */
+#define APP_TIMER_PRESCALER     (0)
+
+/** RF通信がこの時間[ms]無ければ、磁界から離れたとみなす(Pollingの間隔より長くする) */
+#define RF_FIELD_GAP_MS         (500)
+
+/** スケジューラからIRQを続けて再処理する最大回数(超えたらdev_rf_retry()に任せる) */
+#define RF_IRQ_RESUME_MAX       (4)
+
 /**************************************************************************
  * declaration
  **************************************************************************/
 
 static RCS730_callbacktable_t           m_rcs730_cbtbl;
 
+/**
+ * ブロックイメージ
+ *  NDEFキャラクタリスティックの値そのもので、Centralの一括転送やWriteでも書き込まれる。
+ *  ブロックデータ(Data)はBLOCKキャラクタリスティック(ブロック窓)からも読み書きされる。
+ *  書き込まれた部分はフラッシュ(blkstore)にも保存する。
+ */
+static BLKIMG_image_t                   m_blk_image;
+
+/**
+ * NDEFとブロック窓の受け側
+ *  SoftDeviceが読み書きし、m_blk_imageとの間はサービスが写す。
+ *  ブロック窓はDataの部分を使う。
+ */
+static BLKIMG_image_t                   m_blk_shadow;
+
+/**
+ * ブロックイメージの参照先
+ *  Read w/o EncはBLEを使わず、IRQの中でここから応答する。
+ *  起動直後はフラッシュ上のレコードを直接指し、RAMへコピーし終わるとm_blk_imageを指す。
+ */
+static const BLKIMG_header_t * volatile m_blk_hdr;
+static const uint8_t * volatile         m_blk_map[BLKIMG_BLK_MAX];
+
+/** true:m_blk_hdrの索引が正しい */
+static volatile bool                    m_blk_ready;
+
+/** 起動(RTC1開始)からブロックイメージを応答できるようになるまでの時間 */
+static uint32_t                         m_blk_ready_ticks;
+
+/**
+ * 磁界検出
+ *  Pollingを受信してから最初のRead w/o Encが来るまでの先行時間を計測する。
+ *  時間はRTC1のカウント(1count = 約30.5us)。
+ */
+static struct {
+    bool        active;         ///< 磁界検出中
+    bool        first_read;     ///< 磁界検出後のRead w/o Enc受信済み
+    uint32_t    on_ticks;       ///< 磁界検出時刻
+    uint32_t    last_ticks;     ///< 最後のRF通信時刻
+
+    uint32_t    fields;         ///< 磁界検出回数
+    uint32_t    leads;          ///< 先行時間を計測した回数
+    uint32_t    misses;         ///< Pollingより先にReadが来た回数
+    uint32_t    lead_sum;       ///< 先行時間合計
+    uint32_t    lead_max;       ///< 先行時間最大
+} m_rf_field;
+
+/** true:RCS730_isrIrq()の中でRead/Writeに応答した */
+static bool                             m_rf_responded;
+
+/** スケジューラから続けてIRQを再処理した回数 */
+static uint8_t                          m_rf_resumes;
+
+/** true:System OFFから起動し、最初のRF応答をまだ返していない */
+static bool                             m_wake_pending;
+
+/**
+ * RF書込みの差分送信(FPS_MSG_BLK_DIFF)の統計
+ *  接続中の書込みについて、フレームをそのまま送った場合との差を数える。
+ */
+static struct {
+    uint32_t    blocks;         ///< 書き込まれたブロック数
+    uint32_t    unchanged;      ///< 内容が変わらなかったブロック数
+    uint32_t    raw_bytes;      ///< フレームをそのまま送った場合のbyte数
+    uint32_t    sent_bytes;     ///< 差分として送ったbyte数(キューに積めた分)
+    uint32_t    drops;          ///< 送信キューに積めなかったメッセージ数
+    uint32_t    resyncs;        ///< FPS_MSG_BLK_RESYNCを送った回数
+} m_blk_diff;
+
+/** 送れなかったBLK_DIFFの数(0以外ならFPS_MSG_BLK_RESYNC待ち) */
+static volatile uint8_t                 m_blk_resync;
+
+/**
+ * 一括実行(FPS_MSG_BATCH)の統計
+ *  時間はRTC1のカウント(1count = 約30.5us)。
+ */
+static struct {
+    uint32_t    batches;        ///< 実行したメッセージ数
+    uint32_t    ops;            ///< 実行したop数
+    uint32_t    errors;         ///< エラーで止まったメッセージ数
+    uint32_t    ticks_sum;      ///< 実行時間合計
+    uint32_t    ticks_max;      ///< 実行時間最大
+    uint32_t    resends;        ///< 送信キューが空いてから送った結果の数
+    uint32_t    busy;           ///< 結果を送れていないときに来て捨てた要求の数
+} m_batch;
+
+/** 送信キューに入らなかった一括実行の結果(長さ0:なし) */
+static uint8_t                          m_batch_res[FPS_MSG_MAX_LEN];
+static uint16_t                         m_batch_res_len;
+
 
 /**************************************************************************
  * prototype
@@ -59,6 +166,26 @@ static RCS730_callbacktable_t           m_rcs730_cbtbl;
 /* RCS-730 callback */
 static bool rcs730cb_read(void *pUser, uint8_t *pData, uint8_t Len);
 static bool rcs730cb_write(void *pUser, uint8_t *pData, uint8_t Len);
+static void rcs730cb_polling(void *pUser, uint32_t IntStat, uint32_t RfStatus);
+static void rcs730cb_timestamp(void *pUser, RCS730_TsPoint Point, uint8_t Cmd);
+static void rf_irq_resume(void *p_context);
+static bool rf_field_touch(void);
+static void rf_field_first_read(void);
+static int blk_list_parse(const uint8_t *pData, uint8_t Len, uint16_t *pSvc, uint8_t *pBlk, uint8_t **ppData);
+static void blk_diff_send(const int *pIdx, const uint8_t *pData, int Nob, uint8_t Len);
+static void blk_diff_flush(const uint8_t *pMsg, uint16_t Len);
+
+/* block image store */
+static void blk_store_init(void);
+static const uint8_t *blk_store_data(uint8_t Idx);
+static void blk_store_load(void *p_context);
+static void blk_store_process(void *p_context);
+
+/* remote control */
+static bool remote_op_len(uint8_t op, uint8_t *p_arg_len, uint8_t *p_res_len);
+static uint8_t remote_op_exec(uint8_t op, const uint8_t *p_arg, uint8_t *p_res);
+static bool remote_batch_flush(void);
+static bool remote_reg_writable(uint16_t reg);
 
 
 /**************************************************************************
@@ -70,29 +197,61 @@ static bool rcs730cb_write(void *pUser, uint8_t *pData, uint8_t Len);
 int main(void)
 {
     int ret;
+    bool resumed;
 
     // 初期化
+    BLKIMG_init(&m_blk_image);
+    ble_blk_buffer_set((uint8_t *)&m_blk_image, (uint8_t *)&m_blk_shadow, sizeof(m_blk_image));
+    ble_blk_window_set(m_blk_image.Data[0], m_blk_shadow.Data[0], sizeof(m_blk_image.Data));
     dev_init();
+    blk_store_init();
 
     RCS730_init();
     m_rcs730_cbtbl.pUserData = NULL;
     m_rcs730_cbtbl.pCbRxHTRDone = rcs730cb_read;
     m_rcs730_cbtbl.pCbRxHTWDone = rcs730cb_write;
+    m_rcs730_cbtbl.pCbRxPlDone = rcs730cb_polling;
+    m_rcs730_cbtbl.pCbTimestamp = rcs730cb_timestamp;
     RCS730_setCallbackTable(&m_rcs730_cbtbl);
-    ret = RCS730_initFTMode(RCS730_OPMODE_PLUG);
-    if (ret != 0) {
+    resumed = dev_is_resumed();
+    if (resumed) {
+        //System OFFからの起動 : RC-S730の設定は残っているので読み出して確認するだけ
+        m_wake_pending = true;
+        ret = RCS730_resumeFTMode(RCS730_OPMODE_PLUG);
+    }
+    else {
+        ret = RCS730_initFTMode(RCS730_OPMODE_PLUG);
+    }
+    if (ret < 0) {
         APP_ERROR_HANDLER(ret);
     }
 
-    ST7032I_init();
+    if (!resumed) {
+        ST7032I_init();
+    }
 
     app_trace_init();
-    app_trace_log("START\r\n");
+    app_trace_log("START%s\r\n", (resumed) ? "(resume)" : "");
+    app_trace_log("image ready=%d boot to ready=%d\r\n", m_blk_ready, m_blk_ready_ticks);
 
     // 処理開始
     //timers_start();
+    if (resumed) {
+        //IRQの立ち下がりはGPIOTE有効化より前なので割込みは来ない。ここで処理する。
+        //応答を返すまでRC-S730は次のIRQを出さないので、割込みと重なることはない。
+        //Readerのタイムアウトに間に合わせるため、Advertisingの設定より先に応答する。
+        if (nrf_gpio_pin_read(RCS730_IRQ) == 0) {
+            gpiote_irq_handler(0, 1 << RCS730_IRQ);
+        }
+    }
+
     ble_advertising_start();
 
+    if (resumed) {
+        //LCDの初期化(40ms以上)は最初の応答のあとにする
+        ST7032I_init();
+    }
+
     ST7032I_writeString("(^_^);");
 
     // メインループ
@@ -132,15 +291,346 @@ void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t *p_
 }
 
 
+/**
+ * @brief ブロックイメージ書込み開始
+ *
+ * Centralからの一括転送やNDEFキャラクタリスティックへの書込みを始めるときに呼ばれる。
+ * 書き終わるまで索引もブロックも古いものと新しいものが混ざるので、RFには応答しない。
+ * 途中で中断された場合は、Centralが次に書き込むまで応答しないままになる。
+ *
+ * @param[in]   offset      書込み開始位置
+ * @param[in]   length      書き込む長さ
+ */
+void blk_image_begin(uint16_t offset, uint16_t length)
+{
+    //フラッシュを指したままだと、あとのコピーで受けたデータが上書きされる
+    blk_store_load(NULL);
+    m_blk_ready = false;
+    app_trace_log("image begin offset=%d len=%d\r\n", offset, length);
+}
+
+
+/**
+ * @brief ブロックイメージ更新
+ *
+ * Centralからの一括転送やNDEFキャラクタリスティックへの書込みが完了したときに呼ばれる。
+ * 索引を書き換えている途中は応答しないよう、完了後に検査し直す(一括転送中はそのまま)。
+ * 更新した範囲はフラッシュに保存する。
+ *
+ * @param[in]   offset      更新した位置
+ * @param[in]   length      更新した長さ
+ */
+void blk_image_updated(uint16_t offset, uint16_t length)
+{
+    BLKSTORE_stat_t stat;
+    int end = offset + length;
+
+    if (offset < BLKIMG_BLK_OFFSET(0)) {
+        m_blk_hdr = &m_blk_image.Hdr;
+        BLKSTORE_write(BLKSTORE_IDX_HDR);
+    }
+    m_blk_ready = !ble_blk_bulk_active() && BLKIMG_validate(m_blk_hdr);
+    for (int i = 0; i < BLKIMG_BLK_MAX; i++) {
+        if ((offset < BLKIMG_BLK_OFFSET(i + 1)) && (end > BLKIMG_BLK_OFFSET(i))) {
+            m_blk_map[i] = m_blk_image.Data[i];
+            BLKSTORE_write(i);
+        }
+    }
+    BLKSTORE_process();
+
+    //書込み量 : 要求したデータ量に対するフラッシュへの書込み量(%)
+    BLKSTORE_getStat(&stat);
+    app_trace_log("image seq=%d svc=%d ready=%d\r\n", m_blk_image.Hdr.Seq, m_blk_image.Hdr.SvcNum, m_blk_ready);
+    app_trace_log("  store rec=%d copy=%d erase=%d err=%d wa=%d%%\r\n",
+                    stat.Records, stat.Copies, stat.Erases, stat.Errors,
+                    (stat.UserBytes) ? stat.FlashBytes * 100 / stat.UserBytes : 0);
+}
+
+
+/**
+ * @brief 一括実行
+ *
+ * FPS_MSG_BATCHのop列を先頭から実行し、結果をFPS_MSG_BATCH_RESULTで返す(形式はble_fps.h)。
+ * Centralからの設定を1往復で済ませるためのもので、スケジューラから呼ばれる。
+ *
+ * @param[in]   p_data      メッセージ([id][op列])
+ * @param[in]   length      メッセージ長
+ */
+void remote_batch_exec(const uint8_t *p_data, uint16_t length)
+{
+    uint8_t res[FPS_MSG_MAX_LEN];
+    uint16_t pos = 1;
+    uint16_t res_pos = FPS_BATCH_HDR_LEN;
+    uint8_t ops = 0;
+    uint8_t status = FPS_BATCH_OK;
+    dev_bus_t bus;
+    uint32_t start;
+    uint32_t now;
+    uint32_t ticks;
+
+    if (length < 1) {
+        return;
+    }
+    if (!remote_batch_flush()) {
+        //前の結果を送れていない : 実行すると結果を返せない
+        m_batch.busy++;
+        app_trace_log("batch id=%d busy(%d)\r\n", p_data[0], m_batch.busy);
+        return;
+    }
+    app_timer_cnt_get(&start);
+    dev_bus_begin(&bus);
+
+    while ((pos < length) && (status == FPS_BATCH_OK)) {
+        uint8_t op = p_data[pos++];
+        uint8_t arg_len = 0;
+        uint8_t res_len = 0;
+
+        //結果の[op][status]は必ず入れる
+        if (res_pos + 2 > FPS_MSG_MAX_LEN) {
+            status = FPS_BATCH_ERR_FULL;
+            break;
+        }
+        if (!remote_op_len(op, &arg_len, &res_len) || (pos + arg_len > length)) {
+            status = FPS_BATCH_ERR_FORMAT;
+        }
+        else if (res_pos + 2 + res_len > FPS_MSG_MAX_LEN) {
+            status = FPS_BATCH_ERR_FULL;
+        }
+        else {
+            status = remote_op_exec(op, &p_data[pos], &res[res_pos + 2]);
+        }
+        res[res_pos++] = op;
+        res[res_pos++] = status;
+        if (status == FPS_BATCH_OK) {
+            res_pos += res_len;
+        }
+        pos += arg_len;
+        ops++;
+    }
+
+    dev_bus_end(&bus, DEV_BUS_CONFIG);
+
+    //ブロックを書き込んでいればフラッシュにも保存する
+    BLKSTORE_process();
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, start, &ticks);
+
+    //[id][実行したop数][status][実行時間(4)]
+    res[0] = p_data[0];
+    res[1] = ops;
+    res[2] = status;
+    res[3] = (uint8_t)ticks;
+    res[4] = (uint8_t)(ticks >> 8);
+    res[5] = (uint8_t)(ticks >> 16);
+    res[6] = (uint8_t)(ticks >> 24);
+    if (ble_send(FPS_MSG_BATCH_RESULT, res, res_pos) == NRF_ERROR_NO_MEM) {
+        //実行済みなので捨てずに、送信キューが空いたら送る(ble_tx_ready())
+        memcpy(m_batch_res, res, res_pos);
+        m_batch_res_len = res_pos;
+    }
+
+    m_batch.batches++;
+    m_batch.ops += ops;
+    if (status != FPS_BATCH_OK) {
+        m_batch.errors++;
+    }
+    m_batch.ticks_sum += ticks;
+    if (ticks > m_batch.ticks_max) {
+        m_batch.ticks_max = ticks;
+    }
+    app_trace_log("batch id=%d ops=%d status=%d ticks=%d (avg=%d max=%d err=%d resend=%d%s)\r\n",
+                    p_data[0], ops, status, ticks,
+                    m_batch.ticks_sum / m_batch.batches, m_batch.ticks_max, m_batch.errors,
+                    m_batch.resends, (m_batch_res_len > 0) ? " wait" : "");
+}
+
+
+/**
+ * @brief RFログ要求
+ *
+ * FPS_MSG_RFLOG_REQに、FPS_MSG_RFLOG_RECORDSかFPS_MSG_RFLOG_SUMMARYで応答する(形式はble_fps.h)。
+ * スケジューラから呼ばれる。
+ *
+ * @param[in]   p_data      メッセージ([種別][seq(2)])
+ * @param[in]   length      メッセージ長
+ */
+void rf_log_request(const uint8_t *p_data, uint16_t length)
+{
+    uint8_t msg[1 + FPS_RFLOG_PAGE * FPS_RFLOG_RECORD_LEN];
+    uint16_t pos = 1;
+
+    if (length < 1) {
+        return;
+    }
+
+    switch (p_data[0]) {
+    case FPS_RFLOG_RECORDS:
+        {
+            RFLOG_record_t rec[FPS_RFLOG_PAGE];
+            uint16_t seq = (length >= 3) ? (uint16_t)(p_data[1] | (p_data[2] << 8)) : 0;
+            uint16_t num = RFLOG_getRecords(seq, rec, FPS_RFLOG_PAGE);
+
+            msg[0] = (uint8_t)num;
+            for (int i = 0; i < num; i++) {
+                msg[pos++] = (uint8_t)rec[i].Seq;
+                msg[pos++] = (uint8_t)(rec[i].Seq >> 8);
+                msg[pos++] = rec[i].Cmd;
+                msg[pos++] = rec[i].Flags;
+                msg[pos++] = (uint8_t)rec[i].Irq;
+                msg[pos++] = (uint8_t)(rec[i].Irq >> 8);
+                msg[pos++] = (uint8_t)(rec[i].Irq >> 16);
+                msg[pos++] = (uint8_t)(rec[i].Irq >> 24);
+                for (int j = 0; j < RFLOG_DELTA_NUM; j++) {
+                    msg[pos++] = (uint8_t)rec[i].Delta[j];
+                    msg[pos++] = (uint8_t)(rec[i].Delta[j] >> 8);
+                }
+            }
+            (void)ble_send(FPS_MSG_RFLOG_RECORDS, msg, pos);
+        }
+        break;
+
+    case FPS_RFLOG_SUMMARY:
+        {
+            RFLOG_summary_t sum[RFLOG_SUM_NUM];
+
+            RFLOG_getSummary(sum);
+            msg[0] = RFLOG_SUM_NUM;
+            for (int i = 0; i < RFLOG_SUM_NUM; i++) {
+                const uint16_t val[] = { sum[i].Min, sum[i].Avg, sum[i].Max, sum[i].P50, sum[i].P90, sum[i].P99 };
+
+                msg[pos++] = sum[i].Cmd;
+                msg[pos++] = (uint8_t)sum[i].Count;
+                msg[pos++] = (uint8_t)(sum[i].Count >> 8);
+                msg[pos++] = (uint8_t)(sum[i].Count >> 16);
+                msg[pos++] = (uint8_t)(sum[i].Count >> 24);
+                for (int j = 0; j < (int)(sizeof(val) / sizeof(val[0])); j++) {
+                    msg[pos++] = (uint8_t)val[j];
+                    msg[pos++] = (uint8_t)(val[j] >> 8);
+                }
+                app_trace_log("rflog cmd=%02x n=%d min/avg/max=%d/%d/%d p50/90/99=%d/%d/%d\r\n",
+                                sum[i].Cmd, sum[i].Count, sum[i].Min, sum[i].Avg, sum[i].Max,
+                                sum[i].P50, sum[i].P90, sum[i].P99);
+            }
+            (void)ble_send(FPS_MSG_RFLOG_SUMMARY, msg, pos);
+        }
+        break;
+
+    case FPS_RFLOG_RESET:
+        RFLOG_reset();
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/**
+ * @brief 送信キューの空き
+ *
+ * TX_COMPLETEで送信キューが空いたときに呼ばれる(dev.c)。
+ * 送れなかったBLK_DIFFがあれば、FPS_MSG_BLK_RESYNCでCentralに読み直しを求める。
+ * RFの書込み(割込み)と重なっても、RESYNCより後の差分はCentralが読み直した内容に含まれる。
+ */
+void ble_tx_ready(void)
+{
+    uint8_t drops;
+
+    (void)remote_batch_flush();
+
+    CRITICAL_REGION_ENTER();
+    drops = m_blk_resync;
+    m_blk_resync = 0;
+    CRITICAL_REGION_EXIT();
+
+    if (drops == 0) {
+        return;
+    }
+    if (ble_send(FPS_MSG_BLK_RESYNC, &drops, sizeof(drops)) == NRF_SUCCESS) {
+        m_blk_diff.resyncs++;
+    }
+    else {
+        //次のTX_COMPLETEでやり直す
+        CRITICAL_REGION_ENTER();
+        m_blk_resync = (m_blk_resync + drops > UINT8_MAX) ? UINT8_MAX : (uint8_t)(m_blk_resync + drops);
+        CRITICAL_REGION_EXIT();
+    }
+}
+
+
+/**
+ * @brief 送れなかったメッセージの破棄
+ *
+ * 切断時に呼ばれる(dev.c)。
+ * 次の接続ではCentralがブロックイメージを読み直すので、RESYNCも要らない。
+ */
+void ble_tx_clear(void)
+{
+    m_blk_resync = 0;
+    m_batch_res_len = 0;
+}
+
+
 /**
  * @brief IRQ検知
  *
  * IRQ立ち下がりでコールバックされる。
+ * 処理中に来たイベントはRCS730_isrIrq()の中で続けて処理する。
+ * 処理しきれなかったとき、IRQがLOWのままなら立ち下がりは来ないので、スケジューラから再度処理する。
+ * RF_IRQ_RESUME_MAX回続けても終わらなければ(I2Cエラーが続くなど)、
+ * 他のイベントを止めないよう、タイマで間を空けてから処理する。
  */
 void gpiote_irq_handler(uint32_t event_pins_low_to_high, uint32_t event_pins_high_to_low)
 {
+    uint32_t start;
+    bool pending;
+    dev_bus_t bus;
+
+    app_timer_cnt_get(&start);
+    m_rf_responded = false;
+
     app_trace_log("irq\r\n");
-    RCS730_isrIrq();
+    //応答は無線イベント中でも待たせない(統計だけ取る)
+    dev_bus_begin(&bus);
+    pending = RCS730_isrIrq();
+    dev_bus_end(&bus, DEV_BUS_RF);
+    RFLOG_end();
+    if (pending || (nrf_gpio_pin_read(RCS730_IRQ) == 0)) {
+        if ((m_rf_resumes < RF_IRQ_RESUME_MAX)
+          && (dev_sched_put(DEV_PRIO_RF, rf_irq_resume, NULL) == NRF_SUCCESS)) {
+            m_rf_resumes++;
+        }
+        else {
+            //キューがいっぱいのときも同じ
+            m_rf_resumes = 0;
+            RCS730_irqGiveUp();
+            dev_rf_retry();
+        }
+    }
+    else {
+        m_rf_resumes = 0;
+    }
+
+    if (m_rf_responded) {
+        //IRQから応答の書込みまでの時間
+        uint32_t now;
+        uint32_t ticks;
+
+        app_timer_cnt_get(&now);
+        app_timer_cnt_diff_compute(now, start, &ticks);
+        dev_telem_rf_response(ticks);
+    }
+
+    if (m_wake_pending) {
+        //起動(timers_init()でRTC1開始)から最初のRF応答までの時間
+        //  RTC1開始までの時間(リセット～timers_init())は含まない
+        uint32_t ticks;
+
+        m_wake_pending = false;
+        app_timer_cnt_get(&ticks);
+        app_trace_log("wake to response=%d\r\n", ticks);
+    }
 }
 
 
@@ -152,30 +642,69 @@ void gpiote_irq_handler(uint32_t event_pins_low_to_high, uint32_t event_pins_hig
  * RC-S730
  **********************************************/
 
+/**
+ * @brief IRQの再処理(スケジューラ)
+ *
+ * gpiote_irq_handler()で処理しきれなかったイベントを処理する。
+ * GPIOTE割込みと重ならないよう、割込み禁止で呼ぶ。
+ *
+ * @param[in]   p_context   未使用
+ */
+static void rf_irq_resume(void *p_context)
+{
+    CRITICAL_REGION_ENTER();
+    gpiote_irq_handler(0, 1 << RCS730_IRQ);
+    CRITICAL_REGION_EXIT();
+}
+
+
 static bool rcs730cb_read(void *pUser, uint8_t *pData, uint8_t Len)
 {
+    uint16_t svc[BLK_NOB_MAX];
+    uint8_t blk[BLK_NOB_MAX];
+    const uint8_t *p_src[BLK_NOB_MAX];
+    int nob;
+
     app_trace_log("read\r\n");
-    ST7032I_clear();
+    m_rf_responded = true;
+    rf_field_first_read();
+    ble_conn_activity();
 
-    if (!ble_is_connected()) {
-        ST7032I_writeString("read err");
+    //Centralへは届けば通知するだけで、応答には使わない(積むだけで、送出はスケジューラ)
+    if (ble_is_connected()) {
+        (void)ble_nofify(pData, Len);
+    }
 
+    nob = (m_blk_ready) ? blk_list_parse(pData, Len, svc, blk, NULL) : -0x70;
+    for (int i = 0; i < nob; i++) {
+        int idx = BLKIMG_index(m_blk_hdr, svc[i], blk[i]);
+        if (idx < 0) {
+            nob = -0xa8;    //ブロック番号エラー
+            break;
+        }
+        p_src[i] = m_blk_map[idx];
+    }
+    ble_broadcast_rf_event(0x06, (nob < 0) ? (uint8_t)-nob : 0, &pData[2], (nob > 0) ? svc[0] : 0xffff);
+    if (nob < 0) {
+        lcd_show("read err");
         pData[0] = 13;
+        pData[1] = 0x07;
         pData[10] = 0xff;  //ST1
-        pData[11] = 0x70;  //ST2(データ読み出しエラー)
+        pData[11] = (uint8_t)-nob;  //ST2
+        pData[12] = 0;
         return true;
     }
 
-    ST7032I_writeString("read");
-
-    ble_nofify(pData, Len);
+    lcd_show("read");
 
-    uint8_t nob = pData[13] << 4;       //16byte * NoB
-    pData[0] = (uint8_t)(13 + nob);
+    //response : [0]LEN [1]0x07 [2-9]IDm [10]ST1 [11]ST2 [12]NoB [13-]Block Data
+    pData[0] = (uint8_t)(13 + nob * BLKIMG_BLK_SIZE);
+    pData[1] = 0x07;
     pData[10] = 0;  //ST1
     pData[11] = 0;  //ST2
+    pData[12] = (uint8_t)nob;
     for (int i = 0; i < nob; i++) {
-        pData[13 + i] = (uint8_t)(0x30 + i);
+        memcpy(&pData[13 + i * BLKIMG_BLK_SIZE], p_src[i], BLKIMG_BLK_SIZE);
     }
 
     return true;
@@ -184,24 +713,561 @@ static bool rcs730cb_read(void *pUser, uint8_t *pData, uint8_t Len)
 
 static bool rcs730cb_write(void *pUser, uint8_t *pData, uint8_t Len)
 {
+    uint16_t svc[BLK_NOB_MAX];
+    uint8_t blk[BLK_NOB_MAX];
+    uint8_t *p_data;
+    int idx[BLK_NOB_MAX];
+    int nob;
+
     app_trace_log("write\r\n");
-    ST7032I_clear();
+    m_rf_responded = true;
+    (void)rf_field_touch();
+    ble_conn_activity();
 
-    pData[0] = 12;
+    nob = (m_blk_ready) ? blk_list_parse(pData, Len, svc, blk, &p_data) : -0x70;
+    if ((nob > 0) && (p_data + nob * BLKIMG_BLK_SIZE > pData + Len)) {
+        nob = -0xa2;    //ブロック数とデータ長が合わない
+    }
+    for (int i = 0; i < nob; i++) {
+        idx[i] = BLKIMG_index(m_blk_hdr, svc[i], blk[i]);
+        if (idx[i] < 0) {
+            nob = -0xa8;    //ブロック番号エラー
+            break;
+        }
+    }
+    ble_broadcast_rf_event(0x08, (nob < 0) ? (uint8_t)-nob : 0, &pData[2], (nob > 0) ? svc[0] : 0xffff);
 
-    if (!ble_is_connected()) {
-        ST7032I_writeString("write err");
+    pData[0] = 12;
+    pData[1] = 0x09;
 
+    if (nob < 0) {
+        lcd_show("write err");
         pData[10] = 0xff;  //ST1
-        pData[11] = 0x70;  //ST2
+        pData[11] = (uint8_t)-nob;  //ST2
         return true;
     }
 
-    ST7032I_writeString("write");
+    lcd_show("write");
+
+    //書き込まれたことは、変化したブロックだけCentralに通知する
+    if (ble_is_connected()) {
+        blk_diff_send(idx, p_data, nob, Len);
+    }
+
+    //NDEFキャラクタリスティックの値へ直接書き込み、フラッシュへの保存は後で行う
+    for (int i = 0; i < nob; i++) {
+        memcpy(m_blk_image.Data[idx[i]], p_data + i * BLKIMG_BLK_SIZE, BLKIMG_BLK_SIZE);
+        m_blk_map[idx[i]] = m_blk_image.Data[idx[i]];
+        BLKSTORE_write((uint8_t)idx[i]);
+    }
+    (void)dev_sched_put(DEV_PRIO_HOUSEKEEPING, blk_store_process, NULL);
 
-    pData[16 + 16] = '\0';
+    //response : [0]LEN [1]0x09 [2-9]IDm [10]ST1 [11]ST2
     pData[10] = 0;  //ST1
     pData[11] = 0;  //ST2
 
     return true;
 }
+
+
+/**
+ * @brief Polling受信
+ *
+ * Readerの磁界に入ったことを、最初のコマンドより前に知ることができる。
+ * この時点でConnection間隔を短くし、CentralにFPS_MSG_RF_FIELDを送って
+ * ブロックデータを先に更新してもらう。
+ * Pollingは繰り返し届くので、磁界から離れるまでは1回だけ処理する。
+ *
+ * @param[in]   pUser       未使用
+ * @param[in]   IntStat     INT_STATUS
+ * @param[in]   RfStatus    RF_STATUS
+ */
+static void rcs730cb_polling(void *pUser, uint32_t IntStat, uint32_t RfStatus)
+{
+    uint8_t data[4];
+
+    //磁界にいる間はConnection間隔を短いままにしておく
+    ble_conn_activity();
+
+    if (rf_field_touch()) {
+        return;
+    }
+
+    m_rf_field.first_read = false;
+    m_rf_field.on_ticks = m_rf_field.last_ticks;
+    m_rf_field.fields++;
+    app_trace_log("field on rf=%08x\r\n", RfStatus);
+
+    if (ble_is_connected()) {
+        data[0] = (uint8_t)RfStatus;
+        data[1] = (uint8_t)(RfStatus >> 8);
+        data[2] = (uint8_t)(RfStatus >> 16);
+        data[3] = (uint8_t)(RfStatus >> 24);
+        (void)ble_queue(FPS_MSG_RF_FIELD, data, sizeof(data));
+    }
+}
+
+
+/**
+ * @brief 書き込まれたブロックの差分送信
+ *
+ * 書込み前の内容と比べ、変化したbyteだけをFPS_MSG_BLK_DIFFで送る。
+ * POSなどは同じ内容を書き直すことが多く、その場合は何も送らない。
+ *
+ * @param[in]   pIdx        ブロック番号(Nob個)
+ * @param[in]   pData       書き込むデータ(Nob x BLKIMG_BLK_SIZE)
+ * @param[in]   Nob         ブロック数
+ * @param[in]   Len         Write w/o Encのフレーム長(そのまま送った場合の比較用)
+ */
+static void blk_diff_send(const int *pIdx, const uint8_t *pData, int Nob, uint8_t Len)
+{
+    uint8_t msg[FPS_MSG_MAX_LEN];
+    uint16_t len = 0;
+
+    for (int i = 0; i < Nob; i++) {
+        const uint8_t *p_new = pData + i * BLKIMG_BLK_SIZE;
+        const uint8_t *p_old = m_blk_map[pIdx[i]];
+        uint16_t mask = 0;
+
+        m_blk_diff.blocks++;
+        for (int j = 0; j < BLKIMG_BLK_SIZE; j++) {
+            if (p_new[j] != p_old[j]) {
+                mask |= 1 << j;
+            }
+        }
+        if (mask == 0) {
+            m_blk_diff.unchanged++;
+            continue;
+        }
+
+        //[ブロック番号][mask(2)][変化したbyte]
+        if (len + 3 + BLKIMG_BLK_SIZE > FPS_MSG_MAX_LEN) {
+            blk_diff_flush(msg, len);
+            len = 0;
+        }
+        msg[len++] = (uint8_t)pIdx[i];
+        msg[len++] = (uint8_t)mask;
+        msg[len++] = (uint8_t)(mask >> 8);
+        for (int j = 0; j < BLKIMG_BLK_SIZE; j++) {
+            if (mask & (1 << j)) {
+                msg[len++] = p_new[j];
+            }
+        }
+    }
+    if (len > 0) {
+        blk_diff_flush(msg, len);
+    }
+    m_blk_diff.raw_bytes += Len;
+
+    app_trace_log("diff blk=%d same=%d saved=%d drop=%d resync=%d\r\n",
+                    m_blk_diff.blocks, m_blk_diff.unchanged,
+                    (int)(m_blk_diff.raw_bytes - m_blk_diff.sent_bytes),
+                    m_blk_diff.drops, m_blk_diff.resyncs);
+}
+
+
+/**
+ * @brief 差分メッセージの送信
+ *
+ * 送信キューに入らなければ、以降の差分は送らずにFPS_MSG_BLK_RESYNCを待つ。
+ * 1つでも欠けるとCentral側のブロックイメージが食い違うため。
+ * RC-S730のIRQから呼ばれるので、積むだけにする。
+ *
+ * @param[in]   pMsg        FPS_MSG_BLK_DIFFのデータ
+ * @param[in]   Len         データ長
+ */
+static void blk_diff_flush(const uint8_t *pMsg, uint16_t Len)
+{
+    if ((m_blk_resync == 0) && (ble_queue(FPS_MSG_BLK_DIFF, pMsg, Len) == NRF_SUCCESS)) {
+        m_blk_diff.sent_bytes += Len;
+        return;
+    }
+
+    m_blk_diff.drops++;
+    if (m_blk_resync < UINT8_MAX) {
+        m_blk_resync++;
+    }
+}
+
+
+/**
+ * @brief RC-S730処理の時刻記録
+ *
+ * RCS730_isrIrq()の各時点をRTC1のカウントでRFログに記録する。
+ * RTC1はapp_timerが止めることがあるので、timers_init()の維持タイマで動かし続けている(dev.c)。
+ *
+ * @param[in]   pUser       未使用
+ * @param[in]   Point       時点
+ * @param[in]   Cmd         コマンドコード
+ */
+static void rcs730cb_timestamp(void *pUser, RCS730_TsPoint Point, uint8_t Cmd)
+{
+    uint32_t now;
+
+    app_timer_cnt_get(&now);
+    RFLOG_stamp(Point, Cmd, now);
+}
+
+
+/**
+ * @brief RF通信の記録
+ *
+ * @retval      true    磁界検出中だった
+ * @retval      false   磁界から離れていた(新たに磁界を検出した)
+ */
+static bool rf_field_touch(void)
+{
+    uint32_t now;
+    uint32_t diff;
+    bool alive;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, m_rf_field.last_ticks, &diff);
+    alive = m_rf_field.active && (diff < APP_TIMER_TICKS(RF_FIELD_GAP_MS, APP_TIMER_PRESCALER));
+
+    m_rf_field.active = true;
+    m_rf_field.last_ticks = now;
+    return alive;
+}
+
+
+/**
+ * @brief Read w/o Enc受信時の先行時間計測
+ */
+static void rf_field_first_read(void)
+{
+    uint32_t lead;
+
+    if (!rf_field_touch()) {
+        //Pollingを受けずにReadが来た
+        m_rf_field.first_read = true;
+        m_rf_field.misses++;
+        app_trace_log("field miss=%d\r\n", m_rf_field.misses);
+        return;
+    }
+    if (m_rf_field.first_read) {
+        return;
+    }
+    m_rf_field.first_read = true;
+
+    app_timer_cnt_diff_compute(m_rf_field.last_ticks, m_rf_field.on_ticks, &lead);
+    m_rf_field.leads++;
+    m_rf_field.lead_sum += lead;
+    if (lead > m_rf_field.lead_max) {
+        m_rf_field.lead_max = lead;
+    }
+    app_trace_log("field lead=%d avg=%d max=%d (n=%d/%d)\r\n",
+                    lead, m_rf_field.lead_sum / m_rf_field.leads, m_rf_field.lead_max,
+                    m_rf_field.leads, m_rf_field.fields);
+}
+
+
+/**
+ * @brief Block List解析
+ *
+ * Read w/o Enc / Write w/o Encのコマンドからサービスコードとブロック番号を取り出す。
+ *  [0]LEN [1]cmd [2-9]IDm [10]NoS [11-]Service Code List [ ]NoB [ ]Block List [ ]Block Data
+ * Block List Elementは2byte形式([0]=0x80|サービスコード順番 [1]=ブロック番号)のみ対応。
+ *
+ * @param[in]   pData       コマンド
+ * @param[in]   Len         コマンド長
+ * @param[out]  pSvc        サービスコード(BLK_NOB_MAX個)
+ * @param[out]  pBlk        ブロック番号(BLK_NOB_MAX個)
+ * @param[out]  ppData      Block Dataの先頭(NULL可)
+ * @return      0以上:ブロック数, 負:ST2の値を負にしたもの
+ */
+static int blk_list_parse(const uint8_t *pData, uint8_t Len, uint16_t *pSvc, uint8_t *pBlk, uint8_t **ppData)
+{
+    uint8_t nos = pData[10];
+    const uint8_t *p_nob = &pData[11 + 2 * nos];
+    uint8_t nob;
+    uint8_t order;
+
+    if ((nos == 0) || (p_nob >= pData + Len)) {
+        return -0xa1;   //サービス数エラー
+    }
+    nob = *p_nob;
+    if ((nob == 0) || (nob > BLK_NOB_MAX) || (p_nob + 1 + 2 * nob > pData + Len)) {
+        return -0xa2;   //ブロック数エラー
+    }
+    for (int i = 0; i < nob; i++) {
+        if ((p_nob[1 + 2 * i] & 0x80) == 0) {
+            return -0xa8;   //ブロック番号エラー(3byte形式は非対応)
+        }
+        order = p_nob[1 + 2 * i] & 0x0f;
+        if (order >= nos) {
+            return -0xa3;   //サービスコード順番エラー
+        }
+        pSvc[i] = pData[11 + 2 * order] | (pData[11 + 2 * order + 1] << 8);
+        pBlk[i] = p_nob[2 + 2 * i];
+    }
+    if (ppData != NULL) {
+        *ppData = (uint8_t *)(p_nob + 1 + 2 * nob);
+    }
+
+    return nob;
+}
+
+
+/**********************************************
+ * ブロックイメージの保存
+ **********************************************/
+
+/**
+ * @brief ブロックイメージの読み出し
+ *
+ * フラッシュに保存されている最新のレコードを、コピーせずにそのまま参照する。
+ * 読み出し時間を短くするためで、RAMへのコピーはスケジューラで後から行う。
+ */
+static void blk_store_init(void)
+{
+    uint32_t err_code;
+    const uint8_t *p;
+
+    err_code = BLKSTORE_init(blk_store_data);
+    APP_ERROR_CHECK(err_code);
+
+    p = BLKSTORE_find(BLKSTORE_IDX_HDR);
+    m_blk_hdr = (p != NULL) ? (const BLKIMG_header_t *)p : &m_blk_image.Hdr;
+    for (int i = 0; i < BLKIMG_BLK_MAX; i++) {
+        p = BLKSTORE_find(i);
+        m_blk_map[i] = (p != NULL) ? p : m_blk_image.Data[i];
+    }
+    m_blk_ready = BLKIMG_validate(m_blk_hdr);
+    app_timer_cnt_get(&m_blk_ready_ticks);
+
+    //NDEFキャラクタリスティックの値(m_blk_image)は、接続されるまでにコピーしておく
+    (void)dev_sched_put(DEV_PRIO_HOUSEKEEPING, blk_store_load, NULL);
+    (void)dev_sched_put(DEV_PRIO_HOUSEKEEPING, blk_store_process, NULL);
+}
+
+
+/**
+ * @brief 保存するデータ
+ *
+ * @param[in]   Idx     ブロック番号 or BLKSTORE_IDX_HDR
+ * @return      m_blk_imageの該当箇所
+ */
+static const uint8_t *blk_store_data(uint8_t Idx)
+{
+    return (Idx == BLKSTORE_IDX_HDR) ? (const uint8_t *)&m_blk_image.Hdr : m_blk_image.Data[Idx];
+}
+
+
+/**
+ * @brief フラッシュからRAMへのコピー
+ *
+ * 参照先をm_blk_imageに切り替える。
+ * 先にRFから書き込まれたブロックはRAMの方が新しいのでコピーしない。
+ */
+static void blk_store_load(void *p_context)
+{
+    if (m_blk_hdr != &m_blk_image.Hdr) {
+        memcpy(&m_blk_image.Hdr, (const void *)m_blk_hdr, sizeof(BLKIMG_header_t));
+        m_blk_hdr = &m_blk_image.Hdr;
+    }
+    for (int i = 0; i < BLKIMG_BLK_MAX; i++) {
+        CRITICAL_REGION_ENTER();
+        if (m_blk_map[i] != m_blk_image.Data[i]) {
+            memcpy(m_blk_image.Data[i], (const void *)m_blk_map[i], BLKIMG_BLK_SIZE);
+            m_blk_map[i] = m_blk_image.Data[i];
+        }
+        CRITICAL_REGION_EXIT();
+    }
+}
+
+
+/**
+ * @brief フラッシュへの書込み
+ *
+ * RFからの書込みは割込みの中なので、スケジューラから呼び出す。
+ */
+static void blk_store_process(void *p_context)
+{
+    BLKSTORE_process();
+}
+
+
+/**********************************************
+ * 一括実行
+ **********************************************/
+
+/**
+ * @brief opの引数長と結果長
+ *
+ * @param[in]   op          FPS_OP_xxx
+ * @param[out]  p_arg_len   引数長
+ * @param[out]  p_res_len   結果長(status除く)
+ * @retval      false       未定義のop
+ */
+static bool remote_op_len(uint8_t op, uint8_t *p_arg_len, uint8_t *p_res_len)
+{
+    switch (op) {
+    case FPS_OP_REG_READ:
+        *p_arg_len = 2;
+        *p_res_len = 4;
+        break;
+    case FPS_OP_REG_WRITE:
+        *p_arg_len = 2 + 4 + 4;
+        *p_res_len = 0;
+        break;
+    case FPS_OP_BLK_READ:
+        *p_arg_len = 1;
+        *p_res_len = BLKIMG_BLK_SIZE;
+        break;
+    case FPS_OP_BLK_WRITE:
+        *p_arg_len = 1 + BLKIMG_BLK_SIZE;
+        *p_res_len = 0;
+        break;
+    case FPS_OP_OPMODE:
+    case FPS_OP_PLUG_SYSCODE:
+        *p_arg_len = 1;
+        *p_res_len = 0;
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief op実行
+ *
+ * RC-S730へのアクセスはIRQ処理(RCS730_isrIrq)とI2Cが重ならないよう、割込みを止めて行う。
+ *
+ * @param[in]   op          FPS_OP_xxx
+ * @param[in]   p_arg       引数
+ * @param[out]  p_res       結果
+ * @return      FPS_BATCH_xxx
+ */
+static uint8_t remote_op_exec(uint8_t op, const uint8_t *p_arg, uint8_t *p_res)
+{
+    int ret = 0;
+    uint16_t reg;
+    uint32_t val;
+    uint32_t mask;
+
+    switch (op) {
+    case FPS_OP_REG_READ:
+        reg = (uint16_t)(p_arg[0] | (p_arg[1] << 8));
+        val = 0;
+        CRITICAL_REGION_ENTER();
+        ret = RCS730_readRegister(reg, &val);
+        CRITICAL_REGION_EXIT();
+        p_res[0] = (uint8_t)val;
+        p_res[1] = (uint8_t)(val >> 8);
+        p_res[2] = (uint8_t)(val >> 16);
+        p_res[3] = (uint8_t)(val >> 24);
+        break;
+
+    case FPS_OP_REG_WRITE:
+        reg = (uint16_t)(p_arg[0] | (p_arg[1] << 8));
+        if (!remote_reg_writable(reg)) {
+            return FPS_BATCH_ERR_RANGE;
+        }
+        val = (uint32_t)p_arg[2] | ((uint32_t)p_arg[3] << 8) | ((uint32_t)p_arg[4] << 16) | ((uint32_t)p_arg[5] << 24);
+        mask = (uint32_t)p_arg[6] | ((uint32_t)p_arg[7] << 8) | ((uint32_t)p_arg[8] << 16) | ((uint32_t)p_arg[9] << 24);
+        CRITICAL_REGION_ENTER();
+        ret = RCS730_writeRegister(reg, val, mask);
+        CRITICAL_REGION_EXIT();
+        break;
+
+    case FPS_OP_BLK_READ:
+        if (p_arg[0] >= BLKIMG_BLK_MAX) {
+            return FPS_BATCH_ERR_RANGE;
+        }
+        memcpy(p_res, (const void *)m_blk_map[p_arg[0]], BLKIMG_BLK_SIZE);
+        break;
+
+    case FPS_OP_BLK_WRITE:
+        if (p_arg[0] >= BLKIMG_BLK_MAX) {
+            return FPS_BATCH_ERR_RANGE;
+        }
+        //RFからの読込み(IRQ)と重ならないようにする
+        CRITICAL_REGION_ENTER();
+        memcpy(m_blk_image.Data[p_arg[0]], &p_arg[1], BLKIMG_BLK_SIZE);
+        m_blk_map[p_arg[0]] = m_blk_image.Data[p_arg[0]];
+        CRITICAL_REGION_EXIT();
+        BLKSTORE_write(p_arg[0]);
+        break;
+
+    case FPS_OP_OPMODE:
+        if (p_arg[0] > RCS730_OPMODE_LITES) {
+            return FPS_BATCH_ERR_RANGE;
+        }
+        CRITICAL_REGION_ENTER();
+        ret = RCS730_setRegOpMode((RCS730_OpMode)p_arg[0]);
+        CRITICAL_REGION_EXIT();
+        break;
+
+    case FPS_OP_PLUG_SYSCODE:
+        if ((p_arg[0] != RCS730_PLUG_SYS_CODE_FEEL) && (p_arg[0] != RCS730_PLUG_SYS_CODE_NDEF)) {
+            return FPS_BATCH_ERR_RANGE;
+        }
+        CRITICAL_REGION_ENTER();
+        ret = RCS730_setRegPlugSysCode((RCS730_PlugSysCode)p_arg[0]);
+        CRITICAL_REGION_EXIT();
+        break;
+
+    default:
+        return FPS_BATCH_ERR_FORMAT;
+    }
+
+    return (ret == 0) ? FPS_BATCH_OK : FPS_BATCH_ERR_DEVICE;
+}
+
+
+/**
+ * @brief 送れなかった一括実行の結果を送る
+ *
+ * @retval      true    送れていない結果は無い
+ */
+static bool remote_batch_flush(void)
+{
+    uint32_t err_code;
+
+    if (m_batch_res_len == 0) {
+        return true;
+    }
+
+    err_code = ble_send(FPS_MSG_BATCH_RESULT, m_batch_res, m_batch_res_len);
+    if (err_code == NRF_ERROR_NO_MEM) {
+        //次のTX_COMPLETEでやり直す
+        return false;
+    }
+    if (err_code == NRF_SUCCESS) {
+        m_batch.resends++;
+    }
+    //送れた、または送れない状態(切断、Notification無効)
+    m_batch_res_len = 0;
+    return true;
+}
+
+
+/**
+ * @brief FPS_OP_REG_WRITEで書き込めるレジスタか
+ *
+ * 次のレジスタはドライバ(rcs730.c)の状態と食い違うので書かせない。
+ *  - I2C_SLAVE_ADDR : スレーブアドレスが変わり、RC-S730にアクセスできなくなる
+ *  - INIT_CTRL      : 初期化され、設定したOperation Modeや割込みマスクが消える
+ *  - INT_CLEAR      : RCS730_isrIrq()が処理する前のイベントが消える
+ *
+ * @param[in]   reg     レジスタ
+ * @retval      true    書き込める
+ */
+static bool remote_reg_writable(uint16_t reg)
+{
+    static const uint16_t deny[] = {
+        RCS730_REG_I2C_SLAVE_ADDR, RCS730_REG_INIT_CTRL, RCS730_REG_INT_CLEAR
+    };
+
+    //4byte書き込むので、アドレスがずれていても重なれば書かせない
+    for (int i = 0; i < (int)(sizeof(deny) / sizeof(deny[0])); i++) {
+        if ((reg + 4 > deny[i]) && (reg < deny[i] + 4)) {
+            return false;
+        }
+    }
+    return true;
+}
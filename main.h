@@ -4,5 +4,11 @@
 #include <stdint.h>
 
 void gpiote_irq_handler(uint32_t event_pins_low_to_high, uint32_t event_pins_high_to_low);
+void blk_image_begin(uint16_t offset, uint16_t length);
+void blk_image_updated(uint16_t offset, uint16_t length);
+void remote_batch_exec(const uint8_t *p_data, uint16_t length);
+void rf_log_request(const uint8_t *p_data, uint16_t length);
+void ble_tx_ready(void);
+void ble_tx_clear(void);
 
 #endif /* MAIN_H */
@@ -39,6 +39,8 @@
 
 #include "ble_fps.h"
 
+#include "app_util_platform.h"
+#include "app_timer.h"
 #include "app_trace.h"
 
 
@@ -47,6 +49,16 @@
  **************************************************************************/
 
 #define DESC_NDEF           "NDEF data"
+#define DESC_READ           "read stream"
+#define DESC_WRITE          "write stream"
+#define DESC_BLOCK          "block window"
+#define DESC_TELEM          "telemetry"
+
+/** Prepared Writeキューの1エントリのヘッダ長([handle][offset][length]) */
+#define QWR_HDR_LEN         (6)
+
+/** Read(Read Blob) Responseで返せる最大長(ATT_MTU-1) */
+#define BLOCK_READ_LEN      (FPS_PACKET_LEN + 2)
 
 
 /**************************************************************************
@@ -56,7 +68,32 @@
 static void on_connect(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
 static void on_disconnect(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
 static void on_write(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
+static void on_tx_complete(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
+static void on_rw_authorize(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
+static void qwr_exec(ble_fps_t *p_fps);
+static uint16_t shadow_fill(uint8_t *p_shadow, const uint8_t *p_value, uint16_t value_len, uint16_t offset);
+static void ndef_apply(ble_fps_t *p_fps, uint16_t offset, const uint8_t *p_data, uint16_t len);
+static void value_apply(uint8_t *p_dst, const uint8_t *p_data, uint16_t len);
+static void cccd_sync(ble_fps_t *p_fps);
+static void notify_ready(ble_fps_t *p_fps, bool restored);
+static uint32_t tx_pump(ble_fps_t *p_fps);
+static void tx_clear(ble_fps_t *p_fps);
+static void rx_fragment(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+static void bulk_start(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+static void bulk_rx(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+static bool bulk_idle(ble_fps_t *p_fps);
+static void bulk_ack(ble_fps_t *p_fps, uint8_t status);
+static void bench_start(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+static void bench_fill(ble_fps_t *p_fps);
+static void bench_rx(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+static void bench_check(ble_fps_t *p_fps);
+static void bench_result(ble_fps_t *p_fps);
 static uint32_t char_add_ndef(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
+static uint32_t char_add_read(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
+static uint32_t char_add_write(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
+static uint32_t char_add_block(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
+static uint32_t char_add_telem(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
+static uint32_t notify_read(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
 
 
 /**************************************************************************
@@ -76,7 +113,30 @@ uint32_t ble_fps_init(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
 
     //ハンドラ
     p_fps->evt_handler_ndef   = p_fps_init->evt_handler_ndef;
+    p_fps->msg_handler      = p_fps_init->msg_handler;
+    p_fps->bulk_handler     = p_fps_init->bulk_handler;
+    p_fps->write_begin_handler = p_fps_init->write_begin_handler;
+    p_fps->block_handler    = p_fps_init->block_handler;
+    //受け側が無ければ値はSoftDevice側に置く
+    p_fps->p_ndef_value     = (p_fps_init->p_ndef_shadow != NULL) ? p_fps_init->p_ndef_value : NULL;
+    p_fps->p_ndef_shadow    = p_fps_init->p_ndef_shadow;
+    p_fps->ndef_value_len   = p_fps_init->ndef_value_len;
+    p_fps->p_block_value    = p_fps_init->p_block_value;
+    p_fps->p_block_shadow   = p_fps_init->p_block_shadow;
+    p_fps->block_value_len  = p_fps_init->block_value_len;
+    memset(&p_fps->block_stat, 0, sizeof(p_fps->block_stat));
+    p_fps->telem_snapshot   = p_fps_init->telem_snapshot;
+    p_fps->telem_handler    = p_fps_init->telem_handler;
     p_fps->conn_handle      = BLE_CONN_HANDLE_INVALID;
+    p_fps->notify_enabled   = false;
+    p_fps->telem_notify_enabled = false;
+    tx_clear(p_fps);
+    memset(&p_fps->tx_stat, 0, sizeof(p_fps->tx_stat));
+    p_fps->rx.busy          = false;
+    p_fps->rx.seq           = 0;
+    memset(&p_fps->rx_stat, 0, sizeof(p_fps->rx_stat));
+    memset(&p_fps->bulk, 0, sizeof(p_fps->bulk));
+    memset(&p_fps->bench, 0, sizeof(p_fps->bench));
 
     //Base UUIDを登録し、UUID typeを取得
     ble_uuid128_t   base_uuid = { FPS_UUID_BASE };
@@ -96,10 +156,34 @@ uint32_t ble_fps_init(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
     }
 
     //キャラクタリスティック登録
+    p_fps->attr_user_bytes = 0;
     err_code = char_add_ndef(p_fps, p_fps_init);
     if (err_code != NRF_SUCCESS) {
         return err_code;
     }
+    err_code = char_add_read(p_fps, p_fps_init);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    err_code = char_add_write(p_fps, p_fps_init);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    if ((p_fps_init->p_block_value != NULL) && (p_fps_init->p_block_shadow != NULL)) {
+        err_code = char_add_block(p_fps, p_fps_init);
+        if (err_code != NRF_SUCCESS) {
+            return err_code;
+        }
+    }
+    if (p_fps_init->telem_snapshot != NULL) {
+        err_code = char_add_telem(p_fps, p_fps_init);
+        if (err_code != NRF_SUCCESS) {
+            return err_code;
+        }
+    }
+
+    //SoftDeviceのAttribute Tableを使わずに済んだ値の長さ
+    app_trace_log("fps: user memory value=%d byte\r\n", p_fps->attr_user_bytes);
 
     return NRF_SUCCESS;
 }
@@ -131,6 +215,36 @@ void ble_fps_on_ble_evt(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
         on_write(p_fps, p_ble_evt);
         break;
 
+    case BLE_EVT_TX_COMPLETE:
+        on_tx_complete(p_fps, p_ble_evt);
+        break;
+
+    //Prepared Writeのキューはアプリ側で持つ
+    case BLE_EVT_USER_MEM_REQUEST:
+        {
+            ble_user_mem_block_t mem_block;
+            uint32_t err_code;
+
+            mem_block.p_mem = p_fps->qwr_buf;
+            mem_block.len = sizeof(p_fps->qwr_buf);
+            err_code = sd_ble_user_mem_reply(p_ble_evt->evt.common_evt.conn_handle, &mem_block);
+            if (err_code != NRF_SUCCESS) {
+                app_trace_log("fps: user_mem_reply err=%d\r\n", err_code);
+            }
+        }
+        break;
+
+    case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+        on_rw_authorize(p_fps, p_ble_evt);
+        break;
+
+    //Bonding済みの相手のSystem Attribute(CCCD)が復元されたとき
+    //  Device Managerが先に処理しているので、CCCDの値を読み直す
+    case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+    case BLE_GAP_EVT_CONN_SEC_UPDATE:
+        cccd_sync(p_fps);
+        break;
+
     default:
         // No implementation needed.
         break;
@@ -139,29 +253,177 @@ void ble_fps_on_ble_evt(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
 
 
 /**
- * @brief Notification送信
+ * @brief メッセージ送信
+ *
+ * 送信キューに積み、送れるだけ送る。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
+ */
+uint32_t ble_fps_send(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length)
+{
+    uint32_t err_code;
+
+    err_code = ble_fps_queue(p_fps, type, p_data, length);
+    if (err_code == NRF_SUCCESS) {
+        err_code = tx_pump(p_fps);
+    }
+    return err_code;
+}
+
+
+/**
+ * @brief メッセージを送信キューに積む
+ *
+ * 1メッセージをFPS_PACKET_LEN単位のフラグメントに分割して送信キューに積む。
+ * 全フラグメントが入らない場合はメッセージごと破棄し、NRF_ERROR_NO_MEMを返す(一部だけ積むことはしない)。
+ *
+ * RC-S730のIRQ(GPIOTE割込み)から呼ばれるため、キュー操作はクリティカルセクションで行う。
+ * SoftDeviceは呼ばない。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
+ */
+uint32_t ble_fps_queue(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length)
+{
+    uint32_t err_code = NRF_SUCCESS;
+    uint8_t nfrag;
+    uint32_t now;
+
+    if (length > FPS_MSG_MAX_LEN) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if ((p_fps->conn_handle == BLE_CONN_HANDLE_INVALID) || !p_fps->notify_enabled) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
+    nfrag = (uint8_t)FPS_MSG_PACKETS(length);
+    app_timer_cnt_get(&now);
+
+    CRITICAL_REGION_ENTER();
+    if (FPS_TX_QUEUE_LEN - p_fps->tx_cnt < nfrag) {
+        //back-pressure
+        p_fps->tx_stat.drops++;
+        err_code = NRF_ERROR_NO_MEM;
+    }
+    else {
+        uint16_t pos = 0;
+        uint16_t hdr_len;
+        uint16_t len;
+        ble_fps_packet_t *p_pkt;
+
+        do {
+            p_pkt = &p_fps->tx_queue[(p_fps->tx_rd + p_fps->tx_cnt) % FPS_TX_QUEUE_LEN];
+
+            //ヘッダ
+            p_pkt->data[0] = p_fps->tx_seq & FPS_HDR_SEQ_MASK;
+            if (pos == 0) {
+                p_pkt->data[0] |= FPS_HDR_FIRST;
+                p_pkt->data[1] = type;
+                p_pkt->data[2] = (uint8_t)length;
+                hdr_len = FPS_HDR_FIRST_LEN;
+            }
+            else {
+                hdr_len = FPS_HDR_NEXT_LEN;
+            }
+
+            //payload
+            len = length - pos;
+            if (len > FPS_PACKET_LEN - hdr_len) {
+                len = FPS_PACKET_LEN - hdr_len;
+            }
+            else {
+                p_pkt->data[0] |= FPS_HDR_LAST;
+            }
+            memcpy(&p_pkt->data[hdr_len], &p_data[pos], len);
+            p_pkt->len = (uint8_t)(hdr_len + len);
+            p_pkt->ticks = now;
+
+            p_fps->tx_seq++;
+            p_fps->tx_cnt++;
+            pos += len;
+        } while (pos < length);
+
+        if (p_fps->tx_cnt > p_fps->tx_stat.depth_max) {
+            p_fps->tx_stat.depth_max = p_fps->tx_cnt;
+        }
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+
+/**
+ * @brief 送信キューの送出
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+void ble_fps_tx_flush(ble_fps_t *p_fps)
+{
+    (void)tx_pump(p_fps);
+}
+
+
+/**
+ * @brief 送信キューの空きパケット数
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @return      空きパケット数
+ */
+uint8_t ble_fps_tx_free(const ble_fps_t *p_fps)
+{
+    return (uint8_t)(FPS_TX_QUEUE_LEN - p_fps->tx_cnt);
+}
+
+
+/**
+ * @brief 一括転送の受信先バッファ設定
  *
- * BLEの仕様上、ATT_MTU-3(nRF51822では20byte)までしか送信できない。
- * それ以上やりとりしたい場合は、Client側にRead Blob Requestしてもらうこと。
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_buf       受信先バッファ
+ * @param[in]   size        バッファサイズ
+ */
+void ble_fps_bulk_buffer_set(ble_fps_t *p_fps, uint8_t *p_buf, uint16_t size)
+{
+    p_fps->bulk.p_buf = p_buf;
+    p_fps->bulk.size = size;
+    p_fps->bulk.active = false;
+}
+
+
+/**
+ * @brief テレメトリのNotification送信
  *
- * CCCDのValueにNotificationビットが立っていない場合はNRF_ERROR_INVALID_STATEになる。
- * Write許可している場合はCentralからビットを落とされている可能性があるので注意。
+ * 周期的に同じ形の値を送るだけなので、送信キューを使わずに直接送る。
+ * TXバッファが無くて送れなかった分は、次の周期で新しい値を送ればよい。
  *
  * @param[in]   p_fps       サービス構造体
  * @retval      NRF_SUCCESS 成功
  */
-uint32_t ble_fps_notify(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+uint32_t ble_fps_telem_notify(ble_fps_t *p_fps)
 {
     ble_gatts_hvx_params_t params;
+    uint16_t length = FPS_TELEM_LEN;
+
+    if ((p_fps->conn_handle == BLE_CONN_HANDLE_INVALID) || !p_fps->telem_notify_enabled ||
+      (p_fps->telem_snapshot == NULL)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
 
-    app_trace_log("ble_fps_notify\r\n");
+    p_fps->telem_snapshot(p_fps, p_fps->telem_value);
 
     memset(&params, 0, sizeof(params));
-    params.handle = p_fps->char_handle_ndef.value_handle;
-    params.type = BLE_GATT_HVX_NOTIFICATION;    //Notification
-//    params.offset = 0;
+    params.handle = p_fps->char_handle_telem.value_handle;
+    params.type = BLE_GATT_HVX_NOTIFICATION;
     params.p_len = &length;
-    params.p_data = (uint8_t *)p_data;
+    params.p_data = p_fps->telem_value;
 
     return sd_ble_gatts_hvx(p_fps->conn_handle, &params);
 }
@@ -179,7 +441,20 @@ uint32_t ble_fps_notify(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length
  */
 static void on_connect(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
 {
+    uint32_t err_code;
+
     p_fps->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+    p_fps->notify_enabled = false;
+    p_fps->telem_notify_enabled = false;
+    p_fps->tx_first = true;
+    p_fps->tx_stat.ready_delay = 0;
+    app_timer_cnt_get(&p_fps->conn_ticks);
+
+    //1Connectionイベントで送信できるパケット数
+    err_code = sd_ble_tx_buffer_count_get(&p_fps->tx_credits);
+    if (err_code != NRF_SUCCESS) {
+        p_fps->tx_credits = 1;
+    }
 }
 
 
@@ -193,119 +468,1341 @@ static void on_disconnect(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
 {
     UNUSED_PARAMETER(p_ble_evt);
     p_fps->conn_handle = BLE_CONN_HANDLE_INVALID;
+
+    app_trace_log("fps tx: pkt=%d byte=%d drop=%d err=%d depth=%d delay(max)=%d first=%d\r\n",
+                    p_fps->tx_stat.packets, p_fps->tx_stat.bytes, p_fps->tx_stat.drops, p_fps->tx_stat.errors,
+                    p_fps->tx_stat.depth_max, p_fps->tx_stat.delay_max,
+                    (p_fps->tx_first) ? 0 : p_fps->tx_stat.first_delay);
+    app_trace_log("fps rx: pkt=%d byte=%d msg=%d seqerr=%d\r\n",
+                    p_fps->rx_stat.packets, p_fps->rx_stat.bytes, p_fps->rx_stat.msgs,
+                    p_fps->rx_stat.seq_errors);
+    app_trace_log("fps bulk: nak=%d dup=%d abort=%d\r\n", p_fps->bulk.naks, p_fps->bulk.dups, p_fps->bulk.aborts);
+    app_trace_log("fps block: read=%d write=%d prep=%d exec=%d reject=%d\r\n",
+                    p_fps->block_stat.reads, p_fps->block_stat.writes, p_fps->block_stat.prep_writes,
+                    p_fps->block_stat.execs, p_fps->block_stat.rejects);
+
+    //送受信途中のメッセージは破棄する
+    p_fps->notify_enabled = false;
+    p_fps->telem_notify_enabled = false;
+    tx_clear(p_fps);
+    p_fps->rx.busy = false;
+    p_fps->rx.seq = 0;
+    p_fps->bulk.active = false;
+    p_fps->bench.active = false;
+    p_fps->bench.result_pending = false;
+}
+
+
+/**
+ * @brief CCCDの読み直し
+ *
+ * Bonding済みの相手では、CentralがCCCDを書き込まずにSystem Attributeから復元される。
+ * そのときBLE_GATTS_EVT_WRITEは来ないので、値を読んでnotify_enabledに反映する。
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void cccd_sync(ble_fps_t *p_fps)
+{
+    uint32_t err_code;
+    uint8_t cccd[BLE_CCCD_VALUE_LEN];
+    uint16_t len = sizeof(cccd);
+
+    err_code = sd_ble_gatts_value_get(p_fps->char_handle_read.cccd_handle, 0, &len, cccd);
+    if ((err_code == NRF_SUCCESS) && (len == sizeof(cccd))) {
+        if (!p_fps->notify_enabled && ble_srv_is_notification_enabled(cccd)) {
+            notify_ready(p_fps, true);
+            (void)tx_pump(p_fps);
+        }
+        app_trace_log("fps cccd restored=%d\r\n", p_fps->notify_enabled);
+    }
+
+    len = sizeof(cccd);
+    if (p_fps->telem_snapshot != NULL) {
+        err_code = sd_ble_gatts_value_get(p_fps->char_handle_telem.cccd_handle, 0, &len, cccd);
+        if ((err_code == NRF_SUCCESS) && (len == sizeof(cccd))) {
+            p_fps->telem_notify_enabled = ble_srv_is_notification_enabled(cccd);
+        }
+    }
+}
+
+
+/**
+ * @brief Notification許可
+ *
+ * 接続から許可までの時間は、Centralのサービス探索とCCCD書込みにかかった時間になる。
+ * Bonding情報から復元した場合は、探索を省略できている。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   restored    true:Bonding情報から復元した
+ */
+static void notify_ready(ble_fps_t *p_fps, bool restored)
+{
+    uint32_t now;
+
+    p_fps->notify_enabled = true;
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, p_fps->conn_ticks, &p_fps->tx_stat.ready_delay);
+    p_fps->tx_stat.ready_restored = restored;
+}
+
+
+/**
+ * @brief TX_COMPLETE時
+ *
+ * SoftDeviceのTXバッファが空いたので、送信キューの続きを送る。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_ble_evt   イベント構造体
+ */
+static void on_tx_complete(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
+{
+    uint8_t count = p_ble_evt->evt.common_evt.params.tx_complete.count;
+    uint8_t bench = 0;
+
+    //SoftDeviceは渡した順に送るので、古い方からcount個が完了した
+    CRITICAL_REGION_ENTER();
+    p_fps->tx_credits += count;
+    count = MIN(count, p_fps->tx_in_flight);
+    p_fps->tx_in_flight -= count;
+    while (count > 0) {
+        bench += p_fps->tx_in_flight_bench & 0x01;
+        p_fps->tx_in_flight_bench >>= 1;
+        count--;
+    }
+    CRITICAL_REGION_EXIT();
+
+    if (p_fps->bench.active) {
+        //1回のTX_COMPLETEは1回のConnectionイベントで送れた分
+        //  RF_FRAMEなど、同じキューを通る他のメッセージは数えない
+        if (bench > 0) {
+            p_fps->bench.tx_packets += bench;
+            p_fps->bench.tx_events++;
+        }
+        bench_check(p_fps);
+    }
+
+    tx_pump(p_fps);
+
+    if (p_fps->bench.active) {
+        bench_fill(p_fps);
+    }
+    else if (p_fps->bench.result_pending) {
+        //空けておいた分を他のメッセージが使った
+        if (ble_fps_send(p_fps, FPS_MSG_BENCH_RESULT, p_fps->bench.result, FPS_BENCH_RESULT_LEN) != NRF_ERROR_NO_MEM) {
+            p_fps->bench.result_pending = false;
+        }
+    }
 }
 
+
 /******************************************************************
- * Characteristic
+ * Fragment
  ******************************************************************/
 
 /**
- * @brief Write時
+ * @brief 送信キュー送出
+ *
+ * SoftDeviceのTXバッファに空きがある限り、送信キューの先頭からNotificationを送る。
+ * BLE_ERROR_NO_TX_BUFFERSの場合はBLE_EVT_TX_COMPLETEで再開する。
+ * それ以外のエラーの場合はそのパケットを破棄して続ける。
+ *
+ * RC-S730の応答期限を延ばさないよう、割込み禁止はキューの位置と数の更新だけにする。
+ * 送出中に割り込んだ呼び出しは何もせず、積んだパケットは送出中の側が送る。
+ * IRQからはble_fps_queue()で積むだけなので、ここへは来ない。
+ * 先頭パケットは送出する側しか取り出さず、積む側は末尾にしか書かないので、割込み許可のまま読める。
  *
  * @param[in]   p_fps       サービス構造体
- * @param[in]   p_ble_evt   イベント構造体
+ * @retval      NRF_SUCCESS 成功(TXバッファ不足で中断した場合も含む)
  */
-static void on_write(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
+static uint32_t tx_pump(ble_fps_t *p_fps)
 {
-    ble_gatts_evt_write_t *p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
+    ble_fps_packet_t *p_pkt;
+    uint32_t err_code = NRF_SUCCESS;
+    uint32_t ret = NRF_SUCCESS;
+    uint32_t now;
+    uint32_t delay;
+    bool busy;
 
-    if ((p_evt_write->handle == p_fps->char_handle_ndef.value_handle) &&
-      (p_fps->evt_handler_ndef != NULL)) {
-        //callback
-        p_fps->evt_handler_ndef(p_fps, p_evt_write->data, p_evt_write->len);
+    CRITICAL_REGION_ENTER();
+    busy = p_fps->tx_busy;
+    p_fps->tx_busy = true;
+    CRITICAL_REGION_EXIT();
+    if (busy) {
+        //割り込まれた側が続けて送る
+        return NRF_SUCCESS;
     }
 
-    //Notify/Indicate有り、かつCCCD書込み可で、書込みをチェックしたい場合
-#if 1
-    if ((p_evt_write->handle == p_fps->char_handle_ndef.cccd_handle) &&
-        (p_evt_write->len == 2)) {
-        // CCCDへの書込みが発生(Notify/Indicateの許可ビット変化)
-        if (p_fps->evt_handler_ndef != NULL) {
-            if (ble_srv_is_notification_enabled(p_evt_write->data)) {
-                //通知可能になった場合の処理
+    for (;;) {
+        CRITICAL_REGION_ENTER();
+        busy = (p_fps->tx_cnt > 0) && (p_fps->tx_credits > 0);
+        if (!busy) {
+            //ここで終わるので、この後に積まれたパケットは積んだ側が送る
+            p_fps->tx_busy = false;
+        }
+        CRITICAL_REGION_EXIT();
+        if (!busy) {
+            break;
+        }
+
+        p_pkt = &p_fps->tx_queue[p_fps->tx_rd];
+        err_code = notify_read(p_fps, p_pkt->data, p_pkt->len);
+        if (err_code == BLE_ERROR_NO_TX_BUFFERS) {
+            //TX_COMPLETEで再開
+            CRITICAL_REGION_ENTER();
+            p_fps->tx_credits = 0;
+            CRITICAL_REGION_EXIT();
+            continue;
+        }
+        if (err_code == NRF_SUCCESS) {
+            p_fps->tx_stat.packets++;
+            p_fps->tx_stat.bytes += p_pkt->len;
+
+            app_timer_cnt_get(&now);
+            app_timer_cnt_diff_compute(now, p_pkt->ticks, &delay);
+            p_fps->tx_stat.delay_sum += delay;
+            if (delay > p_fps->tx_stat.delay_max) {
+                p_fps->tx_stat.delay_max = delay;
             }
-            else {
-                //通知不可になった場合の処理
+            if (p_fps->tx_first) {
+                p_fps->tx_first = false;
+                app_timer_cnt_diff_compute(now, p_fps->conn_ticks, &p_fps->tx_stat.first_delay);
+            }
+        }
+        else {
+            p_fps->tx_stat.errors++;
+            ret = err_code;
+        }
+
+        CRITICAL_REGION_ENTER();
+        if (err_code == NRF_SUCCESS) {
+            p_fps->tx_credits--;
+            //計測データは1パケットに収まる
+            if ((p_pkt->data[0] & FPS_HDR_FIRST) && (p_pkt->data[1] == FPS_MSG_BENCH_DATA) &&
+              (p_fps->tx_in_flight < 8)) {
+                p_fps->tx_in_flight_bench |= (uint8_t)(1 << p_fps->tx_in_flight);
             }
+            p_fps->tx_in_flight++;
         }
+        p_fps->tx_rd = (p_fps->tx_rd + 1) % FPS_TX_QUEUE_LEN;
+        p_fps->tx_cnt--;
+        CRITICAL_REGION_EXIT();
     }
-#endif
+
+    if (ret != NRF_SUCCESS) {
+        app_trace_log("tx_pump err=%d\r\n", ret);
+    }
+    return ret;
 }
 
 
 /**
- * @brief キャラクタリスティック登録：Input
- *
- *      permission : Write
+ * @brief READキャラクタリスティックのNotification送信
  *
- * @param[in/out]   p_fps       サービス構造体
- * @param[in]       p_fps_init  サービス初期化構造体
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長
+ * @retval      NRF_SUCCESS 成功
  */
-static uint32_t char_add_ndef(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+static uint32_t notify_read(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
 {
-    ble_gatts_char_md_t char_md;
-    ble_uuid_t          char_uuid;
-    ble_gatts_attr_md_t attr_md;
-    ble_gatts_attr_t    attr_char_value;
-    ble_gatts_attr_md_t cccd_md;
-//    ble_gatts_attr_md_t char_ud_md;
+    ble_gatts_hvx_params_t params;
 
-    ///////////////////////
-    //Characteristicの設定
-    ///////////////////////
+    memset(&params, 0, sizeof(params));
+    params.handle = p_fps->char_handle_read.value_handle;
+    params.type = BLE_GATT_HVX_NOTIFICATION;
+    params.p_len = &length;
+    params.p_data = (uint8_t *)p_data;
 
-    // CCCD(Notify/Indicate用)
-    memset(&cccd_md, 0, sizeof(cccd_md));
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
-    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+    return sd_ble_gatts_hvx(p_fps->conn_handle, &params);
+}
 
-    // メタデータ
-    //      Read/Write without Res./Notify
-    memset(&char_md, 0, sizeof(char_md));
-    //property(アクセス方法)
-    char_md.char_props.read   = 1;
-    char_md.char_props.write  = 1;
-    char_md.char_props.notify = 1;
-    char_md.p_cccd_md         = &cccd_md;
-    //user description
-    char_md.p_char_user_desc        = (uint8_t *)DESC_NDEF;
-    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_NDEF);
-    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
 
-    // UUID
-    char_uuid.type = p_fps->uuid_type;
-    char_uuid.uuid = FPS_UUID_CHAR_NDEF;
+/**
+ * @brief 送信キュー破棄
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void tx_clear(ble_fps_t *p_fps)
+{
+    CRITICAL_REGION_ENTER();
+    p_fps->tx_rd = 0;
+    p_fps->tx_cnt = 0;
+    p_fps->tx_credits = 0;
+    p_fps->tx_seq = 0;
+    p_fps->tx_busy = false;
+    p_fps->tx_in_flight = 0;
+    p_fps->tx_in_flight_bench = 0;
+    CRITICAL_REGION_EXIT();
+}
 
 
-    ///////////////////////
-    // Attributeの設定
-    ///////////////////////
+/**
+ * @brief フラグメント受信
+ *
+ * シーケンス番号が飛んだ場合は組み立て中のメッセージを破棄し、次の先頭フラグメントを待つ。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      受信データ
+ * @param[in]   length      受信データ長
+ */
+static void rx_fragment(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+{
+    ble_fps_frag_t *p_rx = &p_fps->rx;
+    uint8_t hdr;
+    uint16_t hdr_len;
 
-    // メタデータ
-    //Readable/Writable
-    memset(&attr_md, 0, sizeof(attr_md));
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
-//    attr_md.vlen       = 0;
-    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
-//    attr_md.rd_auth    = 0;       //0:without response
-//    attr_md.wr_auth    = 0;       //0:without response
+    if (length < FPS_HDR_NEXT_LEN) {
+        return;
+    }
+    hdr = p_data[0];
 
-    // value
-    memset(&attr_char_value, 0, sizeof(attr_char_value));
-    attr_char_value.p_uuid       = &char_uuid;
-    attr_char_value.p_attr_md    = &attr_md;
-    attr_char_value.init_len     = 10;
-//    attr_char_value.init_offs    = 0;
-    attr_char_value.max_len      = 128;
-//    attr_char_value.p_value      = NULL;
+    if (hdr & FPS_HDR_FIRST) {
+        if (length < FPS_HDR_FIRST_LEN) {
+            return;
+        }
+        if (p_rx->busy) {
+            //前のメッセージは最終フラグメントが来ていない
+            p_fps->rx_stat.seq_errors++;
+        }
+        p_rx->type = p_data[1];
+        p_rx->len = p_data[2];
+        p_rx->pos = 0;
+        p_rx->busy = true;
+        hdr_len = FPS_HDR_FIRST_LEN;
+    }
+    else {
+        if (!p_rx->busy) {
+            return;
+        }
+        if ((hdr & FPS_HDR_SEQ_MASK) != (p_rx->seq & FPS_HDR_SEQ_MASK)) {
+            app_trace_log("rx_fragment seq err\r\n");
+            p_fps->rx_stat.seq_errors++;
+            p_rx->busy = false;
+            return;
+        }
+        hdr_len = FPS_HDR_NEXT_LEN;
+    }
+    p_rx->seq = (uint8_t)((hdr + 1) & FPS_HDR_SEQ_MASK);
 
+    length -= hdr_len;
+    if (p_rx->pos + length > p_rx->len) {
+        //全体長を超えた
+        p_fps->rx_stat.seq_errors++;
+        p_rx->busy = false;
+        return;
+    }
+    memcpy(&p_rx->buf[p_rx->pos], &p_data[hdr_len], length);
+    p_rx->pos += length;
 
-    ///////////////////////
-    // キャラクタリスティックの登録
-    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
-                                                &char_md,
-                                                &attr_char_value,
+    if (hdr & FPS_HDR_LAST) {
+        p_rx->busy = false;
+        if (p_rx->pos != p_rx->len) {
+            p_fps->rx_stat.seq_errors++;
+            return;
+        }
+        p_fps->rx_stat.msgs++;
+        if (p_rx->type == FPS_MSG_BULK_START) {
+            bulk_start(p_fps, p_rx->buf, p_rx->len);
+        }
+        else if (p_rx->type == FPS_MSG_BENCH_START) {
+            bench_start(p_fps, p_rx->buf, p_rx->len);
+        }
+        else if (p_rx->type == FPS_MSG_BENCH_DATA) {
+            bench_rx(p_fps, p_rx->buf, p_rx->len);
+        }
+        else if (p_fps->msg_handler != NULL) {
+            p_fps->msg_handler(p_fps, p_rx->type, p_rx->buf, p_rx->len);
+        }
+    }
+}
+
+/******************************************************************
+ * Bulk
+ ******************************************************************/
+
+/**
+ * @brief 一括転送開始
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      FPS_MSG_BULK_STARTのデータ([offset(2)][length(2)], little endian)
+ * @param[in]   length      データ長
+ */
+static void bulk_start(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+{
+    ble_fps_bulk_t *p_bulk = &p_fps->bulk;
+    uint16_t offset;
+    uint16_t len;
+
+    if (length < 4) {
+        bulk_ack(p_fps, FPS_BULK_STATUS_ERROR);
+        return;
+    }
+    offset = (uint16_t)(p_data[0] | (p_data[1] << 8));
+    len = (uint16_t)(p_data[2] | (p_data[3] << 8));
+    if ((p_bulk->p_buf == NULL) || (len == 0) || ((uint32_t)offset + len > p_bulk->size)) {
+        app_trace_log("bulk_start: invalid range\r\n");
+        bulk_ack(p_fps, FPS_BULK_STATUS_ERROR);
+        return;
+    }
+
+    p_bulk->offset = offset;
+    p_bulk->len = len;
+    p_bulk->pos = 0;
+    p_bulk->pkt_idx = 0;
+    p_bulk->acked = 0;
+    p_bulk->nak_sent = false;
+    p_bulk->active = true;
+    app_timer_cnt_get(&p_bulk->rx_ticks);
+    if (p_fps->write_begin_handler != NULL) {
+        //受信先は書き終わるまで不完全になる
+        p_fps->write_begin_handler(p_fps, offset, len);
+    }
+
+    //受信準備ができたことを通知
+    bulk_ack(p_fps, FPS_BULK_STATUS_ACK);
+}
+
+
+/**
+ * @brief 一括転送データ受信
+ *
+ * SoftDeviceのイベントバッファから受信先バッファへ直接コピーする(中間バッファは使わない)。
+ * 受信先はRFの割込みからも読まれるので、value_apply()で写す。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      受信データ([パケット番号][data])
+ * @param[in]   length      受信データ長
+ */
+static void bulk_rx(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+{
+    ble_fps_bulk_t *p_bulk = &p_fps->bulk;
+    uint8_t diff;
+    uint16_t len;
+
+    if (length <= FPS_BULK_HDR_LEN) {
+        return;
+    }
+
+    diff = (uint8_t)(p_data[0] - (uint8_t)p_bulk->pkt_idx);
+    if (diff != 0) {
+        if (diff & 0x80) {
+            //受信済みパケットの再送
+            p_bulk->dups++;
+        }
+        else if (!p_bulk->nak_sent) {
+            //抜けを検出(同じ抜けに対しては1回だけNAKを返す)
+            p_bulk->naks++;
+            p_bulk->nak_sent = true;
+            bulk_ack(p_fps, FPS_BULK_STATUS_NAK);
+        }
+        return;
+    }
+
+    len = length - FPS_BULK_HDR_LEN;
+    if (len > p_bulk->len - p_bulk->pos) {
+        len = p_bulk->len - p_bulk->pos;
+    }
+    value_apply(p_bulk->p_buf + p_bulk->offset + p_bulk->pos, &p_data[FPS_BULK_HDR_LEN], len);
+    p_bulk->pos += len;
+    p_bulk->pkt_idx++;
+    p_bulk->nak_sent = false;
+    app_timer_cnt_get(&p_bulk->rx_ticks);
+
+    if (p_bulk->pos >= p_bulk->len) {
+        p_bulk->active = false;
+        bulk_ack(p_fps, FPS_BULK_STATUS_DONE);
+        if (p_fps->bulk_handler != NULL) {
+            p_fps->bulk_handler(p_fps, p_bulk->offset, p_bulk->len);
+        }
+    }
+    else if ((uint16_t)(p_bulk->pkt_idx - p_bulk->acked) >= FPS_BULK_ACK_INTERVAL) {
+        bulk_ack(p_fps, FPS_BULK_STATUS_ACK);
+    }
+}
+
+
+/**
+ * @brief 一括転送の中断判定
+ *
+ * Centralが転送をやめると、WRITEへの書込みがすべて一括転送のデータとして扱われ、
+ * BULK_STARTも送れなくなる。受信が進まないまま時間が経っていれば中断する。
+ * NAKや重複では時刻を更新しないので、CentralがBULK_STARTを送り続けても中断できる。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @retval      true        中断した(一括転送中ではない)
+ */
+static bool bulk_idle(ble_fps_t *p_fps)
+{
+    ble_fps_bulk_t *p_bulk = &p_fps->bulk;
+    uint32_t now;
+    uint32_t ticks;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, p_bulk->rx_ticks, &ticks);
+    if (ticks < (uint32_t)FPS_BULK_IDLE_TIMEOUT * 32768) {
+        return false;
+    }
+
+    app_trace_log("bulk: abort pos=%d/%d\r\n", p_bulk->pos, p_bulk->len);
+    p_bulk->active = false;
+    p_bulk->aborts++;
+    return true;
+}
+
+
+/**
+ * @brief 一括転送応答送信
+ *
+ * 送信キューがいっぱいで送れなかった場合、Centralはタイムアウトで再送する想定。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   status      FPS_BULK_STATUS_xxx
+ */
+static void bulk_ack(ble_fps_t *p_fps, uint8_t status)
+{
+    uint8_t ack[3];
+
+    ack[0] = status;
+    ack[1] = (uint8_t)(p_fps->bulk.pkt_idx & 0xff);
+    ack[2] = (uint8_t)(p_fps->bulk.pkt_idx >> 8);
+    p_fps->bulk.acked = p_fps->bulk.pkt_idx;
+    ble_fps_send(p_fps, FPS_MSG_BULK_ACK, ack, sizeof(ack));
+}
+
+
+/******************************************************************
+ * Benchmark
+ ******************************************************************/
+
+/**
+ * @brief スループット計測開始
+ *
+ * 計測中に再度受けた場合は、それまでの結果を返してからやり直す。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      FPS_MSG_BENCH_STARTのデータ([時間(sec)][mode])
+ * @param[in]   length      データ長
+ */
+static void bench_start(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+{
+    ble_fps_bench_t *p_bench = &p_fps->bench;
+
+    if (length < 2) {
+        return;
+    }
+    if (p_bench->active) {
+        bench_result(p_fps);
+    }
+    if (p_data[0] == 0) {
+        //停止のみ
+        return;
+    }
+
+    memset(p_bench, 0, sizeof(*p_bench));
+    p_bench->mode = p_data[1];
+    p_bench->duration = (uint32_t)p_data[0] * 32768;
+    p_bench->tx_errors_base = p_fps->tx_stat.errors;
+    //前の計測で送信完了待ちの計測データは数えない
+    CRITICAL_REGION_ENTER();
+    p_fps->tx_in_flight_bench = 0;
+    CRITICAL_REGION_EXIT();
+    app_timer_cnt_get(&p_bench->start_ticks);
+    p_bench->active = true;
+    app_trace_log("bench start sec=%d mode=%d\r\n", p_data[0], p_bench->mode);
+
+    bench_fill(p_fps);
+}
+
+
+/**
+ * @brief 計測データを送信キューに積む
+ *
+ * 結果を返す分の空きは残しておく。
+ * TXバッファが空く度(TX_COMPLETE)に呼ばれるので、SoftDeviceのバッファは常に埋まっている。
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void bench_fill(ble_fps_t *p_fps)
+{
+    ble_fps_bench_t *p_bench = &p_fps->bench;
+    uint8_t data[FPS_BENCH_DATA_LEN];
+
+    if ((p_bench->mode & FPS_BENCH_MODE_TX) == 0) {
+        return;
+    }
+
+    memset(data, 0xa5, sizeof(data));
+    while (ble_fps_tx_free(p_fps) > FPS_MSG_PACKETS(FPS_BENCH_RESULT_LEN)) {
+        data[0] = (uint8_t)p_bench->tx_seq;
+        data[1] = (uint8_t)(p_bench->tx_seq >> 8);
+        if (ble_fps_send(p_fps, FPS_MSG_BENCH_DATA, data, sizeof(data)) != NRF_SUCCESS) {
+            break;
+        }
+        p_bench->tx_seq++;
+    }
+}
+
+
+/**
+ * @brief 計測データ受信
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_data      FPS_MSG_BENCH_DATAのデータ([seq(2)][任意])
+ * @param[in]   length      データ長
+ */
+static void bench_rx(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length)
+{
+    ble_fps_bench_t *p_bench = &p_fps->bench;
+    uint16_t seq;
+
+    if (!p_bench->active || ((p_bench->mode & FPS_BENCH_MODE_RX) == 0) || (length < 2)) {
+        return;
+    }
+
+    seq = (uint16_t)(p_data[0] | (p_data[1] << 8));
+    p_bench->rx_losses += (uint16_t)(seq - p_bench->rx_seq);
+    p_bench->rx_seq = seq + 1;
+    p_bench->rx_packets++;
+
+    bench_check(p_fps);
+}
+
+
+/**
+ * @brief 計測時間の確認
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void bench_check(ble_fps_t *p_fps)
+{
+    uint32_t now;
+    uint32_t ticks;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, p_fps->bench.start_ticks, &ticks);
+    if (ticks >= p_fps->bench.duration) {
+        bench_result(p_fps);
+    }
+}
+
+
+/**
+ * @brief 計測終了と結果送信
+ *
+ * 上りも下りも1パケットはFPS_PACKET_LEN byte(ヘッダ含む)。
+ * 送信キューに入らなかった結果は、次のTX_COMPLETEで送り直す。
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void bench_result(ble_fps_t *p_fps)
+{
+    ble_fps_bench_t *p_bench = &p_fps->bench;
+    uint8_t *res = p_bench->result;
+    uint32_t now;
+    uint32_t ticks;
+    uint32_t tx_bps = 0;
+    uint32_t rx_bps = 0;
+    uint16_t ppce = 0;
+    uint16_t errors;
+    uint16_t losses;
+
+    p_bench->active = false;
+
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, p_bench->start_ticks, &ticks);
+    if (ticks > 0) {
+        tx_bps = (uint32_t)((uint64_t)p_bench->tx_packets * FPS_PACKET_LEN * 32768 / ticks);
+        rx_bps = (uint32_t)((uint64_t)p_bench->rx_packets * FPS_PACKET_LEN * 32768 / ticks);
+    }
+    if (p_bench->tx_events > 0) {
+        ppce = (uint16_t)(p_bench->tx_packets * 100 / p_bench->tx_events);
+    }
+    errors = (uint16_t)(p_fps->tx_stat.errors - p_bench->tx_errors_base);
+    losses = (uint16_t)p_bench->rx_losses;
+
+    res[0] = p_bench->mode;
+    res[1] = (uint8_t)ticks;
+    res[2] = (uint8_t)(ticks >> 8);
+    res[3] = (uint8_t)(ticks >> 16);
+    res[4] = (uint8_t)(ticks >> 24);
+    res[5] = (uint8_t)tx_bps;
+    res[6] = (uint8_t)(tx_bps >> 8);
+    res[7] = (uint8_t)(tx_bps >> 16);
+    res[8] = (uint8_t)(tx_bps >> 24);
+    res[9] = (uint8_t)ppce;
+    res[10] = (uint8_t)(ppce >> 8);
+    res[11] = (uint8_t)p_bench->tx_packets;
+    res[12] = (uint8_t)(p_bench->tx_packets >> 8);
+    res[13] = (uint8_t)(p_bench->tx_packets >> 16);
+    res[14] = (uint8_t)(p_bench->tx_packets >> 24);
+    res[15] = (uint8_t)errors;
+    res[16] = (uint8_t)(errors >> 8);
+    res[17] = (uint8_t)rx_bps;
+    res[18] = (uint8_t)(rx_bps >> 8);
+    res[19] = (uint8_t)(rx_bps >> 16);
+    res[20] = (uint8_t)(rx_bps >> 24);
+    res[21] = (uint8_t)p_bench->rx_packets;
+    res[22] = (uint8_t)(p_bench->rx_packets >> 8);
+    res[23] = (uint8_t)(p_bench->rx_packets >> 16);
+    res[24] = (uint8_t)(p_bench->rx_packets >> 24);
+    res[25] = (uint8_t)losses;
+    res[26] = (uint8_t)(losses >> 8);
+    p_bench->result_pending = (ble_fps_send(p_fps, FPS_MSG_BENCH_RESULT, res, FPS_BENCH_RESULT_LEN) == NRF_ERROR_NO_MEM);
+
+    app_trace_log("bench tx=%dB/s ppce=%d pkt=%d err=%d rx=%dB/s pkt=%d loss=%d\r\n",
+                    tx_bps, ppce, p_bench->tx_packets, errors,
+                    rx_bps, p_bench->rx_packets, losses);
+}
+
+
+/******************************************************************
+ * Characteristic
+ ******************************************************************/
+
+/**
+ * @brief Write時
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_ble_evt   イベント構造体
+ */
+static void on_write(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
+{
+    ble_gatts_evt_write_t *p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
+
+    //認可の要らない属性だけのPrepared Write
+    if (p_evt_write->op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) {
+        qwr_exec(p_fps);
+        return;
+    }
+
+    //アプリ側メモリの場合は認可要求で処理する
+    if ((p_evt_write->handle == p_fps->char_handle_ndef.value_handle) &&
+      (p_fps->p_ndef_value == NULL) && (p_fps->evt_handler_ndef != NULL)) {
+        //callback
+        p_fps->evt_handler_ndef(p_fps, p_evt_write->data, p_evt_write->len);
+    }
+
+    if (p_evt_write->handle == p_fps->char_handle_write.value_handle) {
+        p_fps->rx_stat.packets++;
+        p_fps->rx_stat.bytes += p_evt_write->len;
+        if (p_fps->bulk.active && !bulk_idle(p_fps)) {
+            //一括転送
+            bulk_rx(p_fps, p_evt_write->data, p_evt_write->len);
+        }
+        else {
+            //フラグメント組み立て
+            rx_fragment(p_fps, p_evt_write->data, p_evt_write->len);
+        }
+    }
+
+    //Notify/Indicate有り、かつCCCD書込み可で、書込みをチェックしたい場合
+#if 1
+    if ((p_evt_write->handle == p_fps->char_handle_read.cccd_handle) &&
+        (p_evt_write->len == 2)) {
+        // CCCDへの書込みが発生(Notify/Indicateの許可ビット変化)
+        if (ble_srv_is_notification_enabled(p_evt_write->data)) {
+            //通知可能になった場合の処理
+            if (!p_fps->notify_enabled) {
+                notify_ready(p_fps, false);
+            }
+        }
+        else {
+            //通知不可になった場合の処理
+            //  送っても届かないので、キューに残っているものは捨てる
+            p_fps->notify_enabled = false;
+            CRITICAL_REGION_ENTER();
+            p_fps->tx_rd = 0;
+            p_fps->tx_cnt = 0;
+            CRITICAL_REGION_EXIT();
+        }
+    }
+#endif
+
+    //テレメトリ
+    if (p_evt_write->handle == p_fps->char_handle_telem.value_handle) {
+        uint16_t len = FPS_TELEM_LEN;
+
+        if (p_fps->telem_handler != NULL) {
+            p_fps->telem_handler(p_fps, p_evt_write->data, p_evt_write->len);
+        }
+        //コマンドで上書きされた値と長さを戻す
+        p_fps->telem_snapshot(p_fps, p_fps->telem_value);
+        (void)sd_ble_gatts_value_set(p_fps->char_handle_telem.value_handle, 0, &len, p_fps->telem_value);
+    }
+    if ((p_evt_write->handle == p_fps->char_handle_telem.cccd_handle) &&
+        (p_evt_write->len == 2)) {
+        p_fps->telem_notify_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+    }
+}
+
+
+/**
+ * @brief Read/Write認可要求
+ *
+ * BLOCKキャラクタリスティック(ブロック窓)と、アプリ側メモリに置いたNDEFへのアクセス。
+ * SoftDeviceが読み書きするのは受け側(p_block_shadow, p_ndef_shadow)で、RFが読むブロックデータとは別のメモリ。
+ * Readは許可する前に返す範囲をブロックデータから受け側へ写す。
+ * Writeは許可した後、ブロックデータへの反映をvalue_apply()で行う(受け側への書込みは捨てる)。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_ble_evt   イベント構造体
+ */
+static void on_rw_authorize(ble_fps_t *p_fps, ble_evt_t *p_ble_evt)
+{
+    ble_gatts_evt_rw_authorize_request_t *p_req = &p_ble_evt->evt.gatts_evt.params.authorize_request;
+    ble_gatts_rw_authorize_reply_params_t reply;
+    uint32_t err_code;
+    uint16_t status = BLE_GATT_STATUS_SUCCESS;
+    uint8_t op = 0;
+    bool is_block = true;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.type = p_req->type;
+
+    if (p_req->type == BLE_GATTS_AUTHORIZE_TYPE_READ) {
+        if (p_req->request.read.handle == p_fps->char_handle_telem.value_handle) {
+            is_block = false;
+            //Readの度にスナップショットを作り直す(Read Blobの続きはそのまま返す)
+            if (p_req->request.read.offset == 0) {
+                p_fps->telem_snapshot(p_fps, p_fps->telem_value);
+            }
+            else if (p_req->request.read.offset > FPS_TELEM_LEN) {
+                status = BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+            }
+        }
+        else if ((p_req->request.read.handle == p_fps->char_handle_ndef.value_handle) &&
+          (p_fps->p_ndef_value != NULL)) {
+            is_block = false;
+            status = shadow_fill(p_fps->p_ndef_shadow, p_fps->p_ndef_value, p_fps->ndef_value_len,
+                                    p_req->request.read.offset);
+        }
+        else if (p_req->request.read.handle != p_fps->char_handle_block.value_handle) {
+            return;
+        }
+        else {
+            status = shadow_fill(p_fps->p_block_shadow, p_fps->p_block_value, p_fps->block_value_len,
+                                    p_req->request.read.offset);
+            if (status == BLE_GATT_STATUS_SUCCESS) {
+                p_fps->block_stat.reads++;
+            }
+        }
+        reply.params.read.gatt_status = status;
+    }
+    else {
+        ble_gatts_evt_write_t *p_write = &p_req->request.write;
+
+        op = p_write->op;
+        switch (op) {
+        case BLE_GATTS_OP_WRITE_REQ:
+        case BLE_GATTS_OP_PREP_WRITE_REQ:
+            if ((p_write->handle == p_fps->char_handle_ndef.value_handle) && (p_fps->p_ndef_value != NULL)) {
+                //Prepare WriteはExecute Writeまでキュー(qwr_buf)に溜まる
+                is_block = false;
+                if ((uint32_t)p_write->offset + p_write->len > p_fps->ndef_value_len) {
+                    status = BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+                }
+                break;
+            }
+            if (p_write->handle != p_fps->char_handle_block.value_handle) {
+                return;
+            }
+            if ((uint32_t)p_write->offset + p_write->len > p_fps->block_value_len) {
+                status = BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+            }
+            else if (op == BLE_GATTS_OP_WRITE_REQ) {
+                p_fps->block_stat.writes++;
+            }
+            else {
+                //Execute Writeまでキュー(qwr_buf)に溜まる
+                p_fps->block_stat.prep_writes++;
+            }
+            break;
+
+        case BLE_GATTS_OP_EXEC_WRITE_REQ_CANCEL:
+            //溜まったエントリを次のExecute Writeで反映しないよう捨てる
+            memset(p_fps->qwr_buf, 0, sizeof(p_fps->qwr_buf));
+            break;
+
+        case BLE_GATTS_OP_EXEC_WRITE_REQ_NOW:
+        default:
+            break;
+        }
+        reply.params.write.gatt_status = status;
+    }
+    if (is_block && (status != BLE_GATT_STATUS_SUCCESS)) {
+        //TELEMETRYのエラーはブロックの統計に入れない
+        p_fps->block_stat.rejects++;
+    }
+
+    err_code = sd_ble_gatts_rw_authorize_reply(p_fps->conn_handle, &reply);
+    if (err_code != NRF_SUCCESS) {
+        app_trace_log("fps: authorize_reply err=%d\r\n", err_code);
+        return;
+    }
+
+    if (status != BLE_GATT_STATUS_SUCCESS) {
+        return;
+    }
+    if (op == BLE_GATTS_OP_WRITE_REQ) {
+        ble_gatts_evt_write_t *p_write = &p_req->request.write;
+
+        if (p_write->handle == p_fps->char_handle_ndef.value_handle) {
+            ndef_apply(p_fps, p_write->offset, p_write->data, p_write->len);
+            if (p_fps->evt_handler_ndef != NULL) {
+                p_fps->evt_handler_ndef(p_fps, p_fps->p_ndef_value, p_write->offset + p_write->len);
+            }
+        }
+        else {
+            value_apply(p_fps->p_block_value + p_write->offset, p_write->data, p_write->len);
+            if (p_fps->block_handler != NULL) {
+                p_fps->block_handler(p_fps, p_write->offset, p_write->len);
+            }
+        }
+    }
+    else if (op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) {
+        qwr_exec(p_fps);
+    }
+}
+
+
+/**
+ * @brief Prepared Writeの反映
+ *
+ * キュー(qwr_buf)のエントリを値へ書き込み、書き込んだ範囲をハンドラに通知する。
+ * キューに並ぶのはBLOCKとNDEF(どちらもアプリ側メモリ)だけ。
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+static void qwr_exec(ble_fps_t *p_fps)
+{
+    uint16_t pos = 0;
+    uint16_t blk_start = UINT16_MAX;
+    uint16_t blk_end = 0;
+    uint16_t ndef_end = 0;
+
+    while (pos + QWR_HDR_LEN <= FPS_QWR_LEN) {
+        const uint8_t *p = &p_fps->qwr_buf[pos];
+        uint16_t handle = (uint16_t)(p[0] | (p[1] << 8));
+        uint16_t offset = (uint16_t)(p[2] | (p[3] << 8));
+        uint16_t len = (uint16_t)(p[4] | (p[5] << 8));
+
+        if (handle == BLE_GATT_HANDLE_INVALID) {
+            break;
+        }
+        pos += QWR_HDR_LEN;
+        if (pos + len > FPS_QWR_LEN) {
+            break;
+        }
+
+        if ((handle == p_fps->char_handle_block.value_handle) &&
+          ((uint32_t)offset + len <= p_fps->block_value_len)) {
+            value_apply(p_fps->p_block_value + offset, &p_fps->qwr_buf[pos], len);
+            blk_start = MIN(blk_start, offset);
+            blk_end = MAX(blk_end, offset + len);
+        }
+        else if ((handle == p_fps->char_handle_ndef.value_handle) && (p_fps->p_ndef_value != NULL) &&
+          ((uint32_t)offset + len <= p_fps->ndef_value_len)) {
+            ndef_apply(p_fps, offset, &p_fps->qwr_buf[pos], len);
+            ndef_end = MAX(ndef_end, offset + len);
+        }
+        pos += len;
+    }
+
+    if (blk_end > 0) {
+        p_fps->block_stat.execs++;
+        if (p_fps->block_handler != NULL) {
+            p_fps->block_handler(p_fps, blk_start, blk_end - blk_start);
+        }
+    }
+    if ((ndef_end > 0) && (p_fps->evt_handler_ndef != NULL)) {
+        p_fps->evt_handler_ndef(p_fps, p_fps->p_ndef_value, ndef_end);
+    }
+}
+
+
+/**
+ * @brief 受け側への写し
+ *
+ * Read(Read Blob)はupdate=0で許可し、受け側の値をoffsetから返すので、その範囲だけ写しておく。
+ *
+ * @param[out]  p_shadow    受け側
+ * @param[in]   p_value     値(アプリ側メモリ)
+ * @param[in]   value_len   値の長さ
+ * @param[in]   offset      Readのoffset
+ * @return      GATTステータス
+ */
+static uint16_t shadow_fill(uint8_t *p_shadow, const uint8_t *p_value, uint16_t value_len, uint16_t offset)
+{
+    uint16_t len;
+
+    if (offset > value_len) {
+        return BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+    }
+    len = MIN(value_len - offset, BLOCK_READ_LEN);
+
+    CRITICAL_REGION_ENTER();
+    memcpy(p_shadow + offset, p_value + offset, len);
+    CRITICAL_REGION_EXIT();
+    return BLE_GATT_STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief NDEFの値への書込み
+ *
+ * 値は索引(ヘッダ)を含むブロックイメージなので、書く前にwrite_begin_handlerで知らせる。
+ * 完了はevt_handler_ndefで通知すること。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   offset      書込み開始位置
+ * @param[in]   p_data      書き込むデータ
+ * @param[in]   len         書き込む長さ
+ */
+static void ndef_apply(ble_fps_t *p_fps, uint16_t offset, const uint8_t *p_data, uint16_t len)
+{
+    if (p_fps->write_begin_handler != NULL) {
+        p_fps->write_begin_handler(p_fps, offset, len);
+    }
+    value_apply(p_fps->p_ndef_value + offset, p_data, len);
+}
+
+
+/**
+ * @brief アプリ側メモリ(ブロックデータ)への書込み
+ *
+ * ブロック窓、NDEF、一括転送の受信先へ書くのはここだけ。
+ * RFの読込み(割込み)とブロックの途中で混ざらないよう、割込みを止めて写す。
+ *
+ * @param[out]  p_dst       書込み先
+ * @param[in]   p_data      書き込むデータ
+ * @param[in]   len         書き込む長さ
+ */
+static void value_apply(uint8_t *p_dst, const uint8_t *p_data, uint16_t len)
+{
+    CRITICAL_REGION_ENTER();
+    memcpy(p_dst, p_data, len);
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**
+ * @brief キャラクタリスティック登録：Input
+ *
+ *      permission : Write
+ *
+ * p_ndef_valueが指定された場合、値はアプリ側のメモリに置き、SoftDeviceには受け側(p_ndef_shadow)を渡す
+ * (BLE_GATTS_VLOC_USER, 認可付き)。
+ * RFの割込みが読むメモリへSoftDeviceが直接書かないよう、値との間の写しはon_rw_authorize()で行う。
+ * アプリが値を書き換えてもsd_ble_gatts_value_set()は不要。
+ *
+ * @param[in/out]   p_fps       サービス構造体
+ * @param[in]       p_fps_init  サービス初期化構造体
+ */
+static uint32_t char_add_ndef(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_uuid_t          char_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_gatts_attr_md_t cccd_md;
+//    ble_gatts_attr_md_t char_ud_md;
+
+    ///////////////////////
+    //Characteristicの設定
+    ///////////////////////
+
+    // CCCD(Notify/Indicate用)
+    memset(&cccd_md, 0, sizeof(cccd_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    // メタデータ
+    //      Read/Write without Res./Notify
+    memset(&char_md, 0, sizeof(char_md));
+    //property(アクセス方法)
+    char_md.char_props.read   = 1;
+    char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_cccd_md         = &cccd_md;
+    //user description
+    char_md.p_char_user_desc        = (uint8_t *)DESC_NDEF;
+    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_NDEF);
+    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+    // UUID
+    char_uuid.type = p_fps->uuid_type;
+    char_uuid.uuid = FPS_UUID_CHAR_NDEF;
+
+
+    ///////////////////////
+    // Attributeの設定
+    ///////////////////////
+
+    // メタデータ
+    //Readable/Writable
+    memset(&attr_md, 0, sizeof(attr_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+//    attr_md.vlen       = 0;
+//    attr_md.rd_auth    = 0;       //0:without response
+//    attr_md.wr_auth    = 0;       //0:without response
+
+    // value
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid       = &char_uuid;
+    attr_char_value.p_attr_md    = &attr_md;
+//    attr_char_value.init_offs    = 0;
+    if (p_fps->p_ndef_value != NULL) {
+        attr_md.vloc                 = BLE_GATTS_VLOC_USER;
+        attr_md.rd_auth              = 1;
+        attr_md.wr_auth              = 1;
+        attr_char_value.init_len     = p_fps_init->ndef_value_len;
+        attr_char_value.max_len      = p_fps_init->ndef_value_len;
+        attr_char_value.p_value      = p_fps_init->p_ndef_shadow;
+        p_fps->attr_user_bytes += p_fps_init->ndef_value_len;
+    }
+    else {
+        attr_md.vloc                 = BLE_GATTS_VLOC_STACK;
+        attr_char_value.init_len     = 10;
+        attr_char_value.max_len      = FPS_NDEF_STACK_LEN;
+    }
+
+
+    ///////////////////////
+    // キャラクタリスティックの登録
+    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
+                                                &char_md,
+                                                &attr_char_value,
                                                 &p_fps->char_handle_ndef);
 }
+
+
+/**
+ * @brief キャラクタリスティック登録：READ
+ *
+ *      permission : Notify
+ *
+ * RFから受けた要求などをCentralへ流す上り専用のキャラクタリスティック。
+ * 値はNotificationでのみ送信するので、Readは許可しない。
+ *
+ * @param[in/out]   p_fps       サービス構造体
+ * @param[in]       p_fps_init  サービス初期化構造体
+ */
+static uint32_t char_add_read(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_uuid_t          char_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_gatts_attr_md_t cccd_md;
+
+    // CCCD(Notify用)
+    memset(&cccd_md, 0, sizeof(cccd_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    // メタデータ
+    memset(&char_md, 0, sizeof(char_md));
+    char_md.char_props.notify = 1;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_char_user_desc        = (uint8_t *)DESC_READ;
+    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_READ);
+    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+    // UUID
+    char_uuid.type = p_fps->uuid_type;
+    char_uuid.uuid = FPS_UUID_CHAR_READ;
+
+    // Attribute
+    memset(&attr_md, 0, sizeof(attr_md));
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+    attr_md.vlen       = 1;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid       = &char_uuid;
+    attr_char_value.p_attr_md    = &attr_md;
+    attr_char_value.init_len     = 0;
+    attr_char_value.max_len      = FPS_PACKET_LEN;
+    attr_char_value.p_value      = p_fps->read_value;
+    p_fps->attr_user_bytes += FPS_PACKET_LEN;
+
+    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
+                                                &char_md,
+                                                &attr_char_value,
+                                                &p_fps->char_handle_read);
+}
+
+
+/**
+ * @brief キャラクタリスティック登録：WRITE
+ *
+ *      permission : Write without Response
+ *
+ * Centralからのメッセージを受ける下り専用のキャラクタリスティック。
+ * Write Requestの応答待ちが無いので、1回のConnectionイベントで複数パケットを受けられる。
+ *
+ * @param[in/out]   p_fps       サービス構造体
+ * @param[in]       p_fps_init  サービス初期化構造体
+ */
+static uint32_t char_add_write(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_uuid_t          char_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+
+    // メタデータ
+    memset(&char_md, 0, sizeof(char_md));
+    char_md.char_props.write_wo_resp = 1;
+    char_md.p_char_user_desc        = (uint8_t *)DESC_WRITE;
+    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_WRITE);
+    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+    // UUID
+    char_uuid.type = p_fps->uuid_type;
+    char_uuid.uuid = FPS_UUID_CHAR_WRITE;
+
+    // Attribute
+    memset(&attr_md, 0, sizeof(attr_md));
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vlen       = 1;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid       = &char_uuid;
+    attr_char_value.p_attr_md    = &attr_md;
+    attr_char_value.init_len     = 0;
+    attr_char_value.max_len      = FPS_PACKET_LEN;
+    attr_char_value.p_value      = p_fps->write_value;
+    p_fps->attr_user_bytes += FPS_PACKET_LEN;
+
+    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
+                                                &char_md,
+                                                &attr_char_value,
+                                                &p_fps->char_handle_write);
+}
+
+
+/**
+ * @brief キャラクタリスティック登録：BLOCK
+ *
+ *      permission : Read/Write(認可付き)
+ *
+ * 値はブロックデータと同じ長さの受け側(BLE_GATTS_VLOC_USER)。
+ * ATTのoffsetがブロック番号 x 16になるので、CentralはRead Blobや
+ * Prepared Writeで任意のブロックを読み書きできる。
+ * ブロックデータとの間の写しはon_rw_authorize()で行う。
+ *
+ * @param[in/out]   p_fps       サービス構造体
+ * @param[in]       p_fps_init  サービス初期化構造体
+ */
+static uint32_t char_add_block(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_uuid_t          char_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+
+    // メタデータ
+    memset(&char_md, 0, sizeof(char_md));
+    char_md.char_props.read  = 1;
+    char_md.char_props.write = 1;
+    char_md.p_char_user_desc        = (uint8_t *)DESC_BLOCK;
+    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_BLOCK);
+    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+    // UUID
+    char_uuid.type = p_fps->uuid_type;
+    char_uuid.uuid = FPS_UUID_CHAR_BLOCK;
+
+    // Attribute
+    memset(&attr_md, 0, sizeof(attr_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vlen       = 0;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
+    attr_md.rd_auth    = 1;
+    attr_md.wr_auth    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid       = &char_uuid;
+    attr_char_value.p_attr_md    = &attr_md;
+    attr_char_value.init_len     = p_fps_init->block_value_len;
+    attr_char_value.max_len      = p_fps_init->block_value_len;
+    attr_char_value.p_value      = p_fps_init->p_block_shadow;
+    p_fps->attr_user_bytes += p_fps_init->block_value_len;
+
+    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
+                                                &char_md,
+                                                &attr_char_value,
+                                                &p_fps->char_handle_block);
+}
+
+
+/**
+ * @brief キャラクタリスティック登録：TELEMETRY
+ *
+ *      permission : Read(認可付き)/Write/Notify
+ *
+ * 値は動作統計のスナップショット(BLE_GATTS_VLOC_USER)。
+ * Readは認可要求の中で値を作り直してから許可するので、いつ読んでも最新になる。
+ * Writeはコマンド(リセット、Notification周期)として扱う。
+ *
+ * @param[in/out]   p_fps       サービス構造体
+ * @param[in]       p_fps_init  サービス初期化構造体
+ */
+static uint32_t char_add_telem(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_uuid_t          char_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_gatts_attr_md_t cccd_md;
+
+    // CCCD(Notify用)
+    memset(&cccd_md, 0, sizeof(cccd_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    // メタデータ
+    memset(&char_md, 0, sizeof(char_md));
+    char_md.char_props.read   = 1;
+    char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_char_user_desc        = (uint8_t *)DESC_TELEM;
+    char_md.char_user_desc_size     = (uint8_t)strlen(DESC_TELEM);
+    char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+    // UUID
+    char_uuid.type = p_fps->uuid_type;
+    char_uuid.uuid = FPS_UUID_CHAR_TELEMETRY;
+
+    // Attribute
+    //  Writeはコマンドとして受け、処理したあと値を作り直す(on_write)
+    memset(&attr_md, 0, sizeof(attr_md));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vlen       = 1;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
+    attr_md.rd_auth    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid       = &char_uuid;
+    attr_char_value.p_attr_md    = &attr_md;
+    attr_char_value.init_len     = FPS_TELEM_LEN;
+    attr_char_value.max_len      = FPS_TELEM_LEN;
+    attr_char_value.p_value      = p_fps->telem_value;
+    p_fps->attr_user_bytes += FPS_TELEM_LEN;
+
+    return sd_ble_gatts_characteristic_add(p_fps->service_handle,
+                                                &char_md,
+                                                &attr_char_value,
+                                                &p_fps->char_handle_telem);
+}
@@ -36,6 +36,7 @@
  * include
  **************************************************************************/
 
+#include <stdbool.h>
 #include "ble.h"
 
 
@@ -50,6 +51,251 @@
 #define FPS_UUID_CHAR_NDEF      (0x5501)
 #define FPS_UUID_CHAR_READ      (0x5502)
 #define FPS_UUID_CHAR_WRITE     (0x5503)
+#define FPS_UUID_CHAR_BLOCK     (0x5504)
+#define FPS_UUID_CHAR_TELEMETRY (0x5505)
+
+/**
+ * 属性テーブルの版
+ *
+ * Bonding済みのCentralはハンドルをキャッシュし、サービス探索を省略する。
+ * 次の並びを変えたときは必ず値を上げること(上がっているとService Changedを通知する)。
+ * CCCDの数を変えたときはDM_GATT_CCCD_COUNT(device_manager_cnfg.h)も合わせること。
+ * 少ないとSystem Attributeが保存できず、再接続でCCCDがすべて失われる。
+ *
+ *  [GAP][GATT(Service Changed)]
+ *  [FPS Service]
+ *      NDEF  : Declaration, Value, CCCD
+ *      READ  : Declaration, Value, CCCD
+ *      WRITE : Declaration, Value
+ *      BLOCK : Declaration, Value
+ *      TELEMETRY : Declaration, Value, CCCD
+ */
+#define FPS_DB_VERSION          (3)
+
+/** 1パケットで送受信できる最大長(ATT_MTU-3) */
+#define FPS_PACKET_LEN          (20)
+
+/** NDEFの値をSoftDevice側に置く場合の最大長 */
+#define FPS_NDEF_STACK_LEN      (128)
+
+/** 分割転送で扱うメッセージの最大長 */
+#define FPS_MSG_MAX_LEN         (255)
+
+/*
+ * 分割転送ヘッダ
+ *
+ *  先頭フラグメント : [hdr][type][全体長][payload(17byte)]
+ *  後続フラグメント : [hdr][payload(19byte)]
+ *
+ *  hdr : b7=先頭, b6=最終, b5-0=シーケンス番号(フラグメント毎に+1)
+ */
+#define FPS_HDR_FIRST           (0x80)
+#define FPS_HDR_LAST            (0x40)
+#define FPS_HDR_SEQ_MASK        (0x3f)
+#define FPS_HDR_FIRST_LEN       (3)
+#define FPS_HDR_NEXT_LEN        (1)
+
+/** 送信キューの段数(パケット数) */
+#define FPS_TX_QUEUE_LEN        (16)
+
+/** メッセージ長からパケット数を求める */
+#define FPS_MSG_PACKETS(len)    (((len) <= FPS_PACKET_LEN - FPS_HDR_FIRST_LEN) ? 1 : \
+                                    (1 + ((len) - (FPS_PACKET_LEN - FPS_HDR_FIRST_LEN) + (FPS_PACKET_LEN - FPS_HDR_NEXT_LEN) - 1) / (FPS_PACKET_LEN - FPS_HDR_NEXT_LEN)))
+
+/*
+ * メッセージ種別
+ */
+#define FPS_MSG_RF_FRAME        (0x01)      ///< [P->C]RFで受信したFeliCaコマンド
+#define FPS_MSG_RF_FIELD        (0x02)      ///< [P->C]Readerの磁界を検出 [RF_STATUS(4, little endian)]
+                                            ///<    Centralは最初のコマンドが来る前にBULK_STARTでブロックを更新してよい
+#define FPS_MSG_BLK_DIFF        (0x03)      ///< [P->C]RFで書き換わったブロック [ブロック番号][変化mask(2)][変化したbyte]...
+                                            ///<    maskのbit nがブロックのn byte目(little endian)。同じ内容の書込みは送らない
+#define FPS_MSG_BLK_RESYNC      (0x04)      ///< [P->C]BLK_DIFFを送れなかった [送れなかったBLK_DIFF数]
+                                            ///<    Centralはブロックイメージ(NDEF)を読み直すこと。届くまでBLK_DIFFは送らない
+#define FPS_MSG_BULK_START      (0x10)      ///< [C->P]一括転送開始 [offset(2)][length(2)]
+#define FPS_MSG_BULK_ACK        (0x11)      ///< [P->C]一括転送応答 [status][受信済みパケット数(2)]
+
+/*
+ * 一括転送(Write without Response)
+ *
+ *  FPS_MSG_BULK_STARTのあと、WRITEキャラクタリスティックには次の形式でデータを書き込む。
+ *      [パケット番号(下位8bit)][data(19byte)]
+ *  CentralはACKを待たずにFPS_BULK_WINDOWパケットまで送ってよい。
+ *  PeripheralはFPS_BULK_ACK_INTERVALパケット毎にACK、抜けを検出したらNAKを返す。
+ *  NAKを受けたCentralは、通知された受信済みパケット数から再送する(go-back-N)。
+ *  FPS_BULK_IDLE_TIMEOUTのあいだ受信が進まなければ中断し、次の書込みからはメッセージとして扱う。
+ *  Centralは転送をやめたとき、その時間を待ってからBULK_STARTなどを送り直す(中断した範囲は書きかけのまま)。
+ */
+#define FPS_BULK_HDR_LEN        (1)
+#define FPS_BULK_WINDOW         (16)
+#define FPS_BULK_ACK_INTERVAL   (FPS_BULK_WINDOW / 2)
+#define FPS_BULK_IDLE_TIMEOUT   (2)         ///< 一括転送を中断するまでの時間[sec]
+
+#define FPS_BULK_STATUS_ACK     (0x00)      ///< 受信済みパケット数の通知
+#define FPS_BULK_STATUS_NAK     (0x01)      ///< 抜けを検出した
+#define FPS_BULK_STATUS_DONE    (0x02)      ///< 全データ受信完了
+#define FPS_BULK_STATUS_ERROR   (0xff)      ///< 開始要求が不正(範囲外など)
+
+/*
+ * スループット計測(ベンチマーク)
+ *
+ *  FPS_MSG_BENCH_STARTで開始し、指定時間のあいだ次を行う。
+ *      下り : PeripheralはFPS_MSG_BENCH_DATAを送信キューが空く限り送り続ける(READのNotification)
+ *      上り : CentralはFPS_MSG_BENCH_DATAをWRITEへWrite without Responseで送り続ける
+ *  どちらも通常のメッセージと同じ経路(分割転送、送信キュー)を通る。
+ *  時間が過ぎたら最初のイベント(TX_COMPLETEか受信)で止め、FPS_MSG_BENCH_RESULTを返す。
+ *  時間0のFPS_MSG_BENCH_STARTは、すぐに止めて結果を返す(上りだけで送り終えた場合など)。
+ *  Connectionパラメータは普段どおり切り替わるので、その影響も含めた値になる。
+ *
+ *  [C->P] FPS_MSG_BENCH_START  : [時間(sec)][mode]
+ *              mode : FPS_BENCH_MODE_TX | FPS_BENCH_MODE_RX
+ *  [C<->P] FPS_MSG_BENCH_DATA  : [seq(2)][任意(15)]    (1パケットに収まる長さ)
+ *              seqは方向毎に0から+1。飛んだ数を抜けとして数える。
+ *  [P->C] FPS_MSG_BENCH_RESULT : (little endian)
+ *              [0]     mode
+ *              [1-4]   計測時間[RTC1 tick]
+ *              [5-8]   下り byte/sec(ヘッダ含む)
+ *              [9-10]  下り Connectionイベント当たりのパケット数 x100
+ *              [11-14] 下り 送信したFPS_MSG_BENCH_DATAのパケット数(計測中の他のメッセージは含まない)
+ *              [15-16] 下り 送信エラーで破棄したパケット数
+ *              [17-20] 上り byte/sec(ヘッダ含む)
+ *              [21-24] 上り 受信したパケット数
+ *              [25-26] 上り 抜け(seqが飛んだ数)
+ */
+#define FPS_MSG_BENCH_START     (0x30)      ///< [C->P]計測開始
+#define FPS_MSG_BENCH_DATA      (0x31)      ///< [C<->P]計測データ
+#define FPS_MSG_BENCH_RESULT    (0x32)      ///< [P->C]計測結果
+
+#define FPS_BENCH_MODE_TX       (0x01)      ///< 下り(Peripheral->Central)
+#define FPS_BENCH_MODE_RX       (0x02)      ///< 上り(Central->Peripheral)
+
+#define FPS_BENCH_DATA_LEN      (FPS_PACKET_LEN - FPS_HDR_FIRST_LEN)
+#define FPS_BENCH_RESULT_LEN    (27)
+
+/*
+ * 一括実行
+ *
+ *  Centralは1メッセージでRC-S730やブロックイメージへの操作を並べて送り、
+ *  結果を1メッセージ(Notificationの列)で受け取る。
+ *
+ *  [C->P] FPS_MSG_BATCH        : [id][op][引数][op][引数]...
+ *  [P->C] FPS_MSG_BATCH_RESULT : [id][実行したop数][status][実行時間(4)][op][status][結果]...
+ *
+ *  opは先頭から順に実行し、エラーになったopで止める(そのopの結果までを返す)。
+ *  結果が送信キューに入らなければ、空き次第(TX_COMPLETE)送り直す。
+ *  Centralは結果を受け取ってから次の要求を送ること(送れていない結果があるときの要求は捨てる)。
+ *  FPS_OP_REG_WRITEで、ドライバの状態と食い違うレジスタ(I2C_SLAVE_ADDR, INIT_CTRL, INT_CLEAR)はFPS_BATCH_ERR_RANGE。
+ *  数値はlittle endian、実行時間はRTC1のカウント(1count = 約30.5us)。
+ *
+ *  op                      引数                            結果
+ *  FPS_OP_REG_READ         [reg(2)]                        [value(4)]
+ *  FPS_OP_REG_WRITE        [reg(2)][value(4)][mask(4)]     -
+ *  FPS_OP_BLK_READ         [ブロック番号]                  [data(16)]
+ *  FPS_OP_BLK_WRITE        [ブロック番号][data(16)]        -
+ *  FPS_OP_OPMODE           [RCS730_OpMode]                 -
+ *  FPS_OP_PLUG_SYSCODE     [RCS730_PlugSysCode]            -
+ */
+#define FPS_MSG_BATCH           (0x20)      ///< [C->P]一括実行要求
+#define FPS_MSG_BATCH_RESULT    (0x21)      ///< [P->C]一括実行結果
+#define FPS_BATCH_HDR_LEN       (7)
+
+#define FPS_OP_REG_READ         (0x01)      ///< RC-S730レジスタ読込み
+#define FPS_OP_REG_WRITE        (0x02)      ///< RC-S730レジスタ書込み(RCS730_writeRegister)
+#define FPS_OP_BLK_READ         (0x03)      ///< ブロックイメージ読込み
+#define FPS_OP_BLK_WRITE        (0x04)      ///< ブロックイメージ書込み
+#define FPS_OP_OPMODE           (0x05)      ///< RCS730_setRegOpMode
+#define FPS_OP_PLUG_SYSCODE     (0x06)      ///< RCS730_setRegPlugSysCode
+
+#define FPS_BATCH_OK            (0x00)      ///< 成功
+#define FPS_BATCH_ERR_FORMAT    (0x01)      ///< 未定義のop、引数不足
+#define FPS_BATCH_ERR_RANGE     (0x02)      ///< 引数が範囲外
+#define FPS_BATCH_ERR_DEVICE    (0x03)      ///< RC-S730へのアクセス失敗
+#define FPS_BATCH_ERR_FULL      (0x04)      ///< 結果がメッセージに入らない
+
+/*
+ * RFトランザクションログ
+ *
+ *  RC-S730のIRQから応答の送信許可までの各時点を、RTC1のカウント(1count = 約30.5us)で記録する。
+ *  Peripheralは最新RFLOG_NUM件をリングで持ち、Centralはseqを指定してページ毎に読み出す。
+ *  数値はlittle endian。
+ *
+ *  [C->P] FPS_MSG_RFLOG_REQ     : [種別][seq(2)]
+ *              種別 : FPS_RFLOG_RECORDS(seqから。古すぎるseqは最も古い記録から)
+ *                     FPS_RFLOG_SUMMARY(seq不要)
+ *                     FPS_RFLOG_RESET(seq不要。記録と集計を消す。seqは続きから)
+ *  [P->C] FPS_MSG_RFLOG_RECORDS : [件数][record]...   (最大FPS_RFLOG_PAGE件。続きは最後のseq+1で要求する)
+ *              record(FPS_RFLOG_RECORD_LEN)
+ *              [0-1]   seq
+ *              [2]     コマンドコード(0x00:Polling, 0x06:Read, 0x08:Write, 0xff:コールバック無し)
+ *              [3]     flags(bit0:同じIRQの2回目以降のINT_STATUS, bit1:同じINT_STATUSの2つ目のコールバック)
+ *              [4-7]   IRQ時刻
+ *              [8-17]  IRQからの時間(2) x 5 : INT_STATUS読込み、コールバック開始、コールバック終了、
+ *                                              応答書込み、送信許可 (0xffff:到達していない)
+ *  [P->C] FPS_MSG_RFLOG_SUMMARY : [コマンド数][summary]...
+ *              summary(FPS_RFLOG_SUMMARY_LEN)
+ *              [0]     コマンドコード
+ *              [1-4]   件数
+ *              [5-10]  応答時間 min, avg, max (2byteずつ)
+ *              [11-16] 応答時間 50%, 90%, 99%タイル (2byteずつ)
+ *              応答時間はIRQから送信許可まで(応答しないものはコールバック終了まで)。
+ *              件数・min・avg・maxはリセットから、パーセンタイルはリングにある記録から求める。
+ */
+#define FPS_MSG_RFLOG_REQ       (0x40)      ///< [C->P]RFログ要求
+#define FPS_MSG_RFLOG_RECORDS   (0x41)      ///< [P->C]RFログ記録
+#define FPS_MSG_RFLOG_SUMMARY   (0x42)      ///< [P->C]RFログ集計
+
+#define FPS_RFLOG_RECORDS       (0x00)      ///< 記録の読出し
+#define FPS_RFLOG_SUMMARY       (0x01)      ///< 集計の読出し
+#define FPS_RFLOG_RESET         (0x02)      ///< 記録と集計のリセット
+
+#define FPS_RFLOG_RECORD_LEN    (18)
+#define FPS_RFLOG_SUMMARY_LEN   (17)
+#define FPS_RFLOG_PAGE          (8)         ///< 1メッセージの記録数
+
+/*
+ * ブロック窓(BLOCKキャラクタリスティック)
+ *
+ *  値はブロックデータの配列そのもので、ATTのoffsetが「ブロック番号 x 16」になる。
+ *  Read(Read Blob)で任意のブロックから読み、Prepared Write/Execute Writeで任意のブロックへ書く。
+ *  Read/Writeは認可付きで、Peripheralが範囲を確認して応答する。
+ *  属性の値は受け側のバッファで、ブロックデータへはPeripheralが割込みを止めて写す。
+ *
+ *  Prepared Writeはアプリ側のメモリ(FPS_QWR_LEN)に溜め、Execute Writeで反映する。
+ *  溜まる形式 : [handle(2)][offset(2)][length(2)][data]... [BLE_GATT_HANDLE_INVALID(2)]
+ *  1回のPrepare Write RequestはATT_MTU-5(18byte)までなので、ヘッダを含めて24byte使う。
+ */
+#define FPS_QWR_LEN             (256)
+
+/*
+ * テレメトリ(TELEMETRYキャラクタリスティック)
+ *
+ *  値は動作統計のスナップショット(FPS_TELEM_LEN byte, little endian)で、Readの度に作り直す。
+ *  Notificationを許可して周期を設定すると、その周期で同じ値を通知する。
+ *  カウンタは16bitで一周するので、Centralは前回との差で見ること。
+ *
+ *  [0]     形式(FPS_TELEM_FORMAT)
+ *  [1-2]   リセットからの時間[sec]
+ *  [3-4]   RC-S730のIRQ数
+ *  [5-12]  RF応答時間(IRQから応答書込みまで)のヒストグラム
+ *              2ms未満, 4ms未満, 8ms未満, 8ms以上 (各2byte)
+ *  [13-14] I2Cのリトライ数
+ *  [15]    送信キュー段数の最大値
+ *  [16-17] 送信キューに入らず破棄したメッセージ数
+ *  [18]    スケジューラのキュー段数の最大値
+ *  [19]    スリープ(sd_app_evt_wait)していた時間の割合[%]
+ *
+ *  Writeで次のコマンドを受け付ける。
+ *      [FPS_TELEM_CMD_RESET]               : カウンタをリセットする
+ *      [FPS_TELEM_CMD_PERIOD][周期(sec)]   : Notification周期(0:停止, 切断で停止)
+ *      [FPS_TELEM_CMD_PROFILE]             : プロファイル結果をログ(UART)に出力する(デバッグビルドのみ)
+ */
+#define FPS_TELEM_LEN           (20)
+#define FPS_TELEM_FORMAT        (0x01)
+#define FPS_TELEM_HIST_NUM      (4)
+
+#define FPS_TELEM_CMD_RESET     (0x00)      ///< カウンタのリセット
+#define FPS_TELEM_CMD_PERIOD    (0x01)      ///< Notification周期の設定
+#define FPS_TELEM_CMD_PROFILE   (0x02)      ///< プロファイル結果のログ出力
 
 
 /**************************************************************************
@@ -70,9 +316,177 @@ typedef struct ble_fps_t ble_fps_t;
 typedef void (*ble_fps_evt_handler_t) (ble_fps_t *p_fps, const uint8_t *p_value, uint16_t length);
 
 
+/**
+ * @brief メッセージ受信ハンドラ
+ *
+ * 分割されたフラグメントを組み立て終わったときに呼ばれる。
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[in]   type    メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data  メッセージ
+ * @param[in]   length  メッセージ長
+ */
+typedef void (*ble_fps_msg_handler_t) (ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length);
+
+
+/**
+ * @brief 一括転送完了ハンドラ
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[in]   offset  受信先バッファの書込み開始位置
+ * @param[in]   length  受信したデータ長
+ */
+typedef void (*ble_fps_bulk_handler_t) (ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+
+
+/**
+ * @brief 書込み開始ハンドラ
+ *
+ * NDEFの値や一括転送の受信先(アプリ側メモリ)へ書き込み始める前に呼ばれる。
+ * 完了はevt_handler_ndef、bulk_handlerで通知する。一括転送を途中で中断した場合は通知しない。
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[in]   offset  書込み開始位置
+ * @param[in]   length  書き込む長さ
+ */
+typedef void (*ble_fps_write_begin_handler_t) (ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+
+
+/**
+ * @brief ブロック窓書込み完了ハンドラ
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[in]   offset  ブロック窓の書込み開始位置
+ * @param[in]   length  書き込んだ長さ
+ */
+typedef void (*ble_fps_block_handler_t) (ble_fps_t *p_fps, uint16_t offset, uint16_t length);
+
+
+/**
+ * @brief テレメトリ作成ハンドラ
+ *
+ * Read要求とNotificationの前に呼ばれる。割込みから呼ばれることは無い。
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[out]  p_value スナップショット(FPS_TELEM_LEN byte)
+ */
+typedef void (*ble_fps_telem_snapshot_t) (ble_fps_t *p_fps, uint8_t *p_value);
+
+
+/**
+ * @brief テレメトリコマンドハンドラ
+ *
+ * @param[in]   p_fps   I/Oサービス構造体
+ * @param[in]   p_cmd   コマンド(FPS_TELEM_CMD_xxx)
+ * @param[in]   length  コマンド長
+ */
+typedef void (*ble_fps_telem_handler_t) (ble_fps_t *p_fps, const uint8_t *p_cmd, uint16_t length);
+
+
+/**@brief 分割転送の状態(受信側) */
+typedef struct ble_fps_frag_t {
+    uint8_t                         buf[FPS_MSG_MAX_LEN];       /**< メッセージバッファ */
+    uint8_t                         type;                       /**< メッセージ種別 */
+    uint8_t                         len;                        /**< メッセージ長 */
+    uint8_t                         pos;                        /**< 受信済み長 */
+    uint8_t                         seq;                        /**< 次のシーケンス番号 */
+    bool                            busy;                       /**< true:転送中 */
+} ble_fps_frag_t;
+
+
+/**@brief 送信キューのパケット */
+typedef struct ble_fps_packet_t {
+    uint8_t                         data[FPS_PACKET_LEN];       /**< Notificationデータ */
+    uint8_t                         len;                        /**< データ長 */
+    uint32_t                        ticks;                      /**< キュー投入時刻[RTC1 tick] */
+} ble_fps_packet_t;
+
+
+/**@brief 送信キューの統計 */
+typedef struct ble_fps_tx_stat_t {
+    uint32_t                        packets;                    /**< 送信したパケット数 */
+    uint32_t                        bytes;                      /**< 送信したバイト数(ヘッダ含む) */
+    uint32_t                        drops;                      /**< キューに入らず破棄したメッセージ数 */
+    uint32_t                        errors;                     /**< 送信エラーで破棄したパケット数 */
+    uint8_t                         depth_max;                  /**< キュー段数の最大値 */
+    uint32_t                        delay_sum;                  /**< キュー待ち時間の合計[RTC1 tick] */
+    uint32_t                        delay_max;                  /**< キュー待ち時間の最大値[RTC1 tick] */
+    uint32_t                        first_delay;                /**< 接続から最初のNotificationまでの時間[RTC1 tick](前回接続) */
+    uint32_t                        ready_delay;                /**< 接続からNotification許可までの時間[RTC1 tick](前回接続) */
+    bool                            ready_restored;             /**< true:前回接続のNotification許可はBonding情報から復元 */
+} ble_fps_tx_stat_t;
+
+
+/**@brief 受信の統計 */
+typedef struct ble_fps_rx_stat_t {
+    uint32_t                        packets;                    /**< 受信したパケット数 */
+    uint32_t                        bytes;                      /**< 受信したバイト数(ヘッダ含む) */
+    uint32_t                        msgs;                       /**< 組み立てたメッセージ数 */
+    uint32_t                        seq_errors;                 /**< シーケンス番号不一致などで破棄した回数 */
+} ble_fps_rx_stat_t;
+
+
+/**@brief 一括転送の状態 */
+typedef struct ble_fps_bulk_t {
+    uint8_t                         *p_buf;                     /**< 受信先バッファ */
+    uint16_t                        size;                       /**< 受信先バッファサイズ */
+    uint16_t                        offset;                     /**< 今回の書込み開始位置 */
+    uint16_t                        len;                        /**< 今回の転送長 */
+    uint16_t                        pos;                        /**< 受信済み長 */
+    uint16_t                        pkt_idx;                    /**< 次に受けるパケット番号 */
+    uint16_t                        acked;                      /**< 最後にACKしたパケット番号 */
+    uint32_t                        rx_ticks;                   /**< 最後に受信が進んだ時刻[RTC1 tick] */
+    bool                            active;                     /**< true:一括転送中 */
+    bool                            nak_sent;                   /**< true:NAK送信済みで再送待ち */
+    uint32_t                        naks;                       /**< NAKを返した回数 */
+    uint32_t                        dups;                       /**< 重複して破棄したパケット数 */
+    uint32_t                        aborts;                     /**< 受信が進まず中断した回数 */
+} ble_fps_bulk_t;
+
+
+/**@brief スループット計測の状態 */
+typedef struct ble_fps_bench_t {
+    bool                            active;                     /**< true:計測中 */
+    uint8_t                         mode;                       /**< FPS_BENCH_MODE_xxx */
+    uint32_t                        start_ticks;                /**< 開始時刻[RTC1 tick] */
+    uint32_t                        duration;                   /**< 計測時間[RTC1 tick] */
+    uint16_t                        tx_seq;                     /**< 次に送るseq */
+    uint32_t                        tx_packets;                 /**< 送信完了した計測データのパケット数 */
+    uint32_t                        tx_events;                  /**< 計測データを含むTX_COMPLETEの回数(Connectionイベント数) */
+    uint32_t                        tx_errors_base;             /**< 開始時の送信エラー数 */
+    uint16_t                        rx_seq;                     /**< 次に受けるseq */
+    uint32_t                        rx_packets;                 /**< 受信したパケット数 */
+    uint32_t                        rx_losses;                  /**< seqが飛んだ数 */
+    uint8_t                         result[FPS_BENCH_RESULT_LEN];   /**< 計測結果(FPS_MSG_BENCH_RESULTのデータ) */
+    bool                            result_pending;             /**< true:送信キューが空かず結果を送れていない */
+} ble_fps_bench_t;
+
+
+/**@brief ブロック窓の統計 */
+typedef struct ble_fps_block_stat_t {
+    uint32_t                        reads;                      /**< Read/Read Blob Request数 */
+    uint32_t                        writes;                     /**< Write Request数 */
+    uint32_t                        prep_writes;                /**< Prepare Write Request数 */
+    uint32_t                        execs;                      /**< 反映したExecute Write Request数 */
+    uint32_t                        rejects;                    /**< 範囲外などで拒否した数 */
+} ble_fps_block_stat_t;
+
+
 /**@brief サービス初期化構造体 */
 typedef struct ble_fps_init_t {
-    ble_fps_evt_handler_t           evt_handler_ndef;             /**< イベントハンドラ : Notify発生 */
+    ble_fps_evt_handler_t           evt_handler_ndef;             /**< イベントハンドラ : NDEF Write発生 */
+    ble_fps_msg_handler_t           msg_handler;                  /**< イベントハンドラ : WRITEキャラクタリスティックのメッセージ受信 */
+    ble_fps_bulk_handler_t          bulk_handler;                 /**< イベントハンドラ : 一括転送完了 */
+    ble_fps_write_begin_handler_t   write_begin_handler;          /**< イベントハンドラ : NDEF、一括転送の書込み開始 */
+    ble_fps_block_handler_t         block_handler;                /**< イベントハンドラ : ブロック窓書込み */
+    uint8_t                         *p_ndef_value;                /**< NDEFの値(アプリ側メモリ, NULLならSoftDevice側) */
+    uint8_t                         *p_ndef_shadow;               /**< NDEFの受け側(ndef_value_len byte, SoftDeviceが読み書きする。NULLならSoftDevice側) */
+    uint16_t                        ndef_value_len;               /**< NDEFの値の長さ(512byte以下) */
+    uint8_t                         *p_block_value;               /**< ブロック窓の値(アプリ側メモリ, NULLならBLOCKを登録しない) */
+    uint8_t                         *p_block_shadow;              /**< ブロック窓の受け側(block_value_len byte, SoftDeviceが読み書きする) */
+    uint16_t                        block_value_len;              /**< ブロック窓の長さ(512byte以下) */
+    ble_fps_telem_snapshot_t        telem_snapshot;               /**< テレメトリ作成(NULLならTELEMETRYを登録しない) */
+    ble_fps_telem_handler_t         telem_handler;                /**< イベントハンドラ : テレメトリコマンド */
 } ble_fps_init_t;
 
 
@@ -83,7 +497,51 @@ typedef struct ble_fps_t {
     uint8_t                         uuid_type;
     //
     ble_gatts_char_handles_t        char_handle_ndef;           /**< Handles related to the Input characteristic. */
+    ble_gatts_char_handles_t        char_handle_read;           /**< READ(Peripheral->Central, Notify) */
+    ble_gatts_char_handles_t        char_handle_write;          /**< WRITE(Central->Peripheral, Write without Response) */
+    ble_gatts_char_handles_t        char_handle_block;          /**< BLOCK(ブロック窓, 認可付きRead/Write) */
+    ble_gatts_char_handles_t        char_handle_telem;          /**< TELEMETRY(認可付きRead, Write, Notify) */
     ble_fps_evt_handler_t           evt_handler_ndef;           /**< Event handler to be called for handling events in the I/O Service. */
+    ble_fps_msg_handler_t           msg_handler;                /**< メッセージ受信ハンドラ */
+    ble_fps_bulk_handler_t          bulk_handler;               /**< 一括転送完了ハンドラ */
+    ble_fps_write_begin_handler_t   write_begin_handler;        /**< 書込み開始ハンドラ */
+    ble_fps_block_handler_t         block_handler;              /**< ブロック窓書込みハンドラ */
+    ble_fps_telem_snapshot_t        telem_snapshot;             /**< テレメトリ作成 */
+    ble_fps_telem_handler_t         telem_handler;              /**< テレメトリコマンドハンドラ */
+    //
+    //キャラクタリスティックの値(BLE_GATTS_VLOC_USER)
+    uint8_t                         read_value[FPS_PACKET_LEN]; /**< READの値 */
+    uint8_t                         write_value[FPS_PACKET_LEN];/**< WRITEの値 */
+    uint16_t                        attr_user_bytes;            /**< アプリ側メモリに置いた値の合計長 */
+    uint8_t                         *p_ndef_value;              /**< NDEFの値(アプリ側メモリ) */
+    uint8_t                         *p_ndef_shadow;             /**< NDEFの受け側(BLE_GATTS_VLOC_USER) */
+    uint16_t                        ndef_value_len;             /**< NDEFの値の長さ */
+    uint8_t                         *p_block_value;             /**< ブロック窓の値(アプリ側メモリ) */
+    uint8_t                         *p_block_shadow;            /**< ブロック窓の受け側(BLE_GATTS_VLOC_USER) */
+    uint16_t                        block_value_len;            /**< ブロック窓の長さ */
+    uint8_t                         qwr_buf[FPS_QWR_LEN];       /**< Prepared Writeのキュー(BLE_EVT_USER_MEM_REQUESTで渡す) */
+    ble_fps_block_stat_t            block_stat;                 /**< ブロック窓統計 */
+    uint8_t                         telem_value[FPS_TELEM_LEN]; /**< TELEMETRYの値 */
+    bool                            telem_notify_enabled;       /**< true:TELEMETRYのCCCDでNotification許可 */
+    //
+    //上り(READ)
+    bool                            notify_enabled;             /**< true:READのCCCDでNotification許可 */
+    ble_fps_packet_t                tx_queue[FPS_TX_QUEUE_LEN]; /**< 送信キュー */
+    uint8_t                         tx_rd;                      /**< 送信キュー読込み位置 */
+    uint8_t                         tx_cnt;                     /**< 送信キュー段数 */
+    uint8_t                         tx_credits;                 /**< SoftDeviceの空きTXバッファ数 */
+    volatile bool                   tx_busy;                    /**< true:tx_pump()で送出中 */
+    uint8_t                         tx_in_flight;               /**< SoftDeviceに渡して送信完了待ちのパケット数 */
+    uint8_t                         tx_in_flight_bench;         /**< 送信完了待ちのうち計測データのbit(古い順にbit0から) */
+    uint8_t                         tx_seq;                     /**< 次の送信シーケンス番号 */
+    uint32_t                        conn_ticks;                 /**< 接続した時刻[RTC1 tick] */
+    bool                            tx_first;                   /**< true:接続後まだNotificationしていない */
+    ble_fps_tx_stat_t               tx_stat;                    /**< 送信キュー統計 */
+    //下り(WRITE)
+    ble_fps_frag_t                  rx;                         /**< 受信メッセージ組み立て */
+    ble_fps_rx_stat_t               rx_stat;                    /**< 受信統計 */
+    ble_fps_bulk_t                  bulk;                       /**< 一括転送 */
+    ble_fps_bench_t                 bench;                      /**< スループット計測 */
 } ble_fps_t;
 
 
@@ -109,14 +567,82 @@ uint32_t ble_fps_init(ble_fps_t *p_fps, const ble_fps_init_t *p_fps_init);
 void ble_fps_on_ble_evt(ble_fps_t *p_fps, ble_evt_t *p_ble_evt);
 
 
-/**@brief Notify送信
+/**@brief メッセージ送信
+ *
+ * メッセージをフラグメントに分割して送信キューに積み、SoftDeviceのTXバッファが空いている限り
+ * READキャラクタリスティックのNotificationで送信する。
+ * 残りはBLE_EVT_TX_COMPLETEで続きを送信する。
  *
  * @param[in]   p_fps       サービス構造体
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
  * @param[in]   p_data      データ
- * @param[in]   length      データ長(21byte以上は20byteにされる)
- * @retval      NRF_SUCCESS 成功
+ * @param[in]   length      データ長(FPS_MSG_MAX_LEN以下)
+ * @retval      NRF_SUCCESS             成功(キュー投入)
+ * @retval      NRF_ERROR_NO_MEM        送信キューに空きが無い(メッセージは破棄)
+ * @retval      NRF_ERROR_INVALID_STATE 未接続、またはNotification不許可
+ * @retval      NRF_ERROR_INVALID_PARAM データ長が大きすぎる
+ */
+uint32_t ble_fps_send(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length);
+
+
+/**@brief メッセージを送信キューに積む
+ *
+ * ble_fps_send()と同じだが、SoftDeviceは呼ばない(送出はble_fps_tx_flush()かBLE_EVT_TX_COMPLETE)。
+ * RC-S730のIRQなど、応答時間をBLEの状態に左右されたくない割込みから使う。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   type        メッセージ種別(FPS_MSG_xxx)
+ * @param[in]   p_data      データ
+ * @param[in]   length      データ長(FPS_MSG_MAX_LEN以下)
+ * @retval      NRF_SUCCESS             成功(キュー投入)
+ * @retval      NRF_ERROR_NO_MEM        送信キューに空きが無い(メッセージは破棄)
+ * @retval      NRF_ERROR_INVALID_STATE 未接続、またはNotification不許可
+ * @retval      NRF_ERROR_INVALID_PARAM データ長が大きすぎる
+ */
+uint32_t ble_fps_queue(ble_fps_t *p_fps, uint8_t type, const uint8_t *p_data, uint16_t length);
+
+
+/**@brief 送信キューの送出
+ *
+ * SoftDeviceのTXバッファが空いている限り、ble_fps_queue()で積んだメッセージを送信する。
+ *
+ * @param[in]   p_fps       サービス構造体
+ */
+void ble_fps_tx_flush(ble_fps_t *p_fps);
+
+
+/**@brief 送信キューの空きパケット数
+ *
+ * FPS_MSG_PACKETS()と比較して、ble_fps_send()がNRF_ERROR_NO_MEMになるかを事前に確認できる。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @return      空きパケット数
+ */
+uint8_t ble_fps_tx_free(const ble_fps_t *p_fps);
+
+
+/**@brief 一括転送の受信先バッファ設定
+ *
+ * WRITEキャラクタリスティックで受けたデータは、このバッファへ直接書き込まれる。
+ * 書込みは割込みを止めて行い、開始前にwrite_begin_handlerを呼ぶ。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @param[in]   p_buf       受信先バッファ(NULLで一括転送不可)
+ * @param[in]   size        バッファサイズ
+ */
+void ble_fps_bulk_buffer_set(ble_fps_t *p_fps, uint8_t *p_buf, uint16_t size);
+
+
+/**@brief テレメトリのNotification送信
+ *
+ * スナップショットを作り直してTELEMETRYキャラクタリスティックで通知する。
+ * 送信キューは使わない(TXバッファが無ければ今回は送らない)。
+ *
+ * @param[in]   p_fps       サービス構造体
+ * @retval      NRF_SUCCESS             成功
+ * @retval      NRF_ERROR_INVALID_STATE 未接続、Notification不許可、またはTELEMETRY無し
  */
-uint32_t ble_fps_notify(ble_fps_t *p_fps, const uint8_t *p_data, uint16_t length);
+uint32_t ble_fps_telem_notify(ble_fps_t *p_fps);
 
 #endif // BLE_FPS_H__
 
@@ -0,0 +1,453 @@
+/**
+ * @file    fakesd.c
+ * @brief   PC上でble_fps.cを動かすための偽SoftDevice
+ */
+
+#include <string.h>
+#include "nordic_common.h"
+#include "fakesd.h"
+#include "ble_srv_common.h"
+#include "app_timer.h"
+
+
+#define ATTR_MAX            (64)        ///< 属性数
+#define STACK_POOL_LEN      (1024)      ///< VLOC_STACKの値を置く領域
+#define TX_BUFFER_MAX       (8)         ///< TXバッファ数の上限
+#define AIR_MAX             (256)       ///< 空中に出たパケットを覚えておく数
+#define PACKET_LEN          (20)        ///< 1パケットの最大長(ATT_MTU-3)
+#define CLOCK_MASK          (0x00ffffff)
+
+
+/** 属性 */
+typedef struct attr_t {
+    uint8_t     *p_value;
+    uint16_t    len;
+    uint16_t    max_len;
+    uint16_t    cccd_handle;        ///< Notifyありの値ならCCCDのハンドル
+} attr_t;
+
+/** パケット */
+typedef struct packet_t {
+    uint16_t    handle;
+    uint16_t    len;
+    uint8_t     data[PACKET_LEN];
+} packet_t;
+
+
+static attr_t           m_attr[ATTR_MAX];
+static uint16_t         m_next_handle;
+static uint8_t          m_pool[STACK_POOL_LEN];
+static uint16_t         m_pool_used;
+static uint8_t          m_tx_buffers;
+static packet_t         m_tx[TX_BUFFER_MAX];
+static uint8_t          m_tx_cnt;
+static packet_t         m_air[AIR_MAX];
+static uint16_t         m_air_wr;
+static uint16_t         m_air_rd;
+static uint32_t         m_clock;
+static uint16_t         m_conn_handle;
+static fakesd_stat_t    m_stat;
+
+/** 許可待ちのWrite Request */
+static struct {
+    uint16_t    handle;
+    uint16_t    offset;
+    uint16_t    len;
+    uint8_t     data[256];
+} m_auth_write;
+
+/** イベント(ble_gatts_evt_write_tのdataは可変長) */
+static union {
+    ble_evt_t   evt;
+    uint8_t     buf[sizeof(ble_evt_t) + 256];
+} m_evt;
+
+
+static uint16_t attr_add(uint8_t *p_value, uint16_t len, uint16_t max_len);
+static ble_evt_t *evt_make(uint16_t evt_id);
+
+
+/**************************************************************************
+ * test API
+ **************************************************************************/
+
+void fakesd_reset(uint8_t tx_buffers)
+{
+    memset(m_attr, 0, sizeof(m_attr));
+    m_next_handle = 1;
+    m_pool_used = 0;
+    m_tx_buffers = MIN(tx_buffers, TX_BUFFER_MAX);
+    m_tx_cnt = 0;
+    m_air_wr = 0;
+    m_air_rd = 0;
+    m_auth_write.handle = BLE_GATT_HANDLE_INVALID;
+    m_clock = 0;
+    m_conn_handle = BLE_CONN_HANDLE_INVALID;
+    memset(&m_stat, 0, sizeof(m_stat));
+}
+
+
+void fakesd_tick(uint32_t ticks)
+{
+    m_clock += ticks;
+}
+
+
+uint8_t fakesd_conn_event(void)
+{
+    uint8_t cnt = m_tx_cnt;
+    uint8_t lp;
+
+    for (lp = 0; lp < cnt; lp++) {
+        if (m_air_wr < AIR_MAX) {
+            m_air[m_air_wr++] = m_tx[lp];
+        }
+    }
+    m_tx_cnt = 0;
+    if (cnt > 0) {
+        m_stat.conn_events++;
+        m_stat.air_packets += cnt;
+    }
+    return cnt;
+}
+
+
+uint16_t fakesd_air_get(uint16_t *p_handle, uint8_t *p_data)
+{
+    const packet_t *p_pkt;
+
+    if (m_air_rd >= m_air_wr) {
+        return 0;
+    }
+    p_pkt = &m_air[m_air_rd++];
+    if (p_handle != NULL) {
+        *p_handle = p_pkt->handle;
+    }
+    memcpy(p_data, p_pkt->data, p_pkt->len);
+    return p_pkt->len;
+}
+
+
+uint8_t fakesd_in_flight(void)
+{
+    return m_tx_cnt;
+}
+
+
+void fakesd_stat_get(fakesd_stat_t *p_stat)
+{
+    *p_stat = m_stat;
+}
+
+
+ble_evt_t *fakesd_evt_connected(void)
+{
+    ble_evt_t *p_evt = evt_make(BLE_GAP_EVT_CONNECTED);
+
+    m_conn_handle = FAKESD_CONN_HANDLE;
+    p_evt->evt.gap_evt.conn_handle = m_conn_handle;
+    return p_evt;
+}
+
+
+ble_evt_t *fakesd_evt_disconnected(void)
+{
+    ble_evt_t *p_evt = evt_make(BLE_GAP_EVT_DISCONNECTED);
+    uint16_t lp;
+
+    p_evt->evt.gap_evt.conn_handle = m_conn_handle;
+    m_conn_handle = BLE_CONN_HANDLE_INVALID;
+    m_tx_cnt = 0;
+    m_air_rd = m_air_wr;
+    //CCCDはBondingしていない相手として消す
+    for (lp = 1; lp < m_next_handle; lp++) {
+        if (m_attr[lp].cccd_handle != 0) {
+            memset(m_attr[m_attr[lp].cccd_handle].p_value, 0, BLE_CCCD_VALUE_LEN);
+        }
+    }
+    return p_evt;
+}
+
+
+ble_evt_t *fakesd_evt_write(uint16_t handle, const uint8_t *p_data, uint16_t len)
+{
+    ble_evt_t *p_evt = evt_make(BLE_GATTS_EVT_WRITE);
+    ble_gatts_evt_write_t *p_write = &p_evt->evt.gatts_evt.params.write;
+    uint16_t value_len = len;
+
+    (void)sd_ble_gatts_value_set(handle, 0, &value_len, p_data);
+
+    p_evt->evt.gatts_evt.conn_handle = m_conn_handle;
+    p_write->handle = handle;
+    p_write->op = BLE_GATTS_OP_WRITE_REQ;
+    p_write->offset = 0;
+    p_write->len = len;
+    memcpy(p_write->data, p_data, len);
+    return p_evt;
+}
+
+
+ble_evt_t *fakesd_evt_authorize_read(uint16_t handle, uint16_t offset)
+{
+    ble_evt_t *p_evt = evt_make(BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST);
+    ble_gatts_evt_rw_authorize_request_t *p_req = &p_evt->evt.gatts_evt.params.authorize_request;
+
+    p_evt->evt.gatts_evt.conn_handle = m_conn_handle;
+    p_req->type = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    p_req->request.read.handle = handle;
+    p_req->request.read.offset = offset;
+    m_auth_write.handle = BLE_GATT_HANDLE_INVALID;
+    return p_evt;
+}
+
+
+ble_evt_t *fakesd_evt_authorize_write(uint16_t handle, const uint8_t *p_data, uint16_t len)
+{
+    ble_evt_t *p_evt = evt_make(BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST);
+    ble_gatts_evt_rw_authorize_request_t *p_req = &p_evt->evt.gatts_evt.params.authorize_request;
+
+    p_evt->evt.gatts_evt.conn_handle = m_conn_handle;
+    p_req->type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    p_req->request.write.handle = handle;
+    p_req->request.write.op = BLE_GATTS_OP_WRITE_REQ;
+    p_req->request.write.offset = 0;
+    p_req->request.write.len = len;
+    memcpy(p_req->request.write.data, p_data, len);
+
+    m_auth_write.handle = handle;
+    m_auth_write.offset = 0;
+    m_auth_write.len = len;
+    memcpy(m_auth_write.data, p_data, len);
+    return p_evt;
+}
+
+
+ble_evt_t *fakesd_evt_tx_complete(uint8_t count)
+{
+    ble_evt_t *p_evt = evt_make(BLE_EVT_TX_COMPLETE);
+
+    p_evt->evt.common_evt.conn_handle = m_conn_handle;
+    p_evt->evt.common_evt.params.tx_complete.count = count;
+    return p_evt;
+}
+
+
+/**************************************************************************
+ * SoftDevice
+ **************************************************************************/
+
+uint32_t sd_ble_uuid_vs_add(const ble_uuid128_t *p_vs_uuid, uint8_t *p_uuid_type)
+{
+    UNUSED_PARAMETER(p_vs_uuid);
+    *p_uuid_type = 2;       //BLE_UUID_TYPE_VENDOR_BEGIN
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_tx_buffer_count_get(uint8_t *p_count)
+{
+    *p_count = m_tx_buffers;
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_user_mem_reply(uint16_t conn_handle, const ble_user_mem_block_t *p_block)
+{
+    UNUSED_PARAMETER(conn_handle);
+    UNUSED_PARAMETER(p_block);
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, const ble_uuid_t *p_uuid, uint16_t *p_handle)
+{
+    UNUSED_PARAMETER(type);
+    UNUSED_PARAMETER(p_uuid);
+    if (m_next_handle >= ATTR_MAX) {
+        return NRF_ERROR_NO_MEM;
+    }
+    *p_handle = attr_add(NULL, 0, 0);
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, const ble_gatts_char_md_t *p_char_md,
+                                         const ble_gatts_attr_t *p_attr_char_value, ble_gatts_char_handles_t *p_handles)
+{
+    const ble_gatts_attr_md_t *p_md = p_attr_char_value->p_attr_md;
+    uint8_t *p_value = p_attr_char_value->p_value;
+
+    UNUSED_PARAMETER(service_handle);
+    memset(p_handles, 0, sizeof(*p_handles));
+    //Declaration, Value, CCCD, User Description
+    if (m_next_handle + 4 > ATTR_MAX) {
+        return NRF_ERROR_NO_MEM;
+    }
+
+    //Declaration
+    (void)attr_add(NULL, 0, 0);
+
+    //Value
+    if (p_md->vloc == BLE_GATTS_VLOC_STACK) {
+        if (m_pool_used + p_attr_char_value->max_len > STACK_POOL_LEN) {
+            return NRF_ERROR_NO_MEM;
+        }
+        p_value = &m_pool[m_pool_used];
+        m_pool_used += p_attr_char_value->max_len;
+        if (p_attr_char_value->p_value != NULL) {
+            memcpy(p_value, p_attr_char_value->p_value, p_attr_char_value->init_len);
+        }
+    }
+    p_handles->value_handle = attr_add(p_value, p_attr_char_value->init_len, p_attr_char_value->max_len);
+
+    //CCCD
+    if (p_char_md->char_props.notify) {
+        if (m_pool_used + BLE_CCCD_VALUE_LEN > STACK_POOL_LEN) {
+            return NRF_ERROR_NO_MEM;
+        }
+        p_handles->cccd_handle = attr_add(&m_pool[m_pool_used], BLE_CCCD_VALUE_LEN, BLE_CCCD_VALUE_LEN);
+        memset(&m_pool[m_pool_used], 0, BLE_CCCD_VALUE_LEN);
+        m_pool_used += BLE_CCCD_VALUE_LEN;
+        m_attr[p_handles->value_handle].cccd_handle = p_handles->cccd_handle;
+    }
+
+    //User Description
+    if (p_char_md->p_char_user_desc != NULL) {
+        p_handles->user_desc_handle = attr_add(NULL, 0, 0);
+    }
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, const ble_gatts_hvx_params_t *p_hvx_params)
+{
+    const attr_t *p_attr;
+    packet_t *p_pkt;
+    uint16_t len;
+
+    m_stat.hvx++;
+    if ((conn_handle == BLE_CONN_HANDLE_INVALID) || (conn_handle != m_conn_handle)) {
+        return BLE_ERROR_INVALID_CONN_HANDLE;
+    }
+    if ((p_hvx_params->handle == 0) || (p_hvx_params->handle >= m_next_handle)) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_attr = &m_attr[p_hvx_params->handle];
+    if ((p_attr->cccd_handle == 0) ||
+      !ble_srv_is_notification_enabled(m_attr[p_attr->cccd_handle].p_value)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (m_tx_cnt >= m_tx_buffers) {
+        m_stat.no_tx_buffers++;
+        return BLE_ERROR_NO_TX_BUFFERS;
+    }
+
+    len = MIN(*p_hvx_params->p_len, PACKET_LEN);
+    p_pkt = &m_tx[m_tx_cnt++];
+    p_pkt->handle = p_hvx_params->handle;
+    p_pkt->len = len;
+    memcpy(p_pkt->data, p_hvx_params->p_data, len);
+    if (m_tx_cnt > m_stat.in_flight_max) {
+        m_stat.in_flight_max = m_tx_cnt;
+    }
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_value_set(uint16_t handle, uint16_t offset, uint16_t *p_len, const uint8_t *p_value)
+{
+    attr_t *p_attr;
+
+    if ((handle == 0) || (handle >= m_next_handle) || (m_attr[handle].p_value == NULL)) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    p_attr = &m_attr[handle];
+    if (offset >= p_attr->max_len) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    *p_len = MIN(*p_len, p_attr->max_len - offset);
+    memcpy(p_attr->p_value + offset, p_value, *p_len);
+    p_attr->len = offset + *p_len;
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_value_get(uint16_t handle, uint16_t offset, uint16_t *p_len, uint8_t *p_data)
+{
+    const attr_t *p_attr;
+
+    if ((handle == 0) || (handle >= m_next_handle) || (m_attr[handle].p_value == NULL)) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    p_attr = &m_attr[handle];
+    if (offset > p_attr->len) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    *p_len = MIN(*p_len, p_attr->len - offset);
+    memcpy(p_data, p_attr->p_value + offset, *p_len);
+    return NRF_SUCCESS;
+}
+
+
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle, const ble_gatts_rw_authorize_reply_params_t *p_rw_authorize_reply_params)
+{
+    if (conn_handle != m_conn_handle) {
+        return BLE_ERROR_INVALID_CONN_HANDLE;
+    }
+    //許可されたWrite Requestは値を書き換える
+    if ((p_rw_authorize_reply_params->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+      (p_rw_authorize_reply_params->params.write.gatt_status == BLE_GATT_STATUS_SUCCESS) &&
+      (m_auth_write.handle != BLE_GATT_HANDLE_INVALID)) {
+        uint16_t len = m_auth_write.len;
+
+        (void)sd_ble_gatts_value_set(m_auth_write.handle, m_auth_write.offset, &len, m_auth_write.data);
+    }
+    m_auth_write.handle = BLE_GATT_HANDLE_INVALID;
+    return NRF_SUCCESS;
+}
+
+
+bool ble_srv_is_notification_enabled(uint8_t *p_encoded_data)
+{
+    uint16_t cccd = (uint16_t)(p_encoded_data[0] | (p_encoded_data[1] << 8));
+    return (cccd & BLE_GATT_HVX_NOTIFICATION) != 0;
+}
+
+
+uint32_t app_timer_cnt_get(uint32_t *p_ticks)
+{
+    *p_ticks = m_clock & CLOCK_MASK;
+    return NRF_SUCCESS;
+}
+
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from, uint32_t *p_ticks_diff)
+{
+    *p_ticks_diff = (ticks_to - ticks_from) & CLOCK_MASK;
+    return NRF_SUCCESS;
+}
+
+
+/**************************************************************************
+ * private function
+ **************************************************************************/
+
+static uint16_t attr_add(uint8_t *p_value, uint16_t len, uint16_t max_len)
+{
+    uint16_t handle = m_next_handle++;
+
+    m_attr[handle].p_value = p_value;
+    m_attr[handle].len = len;
+    m_attr[handle].max_len = max_len;
+    m_attr[handle].cccd_handle = 0;
+    return handle;
+}
+
+
+static ble_evt_t *evt_make(uint16_t evt_id)
+{
+    memset(&m_evt, 0, sizeof(m_evt));
+    m_evt.evt.header.evt_id = evt_id;
+    m_evt.evt.header.evt_len = sizeof(ble_evt_t);
+    return &m_evt.evt;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file    fakesd.h
+ * @brief   PC上でble_fps.cを動かすための偽SoftDevice
+ *
+ * ble_fps.cが呼ぶsd_xxx()とapp_timerをPC上で真似る。
+ *
+ *  - キャラクタリスティックはハンドルを順に割り当て、値(VLOC_STACK)とCCCDを覚える
+ *  - sd_ble_gatts_hvx()はTXバッファ(fakesd_reset()で指定した数)に積むだけで、
+ *    fakesd_conn_event()で空中に出る(fakesd_air_get()で順に取り出せる)
+ *  - TXバッファが埋まっているとBLE_ERROR_NO_TX_BUFFERSを返す
+ *  - app_timer_cnt_get()はfakesd_tick()で進む時計(24bit)
+ *
+ * イベントはfakesd_evt_xxx()で作り、ble_fps_on_ble_evt()に渡す。
+ * 作ったイベントは次のfakesd_evt_xxx()まで有効。
+ *
+ * host/のSDK代替ヘッダでビルドする :
+ *   gcc -std=gnu99 -Iservices -Iservices/sim -Iservices/sim/host services/ble_fps.c services/sim/fakesd.c (テスト)
+ */
+
+#ifndef FAKESD_H__
+#define FAKESD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+
+
+#define FAKESD_CONN_HANDLE      (0x0010)        ///< 接続時のconn_handle
+
+
+/** 統計 */
+typedef struct fakesd_stat_t {
+    uint32_t    hvx;                ///< sd_ble_gatts_hvx()の呼出し数
+    uint32_t    no_tx_buffers;      ///< BLE_ERROR_NO_TX_BUFFERSを返した数
+    uint32_t    conn_events;        ///< fakesd_conn_event()で1パケット以上出した数
+    uint32_t    air_packets;        ///< 空中に出たパケット数
+    uint8_t     in_flight_max;      ///< TXバッファに積まれた最大数
+} fakesd_stat_t;
+
+
+/**
+ * @brief 初期化
+ *
+ * 属性、TXバッファ、空中のパケット、時計、統計を消す。
+ *
+ * @param[in]   tx_buffers  TXバッファ数(sd_ble_tx_buffer_count_get()の値)
+ */
+void fakesd_reset(uint8_t tx_buffers);
+
+
+/**
+ * @brief 時計を進める
+ *
+ * @param[in]   ticks       進める時間[32768Hz]
+ */
+void fakesd_tick(uint32_t ticks);
+
+
+/**
+ * @brief Connectionイベント
+ *
+ * TXバッファのパケットをすべて空中に出す。
+ * 出した数をfakesd_evt_tx_complete()に渡すこと。
+ *
+ * @return      出したパケット数
+ */
+uint8_t fakesd_conn_event(void);
+
+
+/**
+ * @brief 空中に出たパケットの取出し
+ *
+ * @param[out]  p_handle    ハンドル(NULL可)
+ * @param[out]  p_data      データ(FPS_PACKET_LEN byte以上)
+ * @return      長さ(無ければ0)
+ */
+uint16_t fakesd_air_get(uint16_t *p_handle, uint8_t *p_data);
+
+
+/**
+ * @brief TXバッファに積まれている数
+ *
+ * @return      パケット数
+ */
+uint8_t fakesd_in_flight(void);
+
+
+/**
+ * @brief 統計の取得
+ *
+ * @param[out]  p_stat      統計
+ */
+void fakesd_stat_get(fakesd_stat_t *p_stat);
+
+
+/**
+ * @brief BLE_GAP_EVT_CONNECTED作成
+ *
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_connected(void);
+
+
+/**
+ * @brief BLE_GAP_EVT_DISCONNECTED作成
+ *
+ * TXバッファと空中のパケットは捨てる。
+ *
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_disconnected(void);
+
+
+/**
+ * @brief BLE_GATTS_EVT_WRITE作成
+ *
+ * SoftDeviceと同じく、先に属性の値(CCCDを含む)を書き換えておく。
+ *
+ * @param[in]   handle      ハンドル
+ * @param[in]   p_data      データ
+ * @param[in]   len         データ長
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_write(uint16_t handle, const uint8_t *p_data, uint16_t len);
+
+
+/**
+ * @brief BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST(Read)作成
+ *
+ * 許可すると(update=0)、属性の値がoffsetから返される。
+ *
+ * @param[in]   handle      ハンドル
+ * @param[in]   offset      offset
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_authorize_read(uint16_t handle, uint16_t offset);
+
+
+/**
+ * @brief BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST(Write Request)作成
+ *
+ * SoftDeviceと同じく、sd_ble_gatts_rw_authorize_reply()で許可されたときに属性の値を書き換える。
+ *
+ * @param[in]   handle      ハンドル
+ * @param[in]   p_data      データ
+ * @param[in]   len         データ長
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_authorize_write(uint16_t handle, const uint8_t *p_data, uint16_t len);
+
+
+/**
+ * @brief BLE_EVT_TX_COMPLETE作成
+ *
+ * @param[in]   count       送信できたパケット数
+ * @return      イベント
+ */
+ble_evt_t *fakesd_evt_tx_complete(uint8_t count);
+
+#endif /* FAKESD_H__ */
@@ -0,0 +1,18 @@
+/** host stand-in of app_timer.h for the fake SoftDevice build
+ *
+ * @file    app_timer.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * app_timer_cnt_get() returns the clock of the fake SoftDevice(FAKESD_tick()).
+ */
+
+#ifndef APP_TIMER_H__
+#define APP_TIMER_H__
+
+#include <stdint.h>
+
+uint32_t app_timer_cnt_get(uint32_t *p_ticks);
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from, uint32_t *p_ticks_diff);
+
+#endif /* APP_TIMER_H__ */
@@ -0,0 +1,15 @@
+/** host stand-in of app_trace.h for the fake SoftDevice build
+ *
+ * @file    app_trace.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Logs are dropped so the test output stays readable.
+ */
+
+#ifndef APP_TRACE_H__
+#define APP_TRACE_H__
+
+#define app_trace_log(...)          ((void)0)
+
+#endif /* APP_TRACE_H__ */
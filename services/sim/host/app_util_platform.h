@@ -0,0 +1,16 @@
+/** host stand-in of app_util_platform.h for the fake SoftDevice build
+ *
+ * @file    app_util_platform.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * The tests run in one thread, so a critical region is only a block.
+ */
+
+#ifndef APP_UTIL_PLATFORM_H__
+#define APP_UTIL_PLATFORM_H__
+
+#define CRITICAL_REGION_ENTER()     {
+#define CRITICAL_REGION_EXIT()      }
+
+#endif /* APP_UTIL_PLATFORM_H__ */
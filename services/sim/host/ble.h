@@ -0,0 +1,69 @@
+/** host stand-in of ble.h for the fake SoftDevice build
+ *
+ * @file    ble.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Only what ble_fps.c uses. Values are the same as S110.
+ */
+
+#ifndef BLE_H__
+#define BLE_H__
+
+#include <stdint.h>
+#include "nrf_error.h"
+#include "ble_types.h"
+#include "ble_gap.h"
+#include "ble_gatts.h"
+
+#define BLE_ERROR_INVALID_CONN_HANDLE   (0x3002)
+#define BLE_ERROR_NO_TX_BUFFERS         (0x3004)
+
+enum {
+    BLE_EVT_TX_COMPLETE                 = 0x01,
+    BLE_EVT_USER_MEM_REQUEST            = 0x02,
+    BLE_GAP_EVT_CONNECTED               = 0x10,
+    BLE_GAP_EVT_DISCONNECTED            = 0x11,
+    BLE_GAP_EVT_CONN_SEC_UPDATE         = 0x18,
+    BLE_GATTS_EVT_WRITE                 = 0x50,
+    BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST  = 0x51,
+    BLE_GATTS_EVT_SYS_ATTR_MISSING      = 0x52,
+};
+
+
+typedef struct {
+    uint16_t    evt_id;
+    uint16_t    evt_len;
+} ble_evt_hdr_t;
+
+typedef struct {
+    uint8_t     count;
+} ble_evt_tx_complete_t;
+
+typedef struct {
+    uint16_t    conn_handle;
+    union {
+        ble_evt_tx_complete_t   tx_complete;
+    } params;
+} ble_common_evt_t;
+
+typedef struct {
+    ble_evt_hdr_t   header;
+    union {
+        ble_common_evt_t    common_evt;
+        ble_gap_evt_t       gap_evt;
+        ble_gatts_evt_t     gatts_evt;
+    } evt;
+} ble_evt_t;
+
+typedef struct {
+    uint8_t     *p_mem;
+    uint16_t    len;
+} ble_user_mem_block_t;
+
+
+uint32_t sd_ble_uuid_vs_add(const ble_uuid128_t *p_vs_uuid, uint8_t *p_uuid_type);
+uint32_t sd_ble_tx_buffer_count_get(uint8_t *p_count);
+uint32_t sd_ble_user_mem_reply(uint16_t conn_handle, const ble_user_mem_block_t *p_block);
+
+#endif /* BLE_H__ */
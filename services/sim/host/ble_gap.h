@@ -0,0 +1,25 @@
+/** host stand-in of ble_gap.h for the fake SoftDevice build
+ *
+ * @file    ble_gap.h
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#ifndef BLE_GAP_H__
+#define BLE_GAP_H__
+
+#include <stdint.h>
+
+#define BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(ptr)    do { (ptr)->sm = 0; (ptr)->lv = 0; } while (0)
+#define BLE_GAP_CONN_SEC_MODE_SET_OPEN(ptr)         do { (ptr)->sm = 1; (ptr)->lv = 1; } while (0)
+
+typedef struct {
+    uint8_t     sm : 4;
+    uint8_t     lv : 4;
+} ble_gap_conn_sec_mode_t;
+
+typedef struct {
+    uint16_t    conn_handle;
+} ble_gap_evt_t;
+
+#endif /* BLE_GAP_H__ */
@@ -0,0 +1,146 @@
+/** host stand-in of ble_gatts.h for the fake SoftDevice build
+ *
+ * @file    ble_gatts.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Only what ble_fps.c uses. Values are the same as S110.
+ */
+
+#ifndef BLE_GATTS_H__
+#define BLE_GATTS_H__
+
+#include <stdint.h>
+#include "ble_types.h"
+#include "ble_gap.h"
+
+#define BLE_GATTS_SRVC_TYPE_PRIMARY         (0x01)
+#define BLE_GATTS_VLOC_STACK                (0x01)
+#define BLE_GATTS_VLOC_USER                 (0x02)
+#define BLE_GATT_HVX_NOTIFICATION           (0x01)
+
+#define BLE_GATTS_AUTHORIZE_TYPE_READ       (0x01)
+#define BLE_GATTS_AUTHORIZE_TYPE_WRITE      (0x02)
+
+#define BLE_GATTS_OP_WRITE_REQ              (0x01)
+#define BLE_GATTS_OP_WRITE_CMD              (0x02)
+#define BLE_GATTS_OP_PREP_WRITE_REQ         (0x04)
+#define BLE_GATTS_OP_EXEC_WRITE_REQ_CANCEL  (0x05)
+#define BLE_GATTS_OP_EXEC_WRITE_REQ_NOW     (0x06)
+
+#define BLE_GATT_STATUS_SUCCESS                 (0x0000)
+#define BLE_GATT_STATUS_ATTERR_INVALID_OFFSET   (0x0107)
+
+
+typedef struct {
+    uint8_t     broadcast       : 1;
+    uint8_t     read            : 1;
+    uint8_t     write_wo_resp   : 1;
+    uint8_t     write           : 1;
+    uint8_t     notify          : 1;
+    uint8_t     indicate        : 1;
+    uint8_t     auth_signed_wr  : 1;
+} ble_gatt_char_props_t;
+
+typedef struct {
+    ble_gap_conn_sec_mode_t read_perm;
+    ble_gap_conn_sec_mode_t write_perm;
+    uint8_t                 vlen    : 1;
+    uint8_t                 vloc    : 2;
+    uint8_t                 rd_auth : 1;
+    uint8_t                 wr_auth : 1;
+} ble_gatts_attr_md_t;
+
+typedef struct {
+    ble_uuid_t              *p_uuid;
+    ble_gatts_attr_md_t     *p_attr_md;
+    uint16_t                init_len;
+    uint16_t                init_offs;
+    uint16_t                max_len;
+    uint8_t                 *p_value;
+} ble_gatts_attr_t;
+
+typedef struct {
+    ble_gatt_char_props_t   char_props;
+    uint8_t                 *p_char_user_desc;
+    uint16_t                char_user_desc_max_size;
+    uint16_t                char_user_desc_size;
+    ble_gatts_attr_md_t     *p_user_desc_md;
+    ble_gatts_attr_md_t     *p_cccd_md;
+    ble_gatts_attr_md_t     *p_sccd_md;
+} ble_gatts_char_md_t;
+
+typedef struct {
+    uint16_t    value_handle;
+    uint16_t    user_desc_handle;
+    uint16_t    cccd_handle;
+    uint16_t    sccd_handle;
+} ble_gatts_char_handles_t;
+
+typedef struct {
+    uint16_t    handle;
+    uint8_t     type;
+    uint16_t    offset;
+    uint16_t    *p_len;
+    uint8_t     *p_data;
+} ble_gatts_hvx_params_t;
+
+typedef struct {
+    uint16_t    handle;
+    uint8_t     op;
+    uint16_t    offset;
+    uint16_t    len;
+    uint8_t     data[1];        //!< variable length
+} ble_gatts_evt_write_t;
+
+typedef struct {
+    uint16_t    handle;
+    uint16_t    offset;
+} ble_gatts_evt_read_t;
+
+typedef struct {
+    uint8_t     type;
+    union {
+        ble_gatts_evt_read_t    read;
+        ble_gatts_evt_write_t   write;
+    } request;
+} ble_gatts_evt_rw_authorize_request_t;
+
+typedef struct {
+    uint16_t    gatt_status;
+    uint8_t     update : 1;
+    uint16_t    offset;
+    uint16_t    len;
+    uint8_t     *p_data;
+} ble_gatts_read_authorize_params_t;
+
+typedef struct {
+    uint16_t    gatt_status;
+} ble_gatts_write_authorize_params_t;
+
+typedef struct {
+    uint8_t     type;
+    union {
+        ble_gatts_read_authorize_params_t   read;
+        ble_gatts_write_authorize_params_t  write;
+    } params;
+} ble_gatts_rw_authorize_reply_params_t;
+
+typedef struct {
+    uint16_t    conn_handle;
+    union {
+        ble_gatts_evt_write_t                   write;
+        ble_gatts_evt_rw_authorize_request_t    authorize_request;
+    } params;
+} ble_gatts_evt_t;
+
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, const ble_uuid_t *p_uuid, uint16_t *p_handle);
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, const ble_gatts_char_md_t *p_char_md,
+                                         const ble_gatts_attr_t *p_attr_char_value, ble_gatts_char_handles_t *p_handles);
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, const ble_gatts_hvx_params_t *p_hvx_params);
+uint32_t sd_ble_gatts_value_set(uint16_t handle, uint16_t offset, uint16_t *p_len, const uint8_t *p_value);
+uint32_t sd_ble_gatts_value_get(uint16_t handle, uint16_t offset, uint16_t *p_len, uint8_t *p_data);
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle, const ble_gatts_rw_authorize_reply_params_t *p_rw_authorize_reply_params);
+
+#endif /* BLE_GATTS_H__ */
@@ -0,0 +1,20 @@
+/** host stand-in of ble_srv_common.h for the fake SoftDevice build
+ *
+ * @file    ble_srv_common.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * ble_srv_is_notification_enabled() is in fakesd.c.
+ */
+
+#ifndef BLE_SRV_COMMON_H__
+#define BLE_SRV_COMMON_H__
+
+#include <stdbool.h>
+#include "ble.h"
+
+#define BLE_CCCD_VALUE_LEN          (2)
+
+bool ble_srv_is_notification_enabled(uint8_t *p_encoded_data);
+
+#endif /* BLE_SRV_COMMON_H__ */
@@ -0,0 +1,25 @@
+/** host stand-in of ble_types.h for the fake SoftDevice build
+ *
+ * @file    ble_types.h
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#ifndef BLE_TYPES_H__
+#define BLE_TYPES_H__
+
+#include <stdint.h>
+
+#define BLE_CONN_HANDLE_INVALID     (0xFFFF)
+#define BLE_GATT_HANDLE_INVALID     (0x0000)
+
+typedef struct {
+    uint8_t     uuid128[16];
+} ble_uuid128_t;
+
+typedef struct {
+    uint16_t    uuid;
+    uint8_t     type;
+} ble_uuid_t;
+
+#endif /* BLE_TYPES_H__ */
@@ -0,0 +1,16 @@
+/** host stand-in of nordic_common.h for the fake SoftDevice build
+ *
+ * @file    nordic_common.h
+ * @author  hiro99ma
+ * @version 1.00
+ */
+
+#ifndef NORDIC_COMMON_H_
+#define NORDIC_COMMON_H_
+
+#define MIN(a, b)                   ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                   ((a) < (b) ? (b) : (a))
+#define UNUSED_PARAMETER(X)         ((void)(X))
+#define UNUSED_VARIABLE(X)          ((void)(X))
+
+#endif /* NORDIC_COMMON_H_ */
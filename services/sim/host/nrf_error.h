@@ -0,0 +1,21 @@
+/** host stand-in of nrf_error.h for the fake SoftDevice build
+ *
+ * @file    nrf_error.h
+ * @author  hiro99ma
+ * @version 1.00
+ *
+ * Values are the same as the SDK.
+ */
+
+#ifndef NRF_ERROR_H__
+#define NRF_ERROR_H__
+
+#define NRF_ERROR_BASE_NUM          (0x0)
+#define NRF_SUCCESS                 (NRF_ERROR_BASE_NUM + 0)
+#define NRF_ERROR_INTERNAL          (NRF_ERROR_BASE_NUM + 3)
+#define NRF_ERROR_NO_MEM            (NRF_ERROR_BASE_NUM + 4)
+#define NRF_ERROR_NOT_FOUND         (NRF_ERROR_BASE_NUM + 5)
+#define NRF_ERROR_INVALID_PARAM     (NRF_ERROR_BASE_NUM + 7)
+#define NRF_ERROR_INVALID_STATE     (NRF_ERROR_BASE_NUM + 8)
+
+#endif /* NRF_ERROR_H__ */
@@ -0,0 +1,538 @@
+/**
+ * @file    test_ble_fps.c
+ * @brief   ble_fps.cのテスト(偽SoftDevice)
+ *
+ * make -C services/sim test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "ble_fps.h"
+#include "fakesd.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            m_fails++; \
+        } \
+    } while (0)
+
+
+/** 組み立てたメッセージ */
+typedef struct msg_t {
+    uint8_t     type;
+    uint8_t     len;
+    uint8_t     data[FPS_MSG_MAX_LEN];
+} msg_t;
+
+
+static ble_fps_t    m_fps;
+static int          m_fails;
+static uint8_t      m_air_seq;      ///< 次に来るはずのシーケンス番号
+
+/** 一括転送 */
+static uint8_t      m_bulk_buf[64];
+static int          m_bulk_begins;  ///< write_begin_handlerの呼出し数
+static int          m_bulk_dones;   ///< bulk_handlerの呼出し数
+
+/** NDEF(アプリ側メモリ) */
+static uint8_t      m_ndef_value[64];
+static uint8_t      m_ndef_shadow[64];
+static int          m_ndef_writes;  ///< evt_handler_ndefの呼出し数
+
+
+/**************************************************************************
+ * helper
+ **************************************************************************/
+
+/**
+ * @brief 接続してREADのNotificationを許可する
+ *
+ * @param[in]   tx_buffers  TXバッファ数
+ */
+static void setup(uint8_t tx_buffers)
+{
+    static const uint8_t CCCD_NOTIFY[] = { 0x01, 0x00 };
+    ble_fps_init_t init;
+
+    fakesd_reset(tx_buffers);
+    memset(&init, 0, sizeof(init));
+    CHECK(ble_fps_init(&m_fps, &init) == NRF_SUCCESS);
+
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_connected());
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_read.cccd_handle,
+                                                CCCD_NOTIFY, sizeof(CCCD_NOTIFY)));
+    m_air_seq = 0;
+}
+
+
+/**
+ * @brief Connectionイベントを1回起こし、TX_COMPLETEを渡す
+ *
+ * @return      送信できたパケット数
+ */
+static uint8_t conn_event(void)
+{
+    uint8_t cnt = fakesd_conn_event();
+
+    if (cnt > 0) {
+        ble_fps_on_ble_evt(&m_fps, fakesd_evt_tx_complete(cnt));
+    }
+    return cnt;
+}
+
+
+/**
+ * @brief 空中に出たパケットから1メッセージを組み立てる
+ *
+ * シーケンス番号の連続と、先頭/最終フラグをCentralと同じように確認する。
+ *
+ * @param[out]  p_msg       メッセージ
+ * @retval      true        組み立てた
+ */
+static bool air_msg_get(msg_t *p_msg)
+{
+    uint8_t pkt[FPS_PACKET_LEN];
+    uint16_t handle;
+    uint16_t len;
+    uint16_t pos = 0;
+
+    for (;;) {
+        len = fakesd_air_get(&handle, pkt);
+        if (len == 0) {
+            return false;
+        }
+        CHECK(handle == m_fps.char_handle_read.value_handle);
+        CHECK((pkt[0] & FPS_HDR_SEQ_MASK) == (m_air_seq & FPS_HDR_SEQ_MASK));
+        m_air_seq++;
+
+        if (pkt[0] & FPS_HDR_FIRST) {
+            CHECK(pos == 0);
+            p_msg->type = pkt[1];
+            p_msg->len = pkt[2];
+            memcpy(p_msg->data, &pkt[FPS_HDR_FIRST_LEN], len - FPS_HDR_FIRST_LEN);
+            pos = len - FPS_HDR_FIRST_LEN;
+        }
+        else {
+            CHECK(pos > 0);
+            memcpy(&p_msg->data[pos], &pkt[FPS_HDR_NEXT_LEN], len - FPS_HDR_NEXT_LEN);
+            pos += len - FPS_HDR_NEXT_LEN;
+        }
+        if (pkt[0] & FPS_HDR_LAST) {
+            CHECK(pos == p_msg->len);
+            return true;
+        }
+    }
+}
+
+
+static void on_write_begin(ble_fps_t *p_fps, uint16_t offset, uint16_t length)
+{
+    //書き始める前に呼ばれる
+    CHECK(p_fps->bulk.pos == 0);
+    m_bulk_begins++;
+}
+
+
+static void on_bulk(ble_fps_t *p_fps, uint16_t offset, uint16_t length)
+{
+    m_bulk_dones++;
+}
+
+
+static void on_ndef(ble_fps_t *p_fps, const uint8_t *p_value, uint16_t length)
+{
+    //書き始める前に知らされている
+    CHECK(m_bulk_begins == m_ndef_writes + 1);
+    m_ndef_writes++;
+}
+
+
+/**
+ * @brief 一括転送のハンドラを登録して接続する
+ */
+static void setup_bulk(void)
+{
+    static const uint8_t CCCD_NOTIFY[] = { 0x01, 0x00 };
+    ble_fps_init_t init;
+
+    fakesd_reset(3);
+    memset(&init, 0, sizeof(init));
+    init.bulk_handler = on_bulk;
+    init.write_begin_handler = on_write_begin;
+    init.evt_handler_ndef = on_ndef;
+    init.p_ndef_value = m_ndef_value;
+    init.p_ndef_shadow = m_ndef_shadow;
+    init.ndef_value_len = sizeof(m_ndef_value);
+    CHECK(ble_fps_init(&m_fps, &init) == NRF_SUCCESS);
+    ble_fps_bulk_buffer_set(&m_fps, m_bulk_buf, sizeof(m_bulk_buf));
+
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_connected());
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_read.cccd_handle,
+                                                CCCD_NOTIFY, sizeof(CCCD_NOTIFY)));
+    memset(m_bulk_buf, 0, sizeof(m_bulk_buf));
+    memset(m_ndef_value, 0, sizeof(m_ndef_value));
+    memset(m_ndef_shadow, 0, sizeof(m_ndef_shadow));
+    m_bulk_begins = 0;
+    m_bulk_dones = 0;
+    m_ndef_writes = 0;
+    m_air_seq = 0;
+}
+
+
+/**
+ * @brief 一括転送のデータを書き込む
+ *
+ * @param[in]   idx         パケット番号
+ * @param[in]   p_data      データ
+ * @param[in]   len         データ長
+ */
+static void bulk_write(uint8_t idx, const uint8_t *p_data, uint16_t len)
+{
+    uint8_t pkt[FPS_PACKET_LEN];
+
+    pkt[0] = idx;
+    memcpy(&pkt[FPS_BULK_HDR_LEN], p_data, len);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, pkt, FPS_BULK_HDR_LEN + len));
+}
+
+
+/**************************************************************************
+ * test
+ **************************************************************************/
+
+/**
+ * 最大長のメッセージが、TXバッファを毎回埋めながら順番通りに届く
+ */
+static void test_pipeline(void)
+{
+    uint8_t data[FPS_MSG_MAX_LEN];
+    uint8_t counts[FPS_TX_QUEUE_LEN];
+    uint8_t events = 0;
+    uint8_t cnt;
+    uint16_t lp;
+    msg_t msg;
+    fakesd_stat_t stat;
+
+    setup(3);
+    for (lp = 0; lp < sizeof(data); lp++) {
+        data[lp] = (uint8_t)lp;
+    }
+
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_SUCCESS);
+    //TX_COMPLETEを待たずにTXバッファを埋める
+    CHECK(fakesd_in_flight() == 3);
+
+    while ((cnt = conn_event()) > 0) {
+        if (events < sizeof(counts)) {
+            counts[events] = cnt;
+        }
+        events++;
+    }
+
+    //14パケットを3,3,3,3,2で送る(途中のConnectionイベントでTXバッファが空かない)
+    CHECK(events == (FPS_MSG_PACKETS(FPS_MSG_MAX_LEN) + 2) / 3);
+    for (lp = 0; lp + 1 < events; lp++) {
+        CHECK(counts[lp] == 3);
+    }
+    fakesd_stat_get(&stat);
+    CHECK(stat.air_packets == FPS_MSG_PACKETS(FPS_MSG_MAX_LEN));
+    CHECK(stat.in_flight_max == 3);
+    CHECK(m_fps.tx_stat.packets == FPS_MSG_PACKETS(FPS_MSG_MAX_LEN));
+    CHECK(m_fps.tx_stat.errors == 0);
+
+    CHECK(air_msg_get(&msg));
+    CHECK(msg.type == FPS_MSG_RF_FRAME);
+    CHECK(msg.len == sizeof(data));
+    CHECK(memcmp(msg.data, data, sizeof(data)) == 0);
+    CHECK(!air_msg_get(&msg));
+}
+
+
+/**
+ * 入りきらないメッセージは丸ごと捨て、前後のメッセージは崩れない
+ */
+static void test_back_pressure(void)
+{
+    uint8_t data[FPS_MSG_MAX_LEN];
+    uint8_t small[4] = { 0x11, 0x22, 0x33, 0x44 };
+    msg_t msg;
+
+    setup(2);
+    memset(data, 0x5a, sizeof(data));
+
+    //14パケット積み、2パケット送出中 : 空きは4
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_SUCCESS);
+    CHECK(ble_fps_tx_free(&m_fps) == FPS_TX_QUEUE_LEN - (FPS_MSG_PACKETS(FPS_MSG_MAX_LEN) - 2));
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, 100) == NRF_ERROR_NO_MEM);
+    CHECK(m_fps.tx_stat.drops == 1);
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_BLK_DIFF, small, sizeof(small)) == NRF_SUCCESS);
+
+    while (conn_event() > 0) {
+    }
+
+    CHECK(air_msg_get(&msg));
+    CHECK((msg.type == FPS_MSG_RF_FRAME) && (msg.len == sizeof(data)));
+    CHECK(air_msg_get(&msg));
+    CHECK((msg.type == FPS_MSG_BLK_DIFF) && (msg.len == sizeof(small)));
+    CHECK(memcmp(msg.data, small, sizeof(small)) == 0);
+    CHECK(!air_msg_get(&msg));
+}
+
+
+/**
+ * Notification許可前と切断後は送らず、再接続後のメッセージは先頭から始まる
+ */
+static void test_state(void)
+{
+    uint8_t data[40];
+    msg_t msg;
+
+    fakesd_reset(3);
+    {
+        ble_fps_init_t init;
+
+        memset(&init, 0, sizeof(init));
+        CHECK(ble_fps_init(&m_fps, &init) == NRF_SUCCESS);
+    }
+    memset(data, 0xc3, sizeof(data));
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_ERROR_INVALID_STATE);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_connected());
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_ERROR_INVALID_STATE);
+
+    //送信途中で切断
+    setup(1);
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_SUCCESS);
+    CHECK(conn_event() == 1);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_disconnected());
+    CHECK(ble_fps_tx_free(&m_fps) == FPS_TX_QUEUE_LEN);
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_ERROR_INVALID_STATE);
+
+    //再接続
+    {
+        static const uint8_t CCCD_NOTIFY[] = { 0x01, 0x00 };
+
+        ble_fps_on_ble_evt(&m_fps, fakesd_evt_connected());
+        ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_read.cccd_handle,
+                                                    CCCD_NOTIFY, sizeof(CCCD_NOTIFY)));
+    }
+    m_air_seq = 0;
+    CHECK(ble_fps_send(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_SUCCESS);
+    while (conn_event() > 0) {
+    }
+    CHECK(air_msg_get(&msg));
+    CHECK((msg.type == FPS_MSG_RF_FRAME) && (msg.len == sizeof(data)));
+    CHECK(memcmp(msg.data, data, sizeof(data)) == 0);
+}
+
+
+/**
+ * 計測中に他のメッセージが混ざっても、送信数は計測データだけを数える
+ */
+static void test_bench_count(void)
+{
+    //[FIRST|LAST, seq0][BENCH_START][長さ2][1sec][下り]
+    static const uint8_t START[] = {
+        FPS_HDR_FIRST | FPS_HDR_LAST, FPS_MSG_BENCH_START, 2, 1, FPS_BENCH_MODE_TX
+    };
+    uint8_t diff[4] = { 0x01, 0x02, 0x00, 0xaa };
+    uint8_t pkt[FPS_PACKET_LEN];
+    uint8_t res[FPS_PACKET_LEN];
+    uint32_t bench_pkts = 0;
+    uint32_t bench_events = 0;
+    uint32_t other_pkts = 0;
+    uint32_t tx_packets;
+    uint8_t last_type = 0;
+    bool active;
+    bool got_result = false;
+    uint16_t lp;
+
+    setup(3);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, START, sizeof(START)));
+    CHECK(m_fps.bench.active);
+
+    for (lp = 0; lp < 200; lp++) {
+        uint8_t cnt;
+        uint8_t in_event = 0;
+
+        fakesd_tick(2000);
+        if ((lp % 2) == 0) {
+            //計測中のRFイベント
+            (void)ble_fps_send(&m_fps, FPS_MSG_BLK_DIFF, diff, sizeof(diff));
+        }
+
+        active = m_fps.bench.active;
+        cnt = fakesd_conn_event();
+        if (cnt == 0) {
+            break;
+        }
+        while (fakesd_air_get(NULL, pkt) > 0) {
+            if (pkt[0] & FPS_HDR_FIRST) {
+                last_type = pkt[1];
+                if (last_type == FPS_MSG_BENCH_RESULT) {
+                    memcpy(res, &pkt[FPS_HDR_FIRST_LEN], FPS_PACKET_LEN - FPS_HDR_FIRST_LEN);
+                    got_result = true;
+                }
+            }
+            if (last_type == FPS_MSG_BENCH_DATA) {
+                in_event++;
+            }
+            else if (last_type == FPS_MSG_BLK_DIFF) {
+                other_pkts++;
+            }
+        }
+        if (active && (in_event > 0)) {
+            bench_pkts += in_event;
+            bench_events++;
+        }
+        ble_fps_on_ble_evt(&m_fps, fakesd_evt_tx_complete(cnt));
+    }
+
+    CHECK(!m_fps.bench.active);
+    CHECK(got_result);
+    CHECK(other_pkts > 0);
+    CHECK(m_fps.bench.tx_packets == bench_pkts);
+    CHECK(m_fps.bench.tx_events == bench_events);
+    tx_packets = (uint32_t)res[11] | ((uint32_t)res[12] << 8) |
+                    ((uint32_t)res[13] << 16) | ((uint32_t)res[14] << 24);
+    CHECK(tx_packets == bench_pkts);
+}
+
+
+/**
+ * 一括転送は書き始める前にwrite_begin_handler、書き終わってからbulk_handlerを呼ぶ
+ */
+static void test_bulk(void)
+{
+    //[FIRST|LAST, seq0][BULK_START][長さ4][offset=8][length=40]
+    static const uint8_t START[] = {
+        FPS_HDR_FIRST | FPS_HDR_LAST, FPS_MSG_BULK_START, 4, 8, 0, 40, 0
+    };
+    uint8_t data[40];
+    const uint16_t PKT = FPS_PACKET_LEN - FPS_BULK_HDR_LEN;
+
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (uint8_t)(0x80 + i);
+    }
+    setup_bulk();
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, START, sizeof(START)));
+    CHECK(m_fps.bulk.active);
+    CHECK(m_bulk_begins == 1);
+
+    bulk_write(0, &data[0], PKT);
+    bulk_write(1, &data[PKT], PKT);
+    CHECK(m_bulk_dones == 0);
+    bulk_write(2, &data[PKT * 2], sizeof(data) - PKT * 2);
+    CHECK(!m_fps.bulk.active);
+    CHECK(m_bulk_begins == 1);
+    CHECK(m_bulk_dones == 1);
+    CHECK(memcmp(&m_bulk_buf[8], data, sizeof(data)) == 0);
+}
+
+
+/**
+ * ble_fps_queue()はSoftDeviceを呼ばず、ble_fps_tx_flush()で送出する
+ */
+static void test_queue(void)
+{
+    uint8_t data[40];
+    fakesd_stat_t stat;
+    msg_t msg;
+
+    memset(data, 0x5c, sizeof(data));
+    setup(3);
+    CHECK(ble_fps_queue(&m_fps, FPS_MSG_RF_FRAME, data, sizeof(data)) == NRF_SUCCESS);
+    fakesd_stat_get(&stat);
+    CHECK(stat.hvx == 0);
+    CHECK(fakesd_in_flight() == 0);
+
+    ble_fps_tx_flush(&m_fps);
+    CHECK(fakesd_in_flight() == FPS_MSG_PACKETS(sizeof(data)));
+    while (conn_event() > 0) {
+    }
+    CHECK(air_msg_get(&msg));
+    CHECK((msg.type == FPS_MSG_RF_FRAME) && (msg.len == sizeof(data)));
+    CHECK(memcmp(msg.data, data, sizeof(data)) == 0);
+}
+
+
+/**
+ * 受信が進まない一括転送は中断され、BULK_STARTを送り直せる
+ */
+static void test_bulk_abort(void)
+{
+    //[FIRST|LAST, seq0][BULK_START][長さ4][offset=0][length=40]
+    static const uint8_t START[] = {
+        FPS_HDR_FIRST | FPS_HDR_LAST, FPS_MSG_BULK_START, 4, 0, 0, 40, 0
+    };
+    uint8_t data[FPS_PACKET_LEN - FPS_BULK_HDR_LEN];
+
+    memset(data, 0x33, sizeof(data));
+    setup_bulk();
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, START, sizeof(START)));
+    bulk_write(0, data, sizeof(data));
+    CHECK(m_fps.bulk.pkt_idx == 1);
+
+    //時間内は一括転送のデータとして扱う(受信済みの再送として捨てる)
+    fakesd_tick(FPS_BULK_IDLE_TIMEOUT * 32768 - 1);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, START, sizeof(START)));
+    CHECK(m_fps.bulk.active);
+    CHECK(m_fps.bulk.dups == 1);
+    CHECK(m_bulk_begins == 1);
+
+    //捨てたパケットでは時刻が進まないので中断され、BULK_STARTから始め直す
+    fakesd_tick(1);
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_write(m_fps.char_handle_write.value_handle, START, sizeof(START)));
+    CHECK(m_fps.bulk.aborts == 1);
+    CHECK(m_fps.bulk.active);
+    CHECK(m_fps.bulk.pkt_idx == 0);
+    CHECK(m_bulk_begins == 2);
+    CHECK(m_bulk_dones == 0);
+}
+
+
+/**
+ * NDEFの値へはSoftDeviceが直接書かず、書込み開始を知らせてから写す
+ */
+static void test_ndef(void)
+{
+    static const uint8_t DATA[] = { 0x10, 0x20, 0x30, 0x40 };
+    setup_bulk();
+
+    //Write : 受け側ではなく値に写る
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_authorize_write(m_fps.char_handle_ndef.value_handle, DATA, sizeof(DATA)));
+    CHECK(m_bulk_begins == 1);
+    CHECK(m_ndef_writes == 1);
+    CHECK(memcmp(m_ndef_value, DATA, sizeof(DATA)) == 0);
+
+    //Read : RFが書き換えた値が受け側に写ってから返る
+    m_ndef_value[40] = 0x5a;
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_authorize_read(m_fps.char_handle_ndef.value_handle, 32));
+    CHECK(m_ndef_shadow[40] == 0x5a);
+
+    //範囲外はブロック窓の統計に入れない
+    ble_fps_on_ble_evt(&m_fps, fakesd_evt_authorize_read(m_fps.char_handle_ndef.value_handle, sizeof(m_ndef_value) + 1));
+    CHECK(m_fps.block_stat.rejects == 0);
+    CHECK(m_ndef_writes == 1);
+}
+
+
+int main(void)
+{
+    test_pipeline();
+    test_back_pressure();
+    test_state();
+    test_bench_count();
+    test_queue();
+    test_bulk();
+    test_bulk_abort();
+    test_ndef();
+
+    if (m_fails != 0) {
+        printf("test_ble_fps: %d failed\n", m_fails);
+        return 1;
+    }
+    printf("test_ble_fps: ok\n");
+    return 0;
+}
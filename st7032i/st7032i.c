@@ -8,6 +8,7 @@
 #include "st7032i.h"
 #include "twi_master.h"
 #include "nrf_delay.h"
+#include "app_util_platform.h"
 
 
 #define I2C_SLV_ADDR            (0x7c)      //Slave Address(8bit)
@@ -141,6 +142,9 @@ void ST7032I_writeString(const char *pStr)
 /**
  * ST7032iへの出力
  *
+ * I2CはRC-S730と共有しており、RC-S730は割込みからアクセスするので、
+ * 転送中だけ割込みを禁止する(待ち時間は禁止しない)。
+ *
  * @param[in]   ctrl    コントロールバイト
  * @param[in]   data    データ
  * @param[in]   usec    待ち時間[usec]
@@ -152,7 +156,9 @@ static int write_lcd(uint8_t ctrl, uint8_t data, uint32_t usec)
 
     buf[0] = ctrl;
     buf[1] = data;
+    CRITICAL_REGION_ENTER();
     ret = twi_master_transfer(I2C_SLV_ADDR, buf, (uint8_t)sizeof(buf), true);
+    CRITICAL_REGION_EXIT();
     nrf_delay_us(usec);
 
     return (ret) ? 0 : -1;